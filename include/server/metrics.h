@@ -0,0 +1,103 @@
+#ifndef INCLUDE_SERVER_METRICS_H_
+#define INCLUDE_SERVER_METRICS_H_
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+namespace singa {
+/**
+ * Latency histogram with power-of-2 buckets in microseconds.
+ */
+class Histogram{
+ public:
+  Histogram();
+  void Add(int64_t usecs);
+  void Merge(const Histogram& other);
+  /**
+   * @return upper bound (us) of the bucket containing the p-th percentile.
+   */
+  int64_t Percentile(float p) const;
+  int64_t count() const{
+    return count_;
+  }
+  /**
+   * @return mean latency in us
+   */
+  float mean() const{
+    return count_?1.0f*sum_/count_:0.f;
+  }
+  string ToString() const;
+
+ protected:
+  static const int kNumBuckets=32;
+  int64_t buckets_[kNumBuckets];
+  int64_t count_, sum_;
+};
+
+/**
+ * Counters of requests for one Param or from one worker.
+ */
+struct RequestStats{
+  int64_t nmsgs=0, nbytes=0;
+  //!< time in queue, i.e., waiting for the Param to be available
+  Histogram wait;
+  //!< time of handling the request, e.g., applying sync or update
+  Histogram apply;
+  void Merge(const RequestStats& other);
+};
+
+/**
+ * Metrics of one server process, i.e., throughput and latency of requests
+ * per Param and per worker, and queue depth per stripe.
+ *
+ * Each server thread records into its own shard to avoid contention; the
+ * shards are merged and dumped periodically by the router thread.
+ */
+class ServerMetrics{
+ public:
+  /**
+   * @param nshards one shard per server thread
+   * @param nstripes num of request queues
+   * @param path file to append the metrics
+   * @param period dump period in seconds, 0 for disabling the metrics
+   */
+  ServerMetrics(int nshards, int nstripes, const string& path, int period);
+  bool enabled() const{
+    return period_>0;
+  }
+  /**
+   * record one handled request.
+   */
+  void Record(int shard, int paramid, const string& worker, size_t bytes,
+      int64_t wait, int64_t apply);
+  /**
+   * record the queue depth of a stripe after a request is queued.
+   */
+  void RecordQueue(int stripe, size_t depth);
+  /**
+   * dump and reset the metrics if the period has passed since last dump.
+   */
+  void DumpIfDue();
+
+ protected:
+  struct Shard{
+    std::mutex mtx;
+    std::map<int, RequestStats> params;
+    std::map<string, RequestStats> workers;
+  };
+  void Dump(float seconds);
+
+ protected:
+  vector<Shard> shards_;
+  std::mutex queue_mtx_;
+  //!< max queue depth per stripe since last dump
+  vector<size_t> max_depth_;
+  string path_;
+  int period_;
+  int64_t last_dump_;
+};
+} /* singa */
+#endif // INCLUDE_SERVER_METRICS_H_
@@ -1,16 +1,114 @@
 #ifndef INCLUDE_SERVER_SERVER_H_
 #define INCLUDE_SERVER_SERVER_H_
-#include "utils/cluster.h"
+#include <czmq.h>
 #include <memory>
+#include <map>
+#include <set>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "utils/cluster.h"
+#include "utils/param.h"
+#include "utils/updater.h"
+#include "server/metrics.h"
 using std::shared_ptr;
 namespace singa {
+/**
+ * Get/Sync/Update request from a worker, queued until a server thread handles it.
+ */
+struct ServerRequest{
+  int type;
+  int paramid;
+  //!< identity of the worker that sent the request
+  zframe_t* identity;
+  zmsg_t* msg;
+  //!< time (us) when the request is queued
+  int64_t arrival;
+};
+
+/**
+ * A stripe of the parameter store.
+ *
+ * Params are striped across server threads by id. Each stripe has its own
+ * request queue. One Param is updated by at most one thread at a time, which
+ * is tracked by the busy set.
+ */
+struct ParamStripe{
+  std::mutex mtx;
+  std::map<int, shared_ptr<Param>> params;
+  std::list<ServerRequest> requests;
+  std::set<int> busy;
+  //!< workers waiting for the aggregated update of each Param
+  std::map<int, vector<zframe_t*>> waiting;
+};
+
 class Server{
  public:
-  explicit Server(shared_ptr<Cluster> cluster);
+  /**
+   * @param updater the Updater is run by the server if
+   * UpdaterProto::update_on_server is true.
+   */
+  Server(shared_ptr<Cluster> cluster, const UpdaterProto& updater);
   void Run();
 
+ protected:
+  /**
+   * Main function of a server thread.
+   * It handles requests from its own stripe and steals requests from other
+   * stripes when its own queue is empty.
+   * @param sid id of the stripe owned by this thread
+   */
+  void ServeStripe(int sid);
+  /**
+   * Pop one request whose Param exists and is not being updated.
+   * The Param is marked busy until ReleaseParam is called.
+   * @return false if no such request in this stripe.
+   */
+  bool PopRequest(ParamStripe* stripe, ServerRequest* req);
+  void ReleaseParam(ParamStripe* stripe, int paramid);
+  /**
+   * queue a request to the stripe of its Param and wake up idle threads.
+   */
+  void PushRequest(const ServerRequest& req);
+  /**
+   * @return true if all stripes have no pending or running requests.
+   */
+  bool Idle();
+  /**
+   * Accumulate gradients from one worker; apply the Updater and reply fresh
+   * weights to all waiting workers after receiving nupdates_ gradients.
+   */
+  void HandleUpdate(ParamStripe* stripe, shared_ptr<Param> param,
+      ServerRequest* req, zsock_t* pipe);
+  /**
+   * Dispatch one (unbatched) msg from a worker.
+   * @return 1 if it is a kStop msg, otherwise 0.
+   */
+  int HandleMsg(zframe_t* identity, zmsg_t* msg);
+  /**
+   * Forward replies of server threads that are ready to workers; replies to
+   * one worker are batched up to Cluster::largest_message bytes.
+   */
+  void ForwardReplies(zsock_t* replies, zsock_t* router);
+  ParamStripe* stripe(int paramid){
+    return stripes_[paramid%stripes_.size()].get();
+  }
+
  protected:
   shared_ptr<Cluster> cluster_;
+  shared_ptr<Updater> updater_;
+  //!< num of gradients aggregated for one update, one per group if
+  //!< synchronous, otherwise 1
+  int nupdates_;
+  vector<shared_ptr<ParamStripe>> stripes_;
+  shared_ptr<ServerMetrics> metrics_;
+  //!< guards events_ and running_, idle server threads wait on cv_
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  //!< inc by 1 when a request is queued or a Param is released
+  int64_t events_;
+  bool running_;
 };
 } /* Server */
 #endif //INCLUDE_SERVER_SERVER_H_
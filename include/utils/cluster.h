@@ -42,6 +42,7 @@ class Cluster {
   int nprocs_per_group()const {return cluster_.nprocs_per_group();}
   int nthreads_per_procs()const{return cluster_.nthreads_per_procs();}
   int nthreads_per_server()const{return cluster_.nthreads_per_server();}
+  int nupdaters_per_procs()const{return cluster_.nupdaters_per_procs();}
   int global_procsid()const {return global_procsid_;}
   /**
    * Return the id of the worker thread within his group.
@@ -98,7 +99,28 @@ class Cluster {
   const string visualization_folder(){
     return cluster_.workspace()+"/"+cluster_.vis_subfolder();
   }
+  const string log_folder(){
+    return cluster_.workspace()+"/"+cluster_.log_subfolder();
+  }
+  /**
+   * period (seconds) of dumping server metrics, 0 if disabled
+   */
+  int metrics_period() const {
+    return cluster_.metrics_period();
+  }
 
+  /**
+   * size limit (Bytes) of batched msgs.
+   */
+  int largest_message() const {
+    return cluster_.largest_message();
+  }
+  /**
+   * max delay (ms) of batched msgs.
+   */
+  int flush_window() const {
+    return cluster_.flush_window();
+  }
   /**
    * bandwidth MB/s
    */
@@ -0,0 +1,31 @@
+#ifndef INCLUDE_UTILS_CODEC_H_
+#define INCLUDE_UTILS_CODEC_H_
+#include <cstddef>
+#include "proto/model.pb.h"
+
+namespace singa {
+/**
+ * Encoding of float payloads on the wire, i.e., for sync messages.
+ *
+ * kFloat16 and kBFloat16 keep 2 bytes per float; kInt8 keeps 1 byte per float
+ * plus one float scale per block of kInt8Block floats (absmax/127). The
+ * kernels use AVX2/F16C if the CPU supports them (checked at runtime),
+ * otherwise scalar code with the same rounding (to nearest even).
+ */
+typedef UpdaterProto::WireFormat WireFormat;
+const int kInt8Block=256;
+
+/**
+ * @return num of bytes of count floats encoded in format fmt.
+ */
+size_t EncodedSize(WireFormat fmt, int count);
+/**
+ * encode count floats from src into dst of EncodedSize(fmt, count) bytes.
+ */
+void Encode(WireFormat fmt, const float* src, int count, void* dst);
+/**
+ * decode count floats from src into dst.
+ */
+void Decode(WireFormat fmt, const void* src, int count, float* dst);
+} /* singa */
+#endif // INCLUDE_UTILS_CODEC_H_
@@ -7,14 +7,10 @@
 #include <czmq.h>
 #include "proto/model.pb.h"
 #include "utils/blob.h"
+#include "utils/codec.h"
+#include "utils/router.h"
 // Base paramter class.
 namespace singa {
-enum kMsgType{
-kGet=0,
-kPut=1,
-kSync=2,
-kStop
-};
 class Param {
  public:
    Param();
@@ -31,8 +27,42 @@ class Param {
    * handle sync msg by server
    */
   virtual zmsg_t* HandleSyncMsg(zmsg_t** msg)=0;
+  /**
+   * handle update msg by server, which carries gradients from one worker.
+   * The gradients are accumulated into grad_ until the server applies the
+   * Updater and calls ClearUpdates().
+   * @param step set to the training step of the worker
+   * @return num of gradients accumulated since last update
+   */
+  virtual int HandleUpdateMsg(zmsg_t** msg, int* step);
+  /**
+   * gen reply to update msg by server, which carries the fresh weights
+   * @param step version of the weights
+   */
+  virtual zmsg_t* GenUpdateReply(int step);
+  void ClearUpdates(){
+    nupdates_=0;
+  }
+  /**
+   * Replace the gradients accumulated by HandleUpdateMsg with their mean,
+   * called by the server before applying the Updater, hence every Updater
+   * applies the mean gradient regardless of how it uses grad_scale.
+   */
+  void AverageUpdates();
+  /**
+   * gen update msg by worker, which carries the (scaled) gradients
+   * @param grad gradients to send, e.g., of another Param sharing this
+   * slice; the gradients of this Param if nullptr.
+   */
+  virtual zmsg_t* GenUpdateMsgFromWorker(int step, float grad_scale,
+      float* grad=nullptr);
+  /**
+   * parse the reply to update msg by worker, i.e., copy the fresh weights
+   */
+  virtual void ParseUpdateMsgFromPS(zmsg_t** msg);
   /**
    * gen sync msg by worker
+   * @return nullptr if nothing is sampled, e.g., size()*sample_ratio<1.
    */
   virtual zmsg_t *GenSyncMsgFromWorker(float sample_ratio)=0;
   /**
@@ -44,6 +74,12 @@ class Param {
    * setup param shape
    */
   virtual void Setup(const ParamProto& proto, const std::vector<int>& shape, int fan_in);
+  /**
+   * Setup this Param as a slice of other, i.e., [offset, offset+len) of the
+   * flattened other. The slice shares memory with other, hence updates from
+   * servers to the slice are applied in place to other.
+   */
+  virtual void SetupSlice(Param* other, int offset, int len);
   /*
    * fill the data according to initmethod, i.e., random/gaussian/fixed value
    */
@@ -58,6 +94,9 @@ class Param {
   const std::string& name() {
     return proto_.name();
   }
+  const ParamProto& proto() const {
+    return proto_;
+  }
 
   int id() const{
     return proto_.id();
@@ -65,8 +104,24 @@ class Param {
   void set_id(int id){
     proto_.set_id(id);
   }
+  /**
+   * @return index of this slice in the owner Param, 0 if not sliced
+   */
+  int slice() const{
+    return slice_;
+  }
+  void set_slice(int slice){
+    slice_=slice;
+  }
+  /**
+   * set the encoding of the payload of sync msgs generated by this Param.
+   */
+  void set_wire_format(WireFormat fmt){
+    wire_format_=fmt;
+  }
   void ShareData(shared_ptr<Param> other){
     owner_=other.get();
+    pins_=other->pins_;
     CHECK(std::equal(data_.shape().begin(), data_.shape().end(),
           other->data_.shape().begin()));
     data_.ShareData(other->data_);
@@ -77,11 +132,15 @@ class Param {
   float weight_decay_multiplier() {
     return proto_.weight_decay_multiplier();
   }
-  /*
-  const int split_threshold(){
+  /**
+   * Params larger than this num of floats are split into slices.
+   */
+  int split_threshold() const {
     return proto_.split_threshold();
   }
-  */
+  int partition_dim() const {
+    return proto_.partition_dim();
+  }
    /**
     * @return num of floats.
     */
@@ -113,6 +172,43 @@ class Param {
   Blob<float> *mutable_history() {
     return &history_;
   }
+  /**
+   * Allocate the optimizer states used by the Updater; states are empty
+   * until this is called (see Updater::InitState).
+   */
+  void InitState(bool history, bool update){
+    if(history&&history_.count()!=data_.count()){
+      history_.ReshapeLike(data_);
+      history_.mutable_cpu_data();
+    }
+    if(update&&update_.count()!=data_.count()){
+      update_.ReshapeLike(data_);
+      update_.mutable_cpu_data();
+    }
+  }
+  /**
+   * Free the optimizer states, e.g., once the Updater runs on servers after
+   * the warmup steps updated locally.
+   */
+  void ReleaseState(){
+    history_=Blob<float>();
+    update_=Blob<float>();
+  }
+
+  /**
+   * Append a frame referencing [dptr, dptr+count) of this Param without
+   * copying. The memory is pinned until ZMQ sends the frame.
+   */
+  void AddPinnedFrame(zmsg_t* msg, float* dptr, int count){
+    pins_.AddFrame(msg, dptr, count*sizeof(float));
+  }
+  /**
+   * Block until no frame in flight references memory of this Param (or the
+   * Params sharing memory with it); called before overwriting the memory.
+   */
+  void WaitUnpinned() const{
+    pins_.Wait();
+  }
 
   float* mutable_cpu_data(){
     return data_.mutable_cpu_data();
@@ -126,22 +222,57 @@ class Param {
   float* mutable_cpu_update(){
     return update_.mutable_cpu_data();
   }
- static int64_t ps_handle_sync, worker_gen_sync, worker_handle_sync;
+ static int64_t worker_gen_sync, worker_handle_sync;
+ protected:
+  /**
+   * @return the floats of the payload frame in format fmt; decoded into buf
+   * unless fmt is kFloat32, for which the frame memory is returned.
+   */
+  float* DecodeFrame(zframe_t* frame, int fmt, int count, vector<float>* buf);
+  /**
+   * append count floats encoded in wire_format_ to the msg.
+   * @param decoded if not null, set to the values the receiver decodes.
+   */
+  void AddEncodedFrame(zmsg_t* msg, const float* src, int count,
+      vector<float>* decoded=nullptr);
+  /**
+   * Make the payload of a sync reply count fp32 floats from src, as the
+   * replies carry (absolute) weights which must not be quantized. The payload
+   * frame must be the last frame of the msg; if the request is not kFloat32,
+   * it is replaced and the header format is reset to kFloat32, otherwise src
+   * is the frame memory returned by DecodeFrame and nothing is done.
+   */
+  void SetFloat32Reply(zmsg_t* msg, zframe_t* frame, const float* src,
+      int count);
+
  protected:
   /**
    * name of the parameter used to share wights between neuralnets
    */
   std::string name_;
-  //! content, gradient, history gradient and snapshot of this parameter
-  Blob<float> data_, grad_, history_, update_, snapshot_;
+  //! content, gradient and optimizer states of this parameter; memory is
+  //! allocated on first access, and the states are shaped only for Params
+  //! updated locally, i.e., not for test nets, and released by workers
+  //! pushing gradients once the warmup steps are done.
+  Blob<float> data_, grad_, history_, update_;
   Param* owner_;
 
   ParamProto proto_;
   int fan_in_;
+  int slice_;
+  WireFormat wire_format_;
+  //!< zero-copy frames referencing memory of this Param
+  PinCounter pins_;
+  //!< num of gradients accumulated by server
+  int nupdates_;
 };
 
 /**
  * Sync with server by randomly sampling some parameters for every sync.
+ *
+ * The sample consists of random blocks of kSampleBlock contiguous floats,
+ * which the worker and the server regenerate from the seed in O(m) time.
+ * Contiguous blocks also make the gather and apply loops vectorizable.
  */
 class RandomSyncParam: public Param{
  public:
@@ -149,6 +280,7 @@ class RandomSyncParam: public Param{
   virtual zmsg_t *GenSyncMsgFromWorker(float sample_ratio);
   virtual void ParseSyncMsgFromPS(zmsg_t** msg);
   virtual void Setup(const ParamProto& proto, const vector<int>& shape, int fan_in);
+  virtual void SetupSlice(Param* other, int offset, int len);
   virtual void Init();
 
   float* mutable_cpu_snapshot(){
@@ -159,10 +291,53 @@ class RandomSyncParam: public Param{
   }
 
  protected:
-  const vector<int> RandomSample(int seed, int m, int n);
+  /**
+   * Sample m out of n coordinates.
+   * @return (start, length) of sampled segments.
+   */
+  const vector<std::pair<int, int>> RandomSample(unsigned seed, int m, int n);
 
 
   Blob<float> snapshot_;
+  //!< deltas of the sync in flight as decoded by the server; empty for
+  //!< kFloat32. The snapshot is set to what the server has received, hence
+  //!< the quantization error stays in the next delta (error feedback).
+  vector<float> sent_;
+};
+/**
+ * Sync with server by sending the top-k largest-magnitude deltas as
+ * (index, value) pairs, where k=size*sample_ratio.
+ *
+ * Like RandomSyncParam, the delta is data_-snapshot_ and the snapshot is
+ * updated only for the sent coordinates. Hence the unsent residual stays
+ * in the delta and is sent in later rounds (error feedback).
+ */
+class TopKSyncParam: public RandomSyncParam{
+ public:
+  TopKSyncParam(): round_(0){}
+  virtual zmsg_t* HandleSyncMsg(zmsg_t** msg);
+  virtual zmsg_t *GenSyncMsgFromWorker(float sample_ratio);
+  virtual void ParseSyncMsgFromPS(zmsg_t** msg);
+
+ protected:
+  /**
+   * Top-k selection without sorting the whole buffer.
+   * The threshold is estimated from a random sample of the magnitudes,
+   * drawn anew every call; exact selection is done only among the
+   * candidates above the threshold, which are filled up with values equal
+   * to (or, rarely, below) it if there are fewer than k.
+   * @return indices of min(k, n) values of delta with the largest magnitude.
+   */
+  const vector<int> TopK(const vector<float>& delta, int k);
+  /**
+   * TopK of the delta dptr-sdptr (dptr if sdptr is nullptr) of n floats,
+   * whose magnitudes are computed on the fly, i.e., without buffering it.
+   */
+  const vector<int> TopK(const float* dptr, const float* sdptr, int n, int k);
+
+ protected:
+  //!< num of TopK calls, seeding the threshold sample
+  unsigned round_;
 };
 /**
  * Sync with server by elastic SGD.
@@ -1,6 +1,10 @@
 #ifndef INCLUDE_UTILS_ROUTER_H_
 #define INCLUDE_UTILS_ROUTER_H_
 #include <czmq.h>
+#include <glog/logging.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 using std::pair;
@@ -8,7 +12,122 @@ using std::vector;
 using std::string;
 namespace singa {
 
-#define HEADER "singa\0"
+enum kMsgType{
+kGet=0,
+kPut=1,
+kSync=2,
+kStop=3,
+kUpdate=4,
+kBatch=5
+};
+
+/**
+ * Fixed binary header, i.e., the first frame of every message between
+ * ParamManager and Server (after the identity frame of the Router).
+ *
+ * It replaces the printf/sscanf framed strings. The Param name is sent only
+ * once in the kPut message for registration.
+ */
+struct MsgHeader{
+  int type; //!< kMsgType
+  int paramid;
+  int version; //!< training step of the worker
+  int slice; //!< index of the slice in the owner Param, 0 if not sliced
+  unsigned seed; //!< seed for random sampling of RandomSyncParam
+  int count; //!< num of floats in the payload frame
+  float value; //!< gradient scale for kUpdate, sample/moving rate for kSync
+  int format; //!< UpdaterProto::WireFormat of the kSync payload
+};
+
+/**
+ * insert the header as the first frame.
+ */
+inline void PushHeader(zmsg_t* msg, const MsgHeader& header){
+  zmsg_pushmem(msg, &header, sizeof(MsgHeader));
+}
+/**
+ * @return the header in the first frame, which is kept in the msg and
+ * could be updated in place.
+ */
+inline MsgHeader* PeekHeader(zmsg_t* msg){
+  zframe_t* frame=zmsg_first(msg);
+  CHECK(frame!=nullptr&&zframe_size(frame)==sizeof(MsgHeader));
+  return reinterpret_cast<MsgHeader*>(zframe_data(frame));
+}
+inline MsgHeader PopHeader(zmsg_t* msg){
+  MsgHeader header=*PeekHeader(msg);
+  zframe_t* frame=zmsg_pop(msg);
+  zframe_destroy(&frame);
+  return header;
+}
+
+/**
+ * Append a frame referencing [data, data+size) without copying the memory.
+ * ZMQ calls ffn(data, hint) once the frame is sent; ffn could be nullptr if
+ * the memory outlives the frame. The appended frame is a placeholder
+ * registered by its address; the msg must be sent by SendMsg, which
+ * replaces it by the memory, or destroyed by DestroyMsg.
+ */
+void AddZeroCopyFrame(zmsg_t* msg, void* data, size_t size,
+    zmq_free_fn* ffn=nullptr, void* hint=nullptr);
+/**
+ * Send and destroy the msg, zero-copy frames are sent without copying.
+ * If sending fails, the error is logged and the frames not sent are
+ * released as by DestroyMsg.
+ */
+void SendMsg(zsock_t* sock, zmsg_t** msg);
+/**
+ * Destroy the msg without sending it. Zero-copy frames are unregistered and
+ * their ffn is called, e.g., to unpin the memory.
+ */
+void DestroyMsg(zmsg_t** msg);
+
+/**
+ * @return num of bytes of the msg, including memory of zero-copy frames.
+ */
+size_t MsgSize(zmsg_t* msg);
+/**
+ * Append msg as one part of the batch and destroy it.
+ * The batch starts with a kBatch header whose count is the num of parts;
+ * each part is prefixed by a frame with its num of frames.
+ */
+void AddToBatch(zmsg_t* batch, zmsg_t** msg);
+/**
+ * Split the kBatch msg into its parts and destroy it.
+ */
+vector<zmsg_t*> UnpackBatch(zmsg_t** batch);
+
+/**
+ * Counts zero-copy frames in flight that reference some memory, i.e., the
+ * memory is pinned until ZMQ releases all these frames. Copies of one
+ * PinCounter share the count, e.g., Param slices and the owner Param.
+ */
+class PinCounter{
+ public:
+  PinCounter():state_(std::make_shared<State>()){}
+  /**
+   * append a zero-copy frame of [data, data+size) and pin the memory.
+   */
+  void AddFrame(zmsg_t* msg, void* data, size_t size);
+  /**
+   * block until all frames are released, called before overwriting the
+   * memory.
+   */
+  void Wait() const;
+  int count() const;
+
+ protected:
+  static void Release(void* data, void* hint);
+
+ protected:
+  struct State{
+    std::mutex mtx;
+    //!< notified when count drops to 0
+    std::condition_variable cv;
+    int count=0;
+  };
+  std::shared_ptr<State> state_;
+};
 
 /**
  * for communicating between Server and ParameterManager.
@@ -26,8 +145,8 @@ class Router{
   bool Bind(std::string addr, size_t expected_connections);
 
   /**
-   * push identifier, header and signature of sender
-   * send, then delete
+   * push identifier of the server, send, then delete.
+   * the msg should start with a MsgHeader frame.
    */
   void Send(zmsg_t* msg, int serverid);
 
@@ -39,7 +158,7 @@ class Router{
   void Reply(zmsg_t* msg, zframe_t* identity);
 
   /**
-   * pop identifier, header and signature
+   * pop identifier; the returned msg starts with the MsgHeader frame.
    * upper app delete the msg.
    */
   zmsg_t* Recv();
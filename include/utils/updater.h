@@ -1,5 +1,6 @@
 #ifndef INCLUDE_UTILS_UPDATER_H_
 #define INCLUDE_UTILS_UPDATER_H_
+#include <atomic>
 #include "proto/model.pb.h"
 #include "utils/param.h"
 
@@ -9,19 +10,57 @@ namespace singa{
  */
 class Updater{
  public:
+  Updater(): lr_cache_(~0ULL){}
   virtual void Init(const UpdaterProto &proto){
     proto_=proto;
   }
-  virtual void Update(int step, shared_ptr<Param> param, float grad_scale=1.0f)=0;
+  /**
+   * Update the whole Param.
+   */
+  void Update(int step, shared_ptr<Param> param, float grad_scale=1.0f){
+    InitState(param);
+    UpdateSlice(step, param, grad_scale, 0, param->size());
+  }
+  /**
+   * Update elements [offset, offset+len) of the Param. Different slices of
+   * one Param can be updated by different threads concurrently after
+   * InitState is called.
+   */
+  virtual void UpdateSlice(int step, shared_ptr<Param> param, float grad_scale,
+      int offset, int len)=0;
+  /**
+   * Allocate the states (e.g., history) used by the Updater for the Param,
+   * no-op if they are allocated.
+   */
+  virtual void InitState(shared_ptr<Param> param){
+    param->InitState(true, false);
+  }
 
+  /**
+   * @return the learning rate of the step, cached for the last step.
+   */
   float GetLearningRate(int step);
+ protected:
+  float ComputeLearningRate(int step);
+
  protected:
   UpdaterProto proto_;
+  //!< last step and its learning rate
+  std::atomic<uint64_t> lr_cache_;
 };
+/**
+ * Create the Updater according to UpdaterProto::type, and init it.
+ */
+shared_ptr<Updater> CreateUpdater(const UpdaterProto& proto);
+
 class SGDUpdater : public Updater{
  public:
   virtual void Init(const UpdaterProto& proto);
-  virtual void Update(int step, shared_ptr<Param> param, float grad_scale=1.0f);
+  virtual void InitState(shared_ptr<Param> param){
+    param->InitState(momentum_>0, false);
+  }
+  virtual void UpdateSlice(int step, shared_ptr<Param> param, float grad_scale,
+      int offset, int len);
 
  protected:
   float base_lr_;
@@ -31,7 +70,8 @@ class SGDUpdater : public Updater{
 class NesterovUpdater : public Updater{
  public:
   virtual void Init(const UpdaterProto& proto);
-  virtual void Update(int step, shared_ptr<Param> param, float grad_scale=1.0f);
+  virtual void UpdateSlice(int step, shared_ptr<Param> param, float grad_scale,
+      int offset, int len);
 
  protected:
   float base_lr_;
@@ -41,7 +81,8 @@ class NesterovUpdater : public Updater{
 class AdaGradUpdater : public Updater{
  public:
   virtual void Init(const UpdaterProto& proto);
-  virtual void Update(int step, shared_ptr<Param> param, float grad_scale=1.0f);
+  virtual void UpdateSlice(int step, shared_ptr<Param> param, float grad_scale,
+      int offset, int len);
 
  protected:
   float base_lr_;
@@ -52,7 +93,8 @@ class AdaGradUpdater : public Updater{
 class RMSPropUpdater : public Updater{
  public:
   virtual void Init(const UpdaterProto& proto);
-  virtual void Update(int step, shared_ptr<Param> param, float grad_scale=1.0f);
+  virtual void UpdateSlice(int step, shared_ptr<Param> param, float grad_scale,
+      int offset, int len);
 
  protected:
   float base_lr_;
@@ -64,7 +106,11 @@ class RMSPropUpdater : public Updater{
 class AdaDeltaUpdater : public Updater{
  public:
   virtual void Init(const UpdaterProto& proto);
-  virtual void Update(int step, shared_ptr<Param> param, float grad_scale=1.0f);
+  virtual void InitState(shared_ptr<Param> param){
+    param->InitState(true, true);
+  }
+  virtual void UpdateSlice(int step, shared_ptr<Param> param, float grad_scale,
+      int offset, int len);
 
  protected:
   float rho_;
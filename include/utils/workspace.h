@@ -0,0 +1,51 @@
+#ifndef INCLUDE_UTILS_WORKSPACE_H_
+#define INCLUDE_UTILS_WORKSPACE_H_
+#include <vector>
+#include "utils/blob.h"
+
+namespace singa {
+/**
+ * Scratch memory of one thread shared by all layers run by the thread, e.g.,
+ * the column buffers of convolution layers.
+ *
+ * Layers borrow numbered buffers for the duration of one ComputeFeature or
+ * ComputeGradient call. Each buffer grows to the largest request and is
+ * never shrunk, hence the resident memory is that of the layer with the
+ * largest request instead of the sum over all layers.
+ */
+class Workspace{
+ public:
+  /**
+   * @return the workspace of the calling thread.
+   */
+  static Workspace* Get();
+  /**
+   * @param k buffer id
+   * @param size num of floats
+   * @param owner, stamp identify the content written by the borrower, see
+   * Holds().
+   * @return buffer k of at least size floats; the content is kept if the
+   * buffer is not grown.
+   */
+  float* Borrow(int k, size_t size, const void* owner=nullptr,
+      int64_t stamp=0);
+  /**
+   * @return true if buffer k has not been borrowed by others since it was
+   * borrowed with owner and stamp, i.e., it still holds their content.
+   */
+  bool Holds(int k, const void* owner, int64_t stamp) const;
+  /**
+   * @return total size (Bytes) of all buffers.
+   */
+  size_t size() const;
+
+ protected:
+  struct Buffer{
+    Blob<float> blob;
+    const void* owner=nullptr;
+    int64_t stamp=0;
+  };
+  std::vector<Buffer> buffers_;
+};
+}  // namespace singa
+#endif  // INCLUDE_UTILS_WORKSPACE_H_
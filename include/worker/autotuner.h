@@ -0,0 +1,72 @@
+#ifndef INCLUDE_WORKER_AUTOTUNER_H_
+#define INCLUDE_WORKER_AUTOTUNER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include "proto/model.pb.h"
+#include "worker/conv_engine.h"
+
+using std::string;
+using std::vector;
+namespace singa {
+/**
+ * Choose the fastest implementations of layers by timing them on the real
+ * shapes with scratch data, see NetProto::autotune.
+ *
+ * Choices are keyed by shapes and persisted in a cache file, hence shapes
+ * tuned by previous runs are not timed again.
+ */
+class Autotuner{
+ public:
+  /**
+   * @param path cache file, loaded if it exists.
+   */
+  explicit Autotuner(const string& path);
+  /**
+   * Time all engines supporting the convolution, including im2col lowering
+   * one image and a block of images at a time.
+   * @return settings of proto with the fastest engine.
+   */
+  ConvolutionProto TuneConv(const ConvShape& shape,
+      const ConvolutionProto& proto);
+  /**
+   * Add the GEMMs of an InnerProductLayer (batchsize x vdim, vdim x hdim),
+   * timed by TuneBlasThreads.
+   */
+  void AddGemm(int batchsize, int vdim, int hdim);
+  /**
+   * Time the added GEMMs with different BLAS thread counts, and set the
+   * fastest one. The count is process wide, because BLAS threads are shared
+   * by all layers, hence they are tuned together.
+   * @param maxthreads largest thread count to try
+   */
+  void TuneBlasThreads(int maxthreads);
+  /**
+   * Write the choices into the cache file if there are new ones. Choices
+   * saved by other procs meanwhile are merged, and the file is replaced
+   * atomically by renaming a temporary file.
+   */
+  void Save();
+
+ protected:
+  /**
+   * Add the choices in the cache file into cache.
+   */
+  void Load(std::map<string, string>* cache) const;
+  /**
+   * @return the min time (us) of running func kRuns times after a warmup.
+   */
+  template<typename Func>
+  int64_t Time(Func func);
+
+ protected:
+  string path_;
+  //!< shape key -> choice
+  std::map<string, string> cache_;
+  bool dirty_;
+  //!< (batchsize, vdim, hdim) of added GEMMs
+  vector<vector<int>> gemms_;
+};
+}  // namespace singa
+#endif  // INCLUDE_WORKER_AUTOTUNER_H_
@@ -26,6 +26,7 @@ using std::map;
 namespace singa{
 
 class Layer;
+class Autotuner;
 typedef shared_ptr<Layer> SLayer;
 /**
  * Base layer class.
@@ -37,7 +38,7 @@ typedef shared_ptr<Layer> SLayer;
  */
 class Layer {
  public:
-  Layer(){}
+  Layer(): fused_(false){}
   /**
    * simply save the proto configuation.
    * most initializations are done by Setup().
@@ -91,6 +92,11 @@ class Layer {
   virtual vector<shared_ptr<Param>> GetParams(){
     return vector<shared_ptr<Param>>();
   }
+  /**
+   * Choose the fastest implementation for the shapes of this layer, called
+   * after Setup if NetProto::autotune is set.
+   */
+  virtual void Autotune(Autotuner* tuner){}
   /**
    * Compute features of this layer based on connected layers.
    * Implement forward propagation for BP; TODO Implement both postive phase
@@ -113,6 +119,52 @@ class Layer {
    * \copybrief ComputeGradient(const vector<SLayer>& srclayers)
    */
   virtual void ComputeGradient();
+  /**
+   * Fuse the element-wise layer following this layer, which is then run by
+   * this layer on blocks of its output while they are in cache, see
+   * NeuralNet::FuseLayers.
+   * @return false if this layer cannot run the layer.
+   */
+  virtual bool Fuse(SLayer layer){
+    return false;
+  }
+  /**
+   * @return true if the layer implements ComputeFeatureBlock and
+   * ComputeGradientBlock, i.e., it can be fused into its src layer, and
+   * run in place on the blobs of its src layer.
+   */
+  virtual bool is_elementwise() const {
+    return false;
+  }
+  /**
+   * Compute data[offset, offset+count) of element-wise layers.
+   * @param src the block of src data at offset
+   */
+  virtual void ComputeFeatureBlock(bool training, int offset, int count,
+      const float* src){}
+  /**
+   * Compute the gradient of the src data from grad[offset, offset+count) of
+   * element-wise layers.
+   * @param gsrc the block of src grad at offset
+   */
+  virtual void ComputeGradientBlock(int offset, int count, float* gsrc){}
+  /**
+   * @return true if ComputeGradient reads the data of this layer, hence
+   * element-wise layers must not overwrite it in place.
+   */
+  virtual bool needs_data_in_backward() const {
+    return true;
+  }
+  /**
+   * Fused layers are run by the layer they are fused into, hence
+   * ComputeFeature(bool) and ComputeGradient() return directly.
+   */
+  void set_fused(bool fused){
+    fused_=fused;
+  }
+  bool fused() const {
+    return fused_;
+  }
   /**
    * decide on which dimension to do the partitioning.
    * @mode kLayer, kData, kNone (no partition)
@@ -255,6 +307,7 @@ protected:
   // DArray pos_, neg_;//for CD
   LayerProto layer_proto_;
   vector<SLayer> srclayers_, dstlayers_;
+  bool fused_;
 };
 
 /**
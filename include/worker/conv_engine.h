@@ -0,0 +1,184 @@
+#ifndef INCLUDE_WORKER_CONV_ENGINE_H_
+#define INCLUDE_WORKER_CONV_ENGINE_H_
+
+#include <functional>
+#include <memory>
+#include "proto/model.pb.h"
+
+using std::shared_ptr;
+namespace singa {
+/**
+ * Shapes and settings of the convolution of one ConvolutionLayer.
+ * Images are of shape (batchsize, channels, height, width), weights of shape
+ * (num_filters, channels, kernel, kernel) and outputs of shape (batchsize,
+ * num_filters, conv_height, conv_width).
+ */
+struct ConvShape{
+  int batchsize, channels, height, width;
+  int num_filters, kernel, pad, stride;
+  int conv_height, conv_width;
+};
+
+/**
+ * Called by ConvEngine::Forward on the outputs of images [n, n+nb) right
+ * after they are computed, e.g., to add the bias while they are in cache.
+ */
+typedef std::function<void(int n, int nb, float* data)> ConvEpilogue;
+
+/**
+ * Algorithm computing the convolution (without bias) of a ConvolutionLayer
+ * and its gradients. Scratch buffers are borrowed from the Workspace of the
+ * calling thread, which is shared by all layers run by the thread.
+ */
+class ConvEngine{
+ public:
+  virtual ~ConvEngine(){}
+  /**
+   * @param proto the engine may read its settings, e.g., buffer size.
+   */
+  virtual void Setup(const ConvShape& shape, const ConvolutionProto& proto){
+    shape_=shape;
+  }
+  /**
+   * data=conv(src, weight).
+   * @param training backward follows, hence buffers can be kept for it.
+   * @param epilogue run on each block of images once computed, if not empty.
+   */
+  virtual void Forward(bool training, const float* src, const float* weight,
+      float* data, const ConvEpilogue& epilogue)=0;
+  /**
+   * gweight=dE/dweight, and gsrc=dE/dsrc if gsrc is not nullptr.
+   * @param grad dE/ddata
+   */
+  virtual void Backward(const float* src, const float* weight,
+      const float* grad, float* gweight, float* gsrc)=0;
+  virtual ConvolutionProto::Engine type() const=0;
+  const ConvShape& shape() const {
+    return shape_;
+  }
+
+ protected:
+  ConvShape shape_;
+};
+
+/**
+ * Lower images to columns by im2col and multiply with weights by GEMM.
+ * A block of images is lowered into one matrix, hence one large GEMM per
+ * block; the block size is bounded by ConvolutionProto::col_buffer_mb.
+ */
+class Im2colConvEngine: public ConvEngine{
+ public:
+  virtual void Setup(const ConvShape& shape, const ConvolutionProto& proto);
+  virtual void Forward(bool training, const float* src, const float* weight,
+      float* data, const ConvEpilogue& epilogue);
+  virtual void Backward(const float* src, const float* weight,
+      const float* grad, float* gweight, float* gsrc);
+  virtual ConvolutionProto::Engine type() const{
+    return ConvolutionProto::kIm2col;
+  }
+
+ protected:
+  /**
+   * @return num of images lowered into one column matrix, such that the
+   * column buffers fit into buffer_mb MB (or a share of the available
+   * memory if buffer_mb is 0).
+   */
+  int ColBlockSize(int buffer_mb);
+
+ protected:
+  int col_height_, col_width_;
+  //!< num of images lowered into one column matrix
+  int col_block_;
+  //!< the columns of the whole batch are computed by the last Forward
+  bool col_cached_;
+  //!< inc by 1 per Forward; backward reuses the columns if the Workspace
+  //!< buffer still holds those of the last Forward
+  int64_t col_stamp_;
+};
+
+/**
+ * Direct convolution for stride 1 without lowering. Rows of the output are
+ * accumulated from shifted rows of the input, blocked over kFilterBlock
+ * filters to reuse each loaded input row; the loops over columns are
+ * contiguous and vectorized. The source gradient is computed as a
+ * convolution of the output gradient with the flipped weights.
+ */
+class DirectConvEngine: public ConvEngine{
+ public:
+  virtual void Forward(bool training, const float* src, const float* weight,
+      float* data, const ConvEpilogue& epilogue);
+  virtual void Backward(const float* src, const float* weight,
+      const float* grad, float* gweight, float* gsrc);
+  virtual ConvolutionProto::Engine type() const{
+    return ConvolutionProto::kDirect;
+  }
+
+ protected:
+  /**
+   * Convolve one image (channels, height, width) with weights (nfilters,
+   * channels, kernel, kernel), stride 1.
+   * @param out (nfilters, height+2*pad-kernel+1, width+2*pad-kernel+1)
+   */
+  void Convolve(const float* img, int channels, int height, int width,
+      const float* weight, int nfilters, int pad, float* out);
+  /**
+   * gweight=sum over images of the correlation of src with grad.
+   */
+  void WeightGradient(const float* src, const float* grad, float* gweight);
+  /**
+   * @return weights of shape (channels, num_filters, kernel, kernel) rotated
+   * by 180 degrees, i.e., the filters of the source gradient.
+   */
+  const float* FlipWeight(const float* weight);
+};
+
+/**
+ * Winograd F(2x2,3x3) for 3x3 kernels and stride 1. Each 4x4 input tile
+ * (overlapped by 2) is transformed by B^T d B, multiplied element-wise
+ * with the transformed filters G g G^T, summed over channels as 16 GEMMs,
+ * and transformed back by A^T m A into a 2x2 output tile, which takes 16
+ * instead of 36 multiplications per output tile and channel.
+ * The source gradient is computed in the same way with flipped weights; the
+ * weight gradient by the direct method.
+ */
+class WinogradConvEngine: public DirectConvEngine{
+ public:
+  virtual void Forward(bool training, const float* src, const float* weight,
+      float* data, const ConvEpilogue& epilogue);
+  virtual void Backward(const float* src, const float* weight,
+      const float* grad, float* gweight, float* gsrc);
+  virtual ConvolutionProto::Engine type() const{
+    return ConvolutionProto::kWinograd;
+  }
+
+ protected:
+  /**
+   * Transform weights (nfilters, channels, 3, 3).
+   * @return U of shape (16, nfilters, channels).
+   */
+  const float* TransformWeight(const float* weight, int nfilters,
+      int channels);
+  /**
+   * Convolve one image with the transformed weights U.
+   * @param out (nfilters, height+2*pad-2, width+2*pad-2)
+   */
+  void Convolve(const float* img, int channels, int height, int width,
+      const float* U, int nfilters, int pad, float* out);
+};
+
+/**
+ * @return true if the engine supports the convolution.
+ */
+bool ConvEngineSupports(ConvolutionProto::Engine type, const ConvShape& shape);
+/**
+ * Choose an engine for the convolution from its kernel, stride and shapes.
+ */
+ConvolutionProto::Engine ChooseConvEngine(const ConvShape& shape);
+/**
+ * Create the engine of the type (kAutoEngine for ChooseConvEngine), and
+ * set it up.
+ */
+shared_ptr<ConvEngine> CreateConvEngine(ConvolutionProto::Engine type,
+    const ConvShape& shape, const ConvolutionProto& proto);
+}  // namespace singa
+#endif  // INCLUDE_WORKER_CONV_ENGINE_H_
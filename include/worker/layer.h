@@ -14,6 +14,7 @@
 #include "proto/model.pb.h"
 #include "utils/shard.h"
 #include "worker/base_layer.h"
+#include "worker/conv_engine.h"
 
 
 /**
@@ -23,7 +24,9 @@
 namespace singa {
 
 /**
- * Convolution layer.
+ * Convolution layer. The convolution is computed by a ConvEngine chosen at
+ * Setup, see ConvolutionProto::engine. The bias and fused layers are applied
+ * on the output of each block of images computed by the engine.
  */
 class ConvolutionLayer: public Layer {
  public:
@@ -47,12 +50,22 @@ class ConvolutionLayer: public Layer {
     CHECK_LT(k, srclayers_.size());
     return kOneToAll;
   }
+  /**
+   * Replace the engine by the fastest one unless it is set explicitly.
+   */
+  virtual void Autotune(Autotuner* tuner);
+  virtual bool Fuse(SLayer layer);
+  virtual bool needs_data_in_backward() const {
+    return false;
+  }
  protected:
   int kernel_, pad_,  stride_ ;
   int batchsize_,  channels_, height_,width_;
   int col_height_, col_width_, conv_height_, conv_width_, num_filters_;
   shared_ptr<Param> weight_, bias_;
-  Blob<float> col_data_, col_grad_;
+  shared_ptr<ConvEngine> engine_;
+  //!< element-wise layers run on the output, see Fuse
+  vector<SLayer> fusedlayers_;
 };
 
 class DropoutLayer: public Layer {
@@ -66,6 +79,18 @@ class DropoutLayer: public Layer {
 
   virtual void ComputeFeature(bool training, const vector<shared_ptr<Layer>>& srclayers);
   virtual void ComputeGradient(const vector<shared_ptr<Layer>>& srclayers);
+  virtual bool is_elementwise() const {
+    return true;
+  }
+  virtual void ComputeFeatureBlock(bool training, int offset, int count,
+      const float* src);
+  virtual void ComputeGradientBlock(int offset, int count, float* gsrc);
+  /**
+   * the gradient is computed from the mask.
+   */
+  virtual bool needs_data_in_backward() const {
+    return false;
+  }
  protected:
   // drop probability
   float pdrop_;
@@ -100,6 +125,18 @@ class InnerProductLayer: public Layer {
   virtual vector<shared_ptr<Param>> GetParams() {
     return vector<shared_ptr<Param>>{weight_, bias_};
   }
+  /**
+   * Add the GEMMs for tuning the BLAS thread count.
+   */
+  virtual void Autotune(Autotuner* tuner);
+  /**
+   * The bias and fused layers are applied on blocks of rows of the GEMM
+   * output.
+   */
+  virtual bool Fuse(SLayer layer);
+  virtual bool needs_data_in_backward() const {
+    return false;
+  }
 
  private:
   //! dimension of the hidden layer
@@ -108,6 +145,8 @@ class InnerProductLayer: public Layer {
   int vdim_;
   int batchsize_;
   shared_ptr<Param> weight_, bias_;
+  //!< element-wise layers run on the output, see Fuse
+  vector<SLayer> fusedlayers_;
 };
 
 class LabelLayer: public ParserLayer {
@@ -195,6 +234,12 @@ class ReLULayer: public Layer {
 
   virtual void ComputeFeature(bool training, const vector<shared_ptr<Layer>>& srclayers);
   virtual void ComputeGradient(const vector<shared_ptr<Layer>>& srclayers);
+  virtual bool is_elementwise() const {
+    return true;
+  }
+  virtual void ComputeFeatureBlock(bool training, int offset, int count,
+      const float* src);
+  virtual void ComputeGradientBlock(int offset, int count, float* gsrc);
 };
 
 
@@ -286,6 +331,12 @@ class TanhLayer: public Layer {
 
   virtual void ComputeFeature(bool training, const vector<shared_ptr<Layer>>& srclayers);
   virtual void ComputeGradient(const vector<shared_ptr<Layer>>& srclayers);
+  virtual bool is_elementwise() const {
+    return true;
+  }
+  virtual void ComputeFeatureBlock(bool training, int offset, int count,
+      const float* src);
+  virtual void ComputeGradientBlock(int offset, int count, float* gsrc);
  private:
   float outer_scale_, inner_scale_;
 };
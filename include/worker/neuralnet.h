@@ -120,6 +120,27 @@ class NeuralNet {
 
  protected:
   void ConstructNeuralNet(const NetProto &net_proto);
+  /**
+   * Choose the fastest implementations of layers, see NetProto::autotune.
+   * The process wide BLAS thread count is tuned only by the first net
+   * autotuned in the process, i.e., the train net.
+   * @param cache path of the cache file, relative to the workspace.
+   */
+  void Autotune(const string& cache);
+  /**
+   * Fuse chains of element-wise layers into the layer they follow if the
+   * layer accepts them (see Layer::Fuse). A layer is fused only if it is
+   * the single dst layer of its single src layer on the same location.
+   */
+  void FuseLayers();
+  /**
+   * Let element-wise layers share the data and grad blobs of their src
+   * layer, if the src layer has no other dst layer on the same location and
+   * does not read its data in ComputeGradient. Element-wise layers compute
+   * their outputs (and src grads) element by element, hence they can
+   * overwrite the blobs.
+   */
+  void SetupInplaceLayers();
   void PartitionNeuralNet();
   map<string, shared_ptr<Layer>> GetNameToLayer(
     const vector<shared_ptr<Layer>>& layers);
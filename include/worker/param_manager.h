@@ -4,6 +4,8 @@
 #include <czmq.h>
 #include <thread>
 #include <mutex>
+#include <queue>
+#include <atomic>
 #include <condition_variable>
 #include "utils/param.h"
 #include "utils/router.h"
@@ -16,8 +18,109 @@
 #define kDataReady 16
 
 namespace singa{
+/**
+ * Command from executor threads to the comm thread of ParamManager, sent as
+ * the first frame of msgs through the inproc outbox sockets.
+ */
+struct CommCmd{
+  enum Type{
+    kSend=0, //!< batch the following frames to server serverid
+    kSync=1, //!< gen and send sync msgs of Param paramid
+    kPush=2, //!< gen and send gradients of Param paramid
+    kFlush=3, //!< send all pending batches
+    kStop=4 //!< stop the comm thread
+  };
+  int type;
+  int serverid;
+  int paramid;
+  int step;
+  float scale; //!< gradient scale for kPush
+};
+
+/**
+ * Update of one Param after its gradients of one step are ready, or
+ * reduction and update of one slice [offset, offset+len) of a shared Param.
+ */
+struct UpdateTask{
+  shared_ptr<Param> param;
+  int step;
+  int offset;
+  //!< 0 for updating the whole Param
+  int len;
+};
+/**
+ * Order of UpdateTask in the priority queue: earlier steps first, then lower
+ * Param ids, i.e., Params of lower layers which are needed first by the next
+ * forward pass.
+ */
+struct UpdateTaskLater{
+  bool operator()(const UpdateTask& a, const UpdateTask& b) const{
+    if(a.step!=b.step)
+      return a.step>b.step;
+    return a.param->id()>b.param->id();
+  }
+};
+
+/**
+ * Sync settings and statistics of Params synced with one server, which are
+ * tuned by ParamManager::Tune. Statistics are reset after each tuning.
+ */
+struct SyncGroup{
+  std::atomic<float> sample_ratio;
+  std::atomic<int> sync_frequency;
+  //!< Bytes of sync msgs sent
+  std::atomic<int64_t> nbytes;
+  //!< num of sync replies and their total round trip time (us)
+  std::atomic<int64_t> nreplies, rtt;
+  //!< time (us) that executors are blocked waiting for sync replies
+  std::atomic<int64_t> blocked;
+};
+
+/**
+ * Bookkeeping of one local (slice) Param, or of the owner of local Params,
+ * stored densely by Param id. Slots are created at construction, hence
+ * they are accessed without locking; counters are atomic.
+ */
+struct ParamSlot{
+  //!< nullptr if only Params sharing this owner are local
+  shared_ptr<Param> param;
+  //!< id of the owner Param; for slices, id of the sliced Param
+  int ownerid;
+  //!< id of the server syncing with this (slice) Param
+  int server;
+  //!< slices: offset of the slice in the sliced Param
+  int offset;
+  //!< the Param is ready for the step of this version; for slices, the
+  //!< version of the last reply. Versions never decrease.
+  std::atomic<int> version;
+  //!< owner slots: num of shares whose gradients of this step are ready
+  std::atomic<int> arrivals;
+  //!< owner slots: num of slices being reduced
+  std::atomic<int> pending;
+  //!< owner slots: local Params sharing this owner, and slices
+  vector<shared_ptr<Param>> shares, slices;
+  //!< threads waiting for a newer version sleep on cv
+  std::mutex mtx;
+  std::condition_variable cv;
+  //!< time (us) of sending the last sync msg, accessed by the comm thread
+  int64_t synctime;
+  //!< owner slots: version set by the reply of the last posted sync and the
+  //!< time (us) of posting it; only waiting for this reply counts as blocked
+  std::atomic<int> syncversion;
+  std::atomic<int64_t> syncposted;
+};
+
 /**
  * ParamManager manages Param objects within the process.
+ *
+ * Communication with servers runs in a background comm thread, which owns
+ * the Router. Executor threads post commands (e.g., sync a Param) and
+ * return immediately; the comm thread generates and batches msgs, applies
+ * replies and wakes up threads waiting for the replied Params. Hence the
+ * network time overlaps with computation.
+ * Updates are queued by executor threads once the gradients are ready and
+ * run by a pool of updater threads, hence the backward pass does not wait
+ * for the Updater.
  * It allocates the memory space for all Param objects that are used within this
  * process. It also synchronizes with parameter servers;
  * TODO syn with other processes for parameters shared across procs.
@@ -31,10 +134,11 @@ class ParamManager{
   ~ParamManager();
 
   /**
-   * called by local worker threads;
+   * called by local worker threads after the gradients are computed.
+   * The update is queued and run by updater threads (or by the calling
+   * thread if there is no updater thread).
    * can be implemented in hogwild way, i.e., done asynchornously; or in batch
    * mode, i.e., wait until all threads update for this param is ready.
-   * can be done by the stub thread or the calling thread
    */
   void UpdateParam(shared_ptr<Param> param, int step, int threadid);
   /**
@@ -43,61 +147,231 @@ class ParamManager{
   void UpdateParams(int step, int threadid);
    */
   /**
-   * will be blocked if the param is not updated.
+   * will be blocked if the param is not updated. The calling thread runs
+   * queued updates while waiting.
    */
   void WaitUpdate(shared_ptr<Param> param, int step, int threadid);
+  /**
+   * Block until the updates of all local Params of the steps before step are
+   * done, e.g., before reading the weights outside the training steps. The
+   * calling thread runs queued updates while waiting.
+   */
+  void WaitUpdates(int step);
   /**
     * Initialize neural network parameters and put them to
     * distributed parameter table on parameter servers.
+    * Blocked until the local (warmup) updates before step are done.
     * @param net, neural network
     */
-  void SendParamsToServers();
+  void SendParamsToServers(int step);
   /**
-   * get params to run step-th iteration
+   * Replace local params by the server copies to run step-th iteration.
+   * Blocked until the local updates of previous steps are done and the
+   * replies of all slices are applied.
    */
-  void GetParamsFromServers(int step);// will be blocked until recv all parameters.
+  void GetParamsFromServers(int step);
   /**
    * randomlly init allocated parameters and set them ready */
   void InitParams();
 
-    /**
-   * Poll messages and conduct updates for parameters.
+  void SyncConfig(float compute_time);
+  /**
+   * Called by the main executor after each training step. Every
+   * UpdaterProto::tune_frequency steps, the sample ratio and sync frequency
+   * of each SyncGroup are adjusted so that the sync time is hidden behind
+   * computation, i.e., executors are rarely blocked by sync replies.
+   * @param step_time time (ms) of the training step
    */
-  void Update(int step, int threadid);
+  void Tune(int step, int64_t step_time);
+  bool SyncNow(int step, shared_ptr<Param> param);
   /**
-   * A loop which calls Update, running as a background thread.
-  void Run(int step);
-  void Stop(){
-    running_=false;
-  }
-  void SyncWithPS(int step);
+   * @return true if gradients of this step are pushed to servers, which
+   * run the Updater and reply fresh weights.
+   */
+  bool UpdateOnServer(int step);
 
-  void HandleParamUpdate(zmsg_t* msg){}
-  void HandleLocalMsg(int paramid, zmsg_t* msg){}
-  void HandlePSMsg(int paramid){}
+ protected:
+  /**
+   * Split Params larger than ParamProto::split_threshold (if positive) into
+   * slices.
+   * Each slice has its own id and is synced with a different server. Slices
+   * share memory with the first local share of the owner Param, i.e., they
+   * are reassembled in place, and the gradients reduced into that share are
+   * pushed by the slices.
    */
-  void SyncConfig(float compute_time);
-  bool SyncNow(int step);
+  void SliceParams();
+  /**
+   * Free the optimizer states of local Params, called once the warmup
+   * updates are done if the Updater runs on servers afterwards.
+   */
+  void ReleaseStates();
+  /**
+   * Run the Updater on the Param (or push its gradients) and send sync msgs
+   * if necessary.
+   */
+  void ExecUpdate(shared_ptr<Param> param, int step);
+  /**
+   * Pop the most urgent UpdateTask and run it.
+   * @param block wait for a task if the queue is empty
+   * @return false if no task is run, i.e., the queue is empty and not
+   * blocking, or the ParamManager is being destroyed.
+   */
+  bool RunUpdateTask(bool block);
+  /**
+   * Aggregate gradients of Params sharing one owner and update the weights
+   * (or push the sum to servers), called by the last thread whose gradients
+   * are ready. The Param is split into slices which are reduced and updated
+   * by multiple threads.
+   */
+  void ScatterReduce(const vector<shared_ptr<Param>>& shares, int step);
+  /**
+   * Sum gradients of all shares into the first share and update one slice.
+   * The thread finishing the last slice sets the versions and syncs, or
+   * pushes the gradients if the update runs on servers.
+   */
+  void ReduceSlice(const UpdateTask& task);
+  /**
+   * Main function of updater threads.
+   */
+  void RunUpdater();
+  /**
+   * @return id of the server that maintains the (slice) Param.
+   */
+  int server(int paramid);
+  /**
+   * @return slices of the Param if it is sliced, otherwise the Param itself.
+   */
+  const vector<shared_ptr<Param>> SyncParams(shared_ptr<Param> param);
+  /**
+   * @return the SyncGroup of Params sharing the owner.
+   */
+  SyncGroup* sync_group(int ownerid){
+    return sync_groups_.at(server(ownerid)).get();
+  }
+  /**
+   * @return the slot of the (slice) Param or owner id, nullptr if not local.
+   */
+  ParamSlot* slot(int id){
+    return id<static_cast<int>(slots_.size())?slots_[id].get():nullptr;
+  }
+  /**
+   * @return the slot of id, created if it does not exist, called only
+   * during construction.
+   */
+  ParamSlot* AddSlot(int id);
+  /**
+   * Block until the version of the slot reaches step, or until slices of
+   * shared Params are queued, which the caller should help reduce.
+   */
+  void WaitVersion(ParamSlot* slot, int step);
+  /**
+   * Update the version after recv the reply for (slice) Param id.
+   * The version of a sliced Param is updated once every slice is replied
+   * with this version; a slice replied more than once counts once.
+   * Waiting threads are notified.
+   */
+  void UpdateVersion(int id, int step);
+  /**
+   * Post a command to the comm thread, called by executor threads.
+   * @param msg frames for CommCmd::kSend, destroyed after posting.
+   */
+  void Post(const CommCmd& cmd, zmsg_t* msg=nullptr);
+  /**
+   * Queue the msg into the batch for the server, called by the comm thread.
+   * The batch is sent if it exceeds Cluster::largest_message bytes or is
+   * older than the flush window.
+   */
+  void SendToServer(zmsg_t* msg, int serverid);
+  /**
+   * Send pending batches older than the flush window (all batches if
+   * all is true), called by the comm thread.
+   * @return ms until the next batch expires, -1 if no pending batch.
+   */
+  int FlushBatches(bool all);
+  /**
+   * Main function of the comm thread, which owns the Router. It executes
+   * commands from executor threads, applies replies from servers and
+   * wakes up threads waiting for the replied Params.
+   */
+  void Run();
+  /**
+   * Execute one command from executor threads.
+   * @return false for CommCmd::kStop.
+   */
+  bool HandleCommand(zmsg_t* msg);
+  /**
+   * Apply one (unbatched) reply from servers and update the version.
+   */
+  void HandleReply(zmsg_t* msg);
+  /**
+   * @return the inproc socket of the calling thread to the comm thread.
+   */
+  zsock_t* outbox();
+  /**
+   * Raise the version of Param id (no-op if it is newer) and wake up
+   * threads waiting for it.
+   */
+  void SetVersion(int id, int version);
+  /**
+   * Push gradients to servers instead of updating locally.
+   * Gradients of shared Params are aggregated before pushing.
+   */
+  void PushGradients(shared_ptr<Param> param, int step);
+  /**
+   * Post a sync of param after the update of step, which is sent by the
+   * comm thread.
+   */
+  void PostSync(shared_ptr<Param> param, int step);
 
  protected:
   bool hogwild_;
+  //!< false to stop updater threads, guarded by task_mtx_
   bool running_;
+  bool update_on_server_;
   int warmup_steps_;
   float sample_ratio_, moving_rate_;
   int sync_frequency_;
+  //!< one per server
+  vector<shared_ptr<SyncGroup>> sync_groups_;
+  int tune_frequency_, tune_steps_;
+  //!< total time (ms) of training steps since the last tuning
+  int64_t tune_time_;
   shared_ptr<NeuralNet> net_;
   //!< sgd updater
   shared_ptr<Updater> updater_;
   //!< a big param which allocates mem for all local params.
   shared_ptr<Param> param_;
-  map<int, vector<shared_ptr<Param>>> ownerid2Params_;
-  //!< aggregated updates for one param
-  map<int, size_t> aggregatedUpdates_;
-  map<int, int> paramid2Offset_;
-  map<int, int> paramid2version_;
-  map<int, shared_ptr<Param>> paramid2Param_;
-  std::mutex mtx_;
-  //std::condition_variable cv_;
+  //!< indexed by Param id, see ParamSlot
+  vector<std::unique_ptr<ParamSlot>> slots_;
+  //!< ids of owners of local Params
+  vector<int> ownerids_;
+
+  //!< pending batch, its size (Bytes) and creation time per server, which
+  //!< are accessed only by the comm thread
+  vector<zmsg_t*> batches_;
+  vector<size_t> batchsize_;
+  vector<int64_t> batchstart_;
+
+  //!< queued updates, guarded by task_mtx_
+  std::priority_queue<UpdateTask, vector<UpdateTask>, UpdateTaskLater> tasks_;
+  std::mutex task_mtx_;
+  std::condition_variable task_cv_;
+  //!< num of queued slice tasks; threads waiting for versions wake up to
+  //!< run them, hence slices are reduced in parallel without updaters
+  std::atomic<int> nslicetasks_;
+  vector<std::thread> updaters_;
+
+  //!< num of kGet replies not applied yet, guarded by get_mtx_
+  int pending_gets_;
+  std::mutex get_mtx_;
+  std::condition_variable get_cv_;
+
+  std::thread comm_thread_;
+  //!< comm thread pulls msgs of executor threads from this socket
+  zsock_t* outbox_;
+  //!< push sockets of executor threads to outbox_
+  map<std::thread::id, zsock_t*> pushers_;
+  std::mutex pusher_mtx_;
 
   shared_ptr<Router> router_;
 };
@@ -0,0 +1,120 @@
+#ifndef INCLUDE_WORKER_SCHEDULER_H_
+#define INCLUDE_WORKER_SCHEDULER_H_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <condition_variable>
+#include "worker/neuralnet.h"
+
+namespace singa{
+/**
+ * Forward or backward step of one local layer, run by the LayerScheduler
+ * after the steps of the layers it depends on are done.
+ */
+struct LayerTask{
+  shared_ptr<Layer> layer;
+  //!< tasks depending on this task
+  vector<int> successors;
+  //!< num of tasks this task depends on
+  int ndeps;
+  //!< num of dependencies not done in the current run
+  std::atomic<int> pending;
+};
+
+/**
+ * Tasks of one pass (forward or backward) over the local layers of a net.
+ * Forward tasks depend on the tasks of their source layers; backward tasks
+ * depend on the tasks of their destination layers.
+ */
+struct TaskGraph{
+  vector<std::unique_ptr<LayerTask>> tasks;
+  //!< tasks without dependencies
+  vector<int> roots;
+};
+
+/**
+ * Deque of ready tasks of one scheduler thread. The owner pushes and pops at
+ * the back (the task it just enabled, whose inputs are still in cache); idle
+ * threads steal from the front.
+ */
+struct TaskQueue{
+  std::mutex mtx;
+  std::deque<int> tasks;
+};
+
+/**
+ * Run forward/backward passes of a NeuralNet as graphs of layer tasks on a
+ * work-stealing thread pool. The thread calling Run executes tasks as
+ * thread 0 together with nthreads-1 pool threads, hence layers of all
+ * partitions within the process are balanced over the threads regardless of
+ * their location ids.
+ */
+class LayerScheduler{
+ public:
+  /**
+   * Function executing one task by scheduler thread threadid.
+   */
+  typedef std::function<void(shared_ptr<Layer> layer, int threadid)> TaskFunc;
+  explicit LayerScheduler(int nthreads);
+  ~LayerScheduler();
+  /**
+   * @return the task graph of the forward (or backward) pass over layers of
+   * the net that are located in this process, built on the first call.
+   */
+  TaskGraph* graph(shared_ptr<NeuralNet> net, bool backward);
+  /**
+   * Run all tasks of the graph, blocked until all of them are done.
+   * Called by one thread at a time.
+   */
+  void Run(TaskGraph* graph, const TaskFunc& func);
+  int nthreads() const {
+    return queues_.size();
+  }
+
+ protected:
+  TaskGraph* BuildGraph(shared_ptr<NeuralNet> net, bool backward);
+  /**
+   * Main function of pool threads, which execute tasks of each run.
+   */
+  void RunThread(int threadid);
+  /**
+   * Execute tasks of the current run until all of them are done.
+   */
+  void Execute(int threadid);
+  /**
+   * Pop a ready task from the own queue, or steal one from other queues.
+   * @return false if all queues are empty.
+   */
+  bool PopTask(int threadid, int* task);
+  /**
+   * Mark the task done and queue its successors that become ready.
+   */
+  void FinishTask(int threadid, int task);
+
+ protected:
+  vector<shared_ptr<TaskQueue>> queues_;
+  vector<std::thread> threads_;
+  std::map<std::pair<const NeuralNet*, bool>, shared_ptr<TaskGraph>> graphs_;
+  //!< graph and function of the current run
+  TaskGraph* graph_;
+  const TaskFunc* func_;
+  //!< num of tasks not done in the current run
+  std::atomic<int> remaining_;
+  //!< guards the fields below, idle threads wait on cv_
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  //!< inc by 1 when a run starts, tasks are queued or a run is done
+  int64_t events_;
+  //!< inc by 1 when a run starts
+  int64_t runs_;
+  bool running_;
+};
+}  // namespace singa
+#endif  // INCLUDE_WORKER_SCHEDULER_H_
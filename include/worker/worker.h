@@ -5,6 +5,7 @@
 
 #include "worker/neuralnet.h"
 #include "worker/param_manager.h"
+#include "worker/scheduler.h"
 #include "proto/model.pb.h"
 #include "utils/cluster.h"
 
@@ -32,7 +33,9 @@ class Performance{
 };
 
 /**
- * Executor runs as a thread over one partition of the NeuralNet
+ * Executor runs the layers of the NeuralNet located in this process.
+ * Forward/backward steps of the layers are executed as tasks by a
+ * LayerScheduler with Cluster::nthreads_per_procs threads.
  */
 class Executor{
  public:
@@ -85,6 +88,15 @@ class Executor{
 
   void Forward(shared_ptr<NeuralNet> net, int step, bool training);
   void Backward(shared_ptr<NeuralNet> net, int step);
+  /**
+   * Forward step of one layer, run as a task by scheduler thread threadid.
+   */
+  void ForwardLayer(shared_ptr<Layer> layer, int step, bool training,
+      int threadid);
+  /**
+   * Backward step of one layer, run as a task by scheduler thread threadid.
+   */
+  void BackwardLayer(shared_ptr<Layer> layer, int step, int threadid);
   /**
    * Profiling the time cost of training one batch.
    */
@@ -170,8 +182,13 @@ class Executor{
   float tForward_, tBackward_, tSyncData_, tSyncParam_;
   int ticks_;
 
+  shared_ptr<LayerScheduler> scheduler_;
+  //!< pull socket of bridge layers in this procs, guarded by pull_mtx_
   zsock_t* pull_;
+  std::mutex pull_mtx_;
+  //!< push sockets to other procs (group procs id), guarded by push_mtx_
   map<int, zsock_t*> push_;
+  std::mutex push_mtx_;
 };
 
 /**
@@ -47,7 +47,7 @@ int main(int argc, char **argv) {
 
   RegistryClasses(model);
   if(cluster->AmIServer()) {
-    singa::Server server(cluster);
+    singa::Server server(cluster, model.updater());
     server.Run();
   }else {
     singa::Worker worker(cluster);
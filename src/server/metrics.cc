@@ -0,0 +1,139 @@
+#include <glog/logging.h>
+#include <czmq.h>
+#include <algorithm>
+#include <fstream>
+#include "server/metrics.h"
+#include "utils/common.h"
+
+namespace singa {
+/******************************Histogram************************************/
+Histogram::Histogram(){
+  std::fill(buckets_, buckets_+kNumBuckets, 0);
+  count_=sum_=0;
+}
+
+void Histogram::Add(int64_t usecs){
+  int k=0;
+  while(k<kNumBuckets-1&&(int64_t(1)<<k)<usecs)
+    k++;
+  buckets_[k]++;
+  count_++;
+  sum_+=usecs;
+}
+
+void Histogram::Merge(const Histogram& other){
+  for(int k=0;k<kNumBuckets;k++)
+    buckets_[k]+=other.buckets_[k];
+  count_+=other.count_;
+  sum_+=other.sum_;
+}
+
+int64_t Histogram::Percentile(float p) const{
+  int64_t n=0;
+  for(int k=0;k<kNumBuckets;k++){
+    n+=buckets_[k];
+    if(n>=p*count_)
+      return int64_t(1)<<k;
+  }
+  return int64_t(1)<<(kNumBuckets-1);
+}
+
+string Histogram::ToString() const{
+  return StringPrintf("mean %8.1f p50 %7ld p90 %7ld p99 %7ld", mean(),
+      long(Percentile(0.5f)), long(Percentile(0.9f)), long(Percentile(0.99f)));
+}
+
+void RequestStats::Merge(const RequestStats& other){
+  nmsgs+=other.nmsgs;
+  nbytes+=other.nbytes;
+  wait.Merge(other.wait);
+  apply.Merge(other.apply);
+}
+
+/****************************ServerMetrics**********************************/
+ServerMetrics::ServerMetrics(int nshards, int nstripes, const string& path,
+    int period): shards_(nshards), max_depth_(nstripes, 0), path_(path),
+  period_(period){
+  last_dump_=zclock_mono();
+}
+
+void ServerMetrics::Record(int shard, int paramid, const string& worker,
+    size_t bytes, int64_t wait, int64_t apply){
+  if(!enabled())
+    return;
+  Shard& s=shards_.at(shard);
+  std::unique_lock<std::mutex> lck(s.mtx);
+  for(RequestStats* stats: {&s.params[paramid], &s.workers[worker]}){
+    stats->nmsgs++;
+    stats->nbytes+=bytes;
+    stats->wait.Add(wait);
+    stats->apply.Add(apply);
+  }
+}
+
+void ServerMetrics::RecordQueue(int stripe, size_t depth){
+  if(!enabled())
+    return;
+  std::unique_lock<std::mutex> lck(queue_mtx_);
+  max_depth_.at(stripe)=std::max(max_depth_.at(stripe), depth);
+}
+
+void ServerMetrics::DumpIfDue(){
+  if(!enabled())
+    return;
+  int64_t now=zclock_mono();
+  if(now-last_dump_<period_*1000LL)
+    return;
+  Dump((now-last_dump_)/1000.f);
+  last_dump_=now;
+}
+
+static string StatsToString(const RequestStats& stats, float seconds){
+  return StringPrintf("msgs/s %9.1f MB/s %8.3f wait(us) %s apply(us) %s",
+      stats.nmsgs/seconds, stats.nbytes/seconds/1024/1024,
+      stats.wait.ToString().c_str(), stats.apply.ToString().c_str());
+}
+
+void ServerMetrics::Dump(float seconds){
+  std::map<int, RequestStats> params;
+  std::map<string, RequestStats> workers;
+  for(auto& shard: shards_){
+    std::unique_lock<std::mutex> lck(shard.mtx);
+    for(auto& entry: shard.params)
+      params[entry.first].Merge(entry.second);
+    for(auto& entry: shard.workers)
+      workers[entry.first].Merge(entry.second);
+    shard.params.clear();
+    shard.workers.clear();
+  }
+  vector<size_t> depth;
+  {
+    std::unique_lock<std::mutex> lck(queue_mtx_);
+    depth=max_depth_;
+    std::fill(max_depth_.begin(), max_depth_.end(), 0);
+  }
+
+  std::ofstream ofs(path_, std::ofstream::app);
+  if(!ofs.is_open()){
+    LOG(ERROR)<<"Cannot open metrics file "<<path_;
+    return;
+  }
+  ofs<<StringPrintf("==== metrics of last %.1f seconds ====\n", seconds);
+  // hot Params first
+  vector<std::pair<int, RequestStats*>> sorted;
+  for(auto& entry: params)
+    sorted.push_back(std::make_pair(entry.first, &entry.second));
+  std::sort(sorted.begin(), sorted.end(),
+      [](const std::pair<int, RequestStats*>& a,
+        const std::pair<int, RequestStats*>& b){
+      return a.second->nbytes>b.second->nbytes;});
+  for(auto& entry: sorted)
+    ofs<<StringPrintf("param  %6d ", entry.first)
+      <<StatsToString(*entry.second, seconds)<<"\n";
+  for(auto& entry: workers)
+    ofs<<"worker "<<entry.first<<" "<<StatsToString(entry.second, seconds)
+      <<"\n";
+  for(size_t k=0;k<depth.size();k++)
+    ofs<<StringPrintf("stripe %6zu max queue depth %zu\n", k, depth[k]);
+}
+} /* singa */
@@ -1,6 +1,5 @@
 #include <list>
-#include <tuple>
-#include <queue>
+#include <thread>
 #include "server/server.h"
 #include "utils/router.h"
 #include "utils/param.h"
@@ -9,36 +8,224 @@
 
 
 namespace singa {
+// server threads send replies to the router thread through this endpoint
+#define kReplyEndpoint "inproc://singa-server-reply"
 
-Server::Server(shared_ptr<Cluster> cluster){
+Server::Server(shared_ptr<Cluster> cluster, const UpdaterProto& updater){
   cluster_=cluster;
+  events_=0;
+  running_=false;
+  if(updater.update_on_server())
+    updater_=CreateUpdater(updater);
+  nupdates_=cluster_->synchronous()?cluster_->ngroups():1;
 }
 
-// actor function to handle sync request from workers
-void HandleSyncFromWorker(zsock_t* pipe, void* args){
-  zsock_signal(pipe, 0);
-  bool terminated=false;
-  auto *params=(std::map<int, shared_ptr<Param>>*)args;
-  char* idstr;
-  int id;
-  while(!terminated){
-    zmsg_t* msg=zmsg_recv(pipe);
-    if(!msg) break;
-    idstr=zmsg_popstr(msg);
-    if(streq(idstr, "$TERM")){
-      terminated=true;
+bool Server::PopRequest(ParamStripe* stripe, ServerRequest* req){
+  std::unique_lock<std::mutex> lck(stripe->mtx);
+  for(auto it=stripe->requests.begin();it!=stripe->requests.end();it++){
+    int id=it->paramid;
+    // the requested Param is not available or is being updated, respond later
+    if(stripe->params.find(id)==stripe->params.end()
+        ||stripe->busy.find(id)!=stripe->busy.end())
+      continue;
+    *req=*it;
+    stripe->requests.erase(it);
+    stripe->busy.insert(id);
+    return true;
+  }
+  return false;
+}
+
+void Server::ReleaseParam(ParamStripe* stripe, int paramid){
+  {
+    std::unique_lock<std::mutex> lck(stripe->mtx);
+    stripe->busy.erase(paramid);
+  }
+  std::unique_lock<std::mutex> lck(mtx_);
+  events_++;
+  cv_.notify_all();
+}
+
+void Server::PushRequest(const ServerRequest& req){
+  {
+    ParamStripe* s=stripe(req.paramid);
+    std::unique_lock<std::mutex> lck(s->mtx);
+    s->requests.push_back(req);
+    metrics_->RecordQueue(req.paramid%stripes_.size(), s->requests.size());
+  }
+  std::unique_lock<std::mutex> lck(mtx_);
+  events_++;
+  cv_.notify_one();
+}
+
+bool Server::Idle(){
+  for(auto& s: stripes_){
+    std::unique_lock<std::mutex> lck(s->mtx);
+    if(s->requests.size()||s->busy.size())
+      return false;
+  }
+  return true;
+}
+
+void Server::HandleUpdate(ParamStripe* stripe, shared_ptr<Param> param,
+    ServerRequest* req, zsock_t* pipe){
+  CHECK(updater_!=nullptr)<<"UpdaterProto::update_on_server is not set";
+  int step;
+  int n=param->HandleUpdateMsg(&req->msg, &step);
+  vector<zframe_t*> identities;
+  {
+    std::unique_lock<std::mutex> lck(stripe->mtx);
+    vector<zframe_t*>& waiting=stripe->waiting[req->paramid];
+    waiting.push_back(req->identity);
+    if(n<nupdates_)
+      return;
+    identities.swap(waiting);
+  }
+  // one pass for the mean gradients of all workers
+  param->WaitUnpinned();
+  param->AverageUpdates();
+  updater_->Update(step, param, 1.0f);
+  param->ClearUpdates();
+  for(zframe_t* identity: identities){
+    // version of the weights after the update of this step
+    zmsg_t* reply=param->GenUpdateReply(step+1);
+    zmsg_prepend(reply, &identity);
+    SendMsg(pipe, &reply);
+  }
+}
+
+void Server::ServeStripe(int sid){
+  zsock_t* pipe=zsock_new_push(">" kReplyEndpoint);
+  CHECK_NOTNULL(pipe);
+  int nstripes=stripes_.size();
+  ServerRequest req;
+  while(true){
+    int64_t events;
+    {
+      std::unique_lock<std::mutex> lck(mtx_);
+      if(!running_) break;
+      events=events_;
+    }
+    // own stripe first, then steal from others
+    ParamStripe* s=nullptr;
+    for(int k=0;k<nstripes&&s==nullptr;k++)
+      if(PopRequest(stripes_[(sid+k)%nstripes].get(), &req))
+        s=stripes_[(sid+k)%nstripes].get();
+    if(s==nullptr){
+      std::unique_lock<std::mutex> lck(mtx_);
+      cv_.wait(lck, [&]{return !running_||events_!=events;});
+      continue;
+    }
+    shared_ptr<Param> param;
+    {
+      std::unique_lock<std::mutex> lck(s->mtx);
+      param=s->params.at(req.paramid);
+    }
+    int64_t tstart=zclock_usecs();
+    string worker;
+    size_t bytes=0;
+    if(metrics_->enabled()){
+      char* hex=zframe_strhex(req.identity);
+      worker=hex;
+      free(hex);
+      bytes=MsgSize(req.msg);
+    }
+    if(req.type==kUpdate){
+      HandleUpdate(s, param, &req, pipe);
+      metrics_->Record(sid, req.paramid, worker, bytes, tstart-req.arrival,
+          zclock_usecs()-tstart);
+      ReleaseParam(s, req.paramid);
+      continue;
+    }
+    zmsg_t* reply=nullptr;
+    if(req.type==kGet)
+      reply=param->HandleGetMsg(&req.msg);
+    else
+      reply=param->HandleSyncMsg(&req.msg);
+    // the reply starts with the header of the request
+    CHECK_NOTNULL(reply);
+    zmsg_prepend(reply, &req.identity);
+    SendMsg(pipe, &reply);
+    metrics_->Record(sid, req.paramid, worker, bytes, tstart-req.arrival,
+        zclock_usecs()-tstart);
+    // release after sending, hence Idle() implies all replies are queued
+    ReleaseParam(s, req.paramid);
+  }
+  zsock_destroy(&pipe);
+}
+
+int Server::HandleMsg(zframe_t* identity, zmsg_t* msg){
+  // the header is kept in the msg and handled by the Param
+  const MsgHeader* header=PeekHeader(msg);
+  int type=header->type, id=header->paramid;
+  switch (type){
+    case kGet:
+    case kSync:
+    case kUpdate:
+      PushRequest(ServerRequest{type, id, identity, msg, zclock_usecs()});
+      break;
+    case kPut:
+      {
+        //DLOG(ERROR)<<"kPut";
+        Factory<Param>* factory=Singleton<Factory<Param>>::Instance();
+        ParamStripe* s=stripe(id);
+        {
+          std::unique_lock<std::mutex> lck(s->mtx);
+          if(s->params.find(id)==s->params.end()){
+            s->params[id]=shared_ptr<Param>(factory->Create("Param"));
+            s->params[id]->set_id(id);
+          }
+          s->params[id]->HandlePutMsg(&msg);
+        }
+        zframe_destroy(&identity);
+        // wake up threads for get requests waiting for this Param
+        std::unique_lock<std::mutex> lck(mtx_);
+        events_++;
+        cv_.notify_all();
+      }
+      break;
+    case kStop:
+      zframe_destroy(&identity);
       zmsg_destroy(&msg);
-    } else{
-      sscanf(idstr, "%d", &id);
-      zframe_t* identity=zmsg_pop(msg);
-      zmsg_t* reply=params->at(id)->HandleSyncMsg(&msg);
-      CHECK_NOTNULL(reply);
-      zmsg_pushstr(reply, idstr);
-      zmsg_pushstrf(reply, "%d", kSync);
-      zmsg_prepend(reply, &identity);
-      zmsg_send(&reply,pipe);
+      return 1;
+    default:
+      LOG(ERROR)<<"Unknown msg type "<<type;
+      zframe_destroy(&identity);
+      zmsg_destroy(&msg);
+      break;
+  }
+  return 0;
+}
+
+void Server::ForwardReplies(zsock_t* replies, zsock_t* router){
+  // replies to the same worker that are ready now are sent in one batch
+  std::map<string, vector<zmsg_t*>> parts;
+  std::map<string, zframe_t*> identities;
+  size_t size=0, limit=cluster_->largest_message();
+  do{
+    zmsg_t* msg=zmsg_recv(replies);
+    zframe_t* identity=zmsg_pop(msg);
+    string key((char*)zframe_data(identity), zframe_size(identity));
+    if(identities.find(key)==identities.end())
+      identities[key]=identity;
+    else
+      zframe_destroy(&identity);
+    size+=MsgSize(msg);
+    parts[key].push_back(msg);
+  }while(size<limit&&(zsock_events(replies)&ZMQ_POLLIN));
+
+  for(auto& entry: parts){
+    zmsg_t* msg=nullptr;
+    if(entry.second.size()==1){
+      msg=entry.second.front();
+    }else{
+      msg=zmsg_new();
+      PushHeader(msg, MsgHeader{kBatch, -1, 0, 0, 0, 0, 0.f});
+      for(zmsg_t* part: entry.second)
+        AddToBatch(msg, &part);
     }
-    delete idstr;
+    zmsg_prepend(msg, &identities[entry.first]);
+    zmsg_send(&msg, router);
   }
 }
 
@@ -46,171 +233,62 @@ void Server::Run(){
   Router binder(cluster_->router_port());
   CHECK(binder.Bind(cluster_->server_addr(), cluster_->nworkers()));
   zsock_t* router=binder.router();
+  zsock_t* replies=zsock_new_pull("@" kReplyEndpoint);
+  CHECK_NOTNULL(replies);
+  zpoller_t* poller=zpoller_new(router, replies, NULL);
 
-  std::map<int, shared_ptr<Param>> params;
-  std::queue<zactor_t*> actors;
-  zpoller_t* poller=zpoller_new(router, NULL);
-  int nactors=cluster_->nthreads_per_server();
-  // handle sync request by launching a set of actor threads.
-  for(int i=0;i<nactors;i++){
-    zactor_t * actor=zactor_new(HandleSyncFromWorker, &params);
-    CHECK_NOTNULL(actor);
-    actors.push(actor);
-    zpoller_add(poller, actors.back());
-  }
-
-  std::map<int, bool> locks; // TODO avoid actors updates the same Param
-  std::list<std::tuple<int, zframe_t*, zmsg_t*>> getRequest;
-  std::list<std::tuple<int, zframe_t*, zmsg_t*>> syncRequest;
-  std::map<zactor_t*, int> actor2paramid;
+  int nthreads=cluster_->nthreads_per_server();
+  for(int i=0;i<nthreads;i++)
+    stripes_.push_back(std::make_shared<ParamStripe>());
+  metrics_=std::make_shared<ServerMetrics>(nthreads, nthreads,
+      cluster_->log_folder()+"/server"
+      +std::to_string(cluster_->global_procsid())+"-metrics.txt",
+      cluster_->metrics_period());
+  running_=true;
+  vector<std::thread> threads;
+  for(int i=0;i<nthreads;i++)
+    threads.push_back(std::thread(&Server::ServeStripe, this, i));
 
   int nstop=0; // stop server when recv nstop msgs, one from a worker
-  int id, type;
-  char* idstr=nullptr, *typestr=nullptr;
-  int64_t start=0, dsize=0; // monitor network throughput
   while(true){
-    void* which=zpoller_wait(poller, -1);
+    // wake up periodically to dump metrics
+    int timeout=metrics_->enabled()?1000:-1;
+    void* which=zpoller_wait(poller, nstop==cluster_->nworkers()?100:timeout);
+    metrics_->DumpIfDue();
     if(which==router){ // recv message from workers;
-      // the msg frames are :worker identity, type, Param ID, control, content
+      // the msg frames are :worker identity, MsgHeader, content
       zmsg_t* msg=zmsg_recv(router); if(!msg) break;
       zframe_t* identity=zmsg_pop(msg); if(!identity) break;
-      typestr=zmsg_popstr(msg); sscanf(typestr, "%d", &type); delete typestr;
-      switch (type){
-        case kGet:
-          {
-            //DLOG(ERROR)<<"kGet";
-            idstr=zmsg_popstr(msg); sscanf(idstr, "%d", &id); delete idstr;
-            if(params.find(id)==params.end()){
-              // the requested Param is not available, repsond later
-              getRequest.push_back(
-                  std::make_tuple(id, identity, msg));
-            }else{// response msg of the same structure as recv msg.
-              zmsg_t* reply=params[id]->HandleGetMsg(&msg);
-              zmsg_pushstrf(reply, "%d", id);
-              zmsg_pushstrf(reply, "%d", kGet);
-              zmsg_prepend(reply, &identity);
-              zmsg_send(&reply, router);
-            }
-          }
-          break;
-        case kPut:
-          {
-            //DLOG(ERROR)<<"kPut";
-            idstr=zmsg_popstr(msg); sscanf(idstr, "%d", &id); delete idstr;
-            Factory<Param>* factory=Singleton<Factory<Param>>::Instance();
-            if(params.find(id)==params.end()){
-              params[id]=shared_ptr<Param>(factory->Create("Param"));
-              params[id]->set_id(id);
-              locks[id]=false;
-            }
-            params[id]->HandlePutMsg(&msg);
-            zframe_destroy(&identity);
-          }
-          break;
-        case kSync:
-          {
-            idstr=zmsg_popstr(msg); sscanf(idstr, "%d", &id); delete idstr;
-            /*
-            {// monitor network throught put for recving msgs.
-              if(start==0)
-                start=zclock_mono();
-              int64_t now=zclock_mono();
-              if(now-start>10000){
-                LOG(ERROR)<<"server recv speed "
-                  <<dsize*1.0f*sizeof(float)/1024/1024/(now-start)*1000<<"MB/s";
-                start=now;
-                dsize=0;
-              }
-              char* control=zframe_strdup(zmsg_first(msg));
-              unsigned seed; int count;
-              sscanf(control, "%u-%d", &seed, &count); delete control;
-              dsize+=count;
-            }
-            */
-            if(!locks[id]){
-              CHECK(!actors.empty());
-              zmsg_prepend(msg, &identity);
-              zmsg_pushstrf(msg, "%d", id);
-              CHECK(!actors.empty());
-              zactor_send(actors.front(), &msg);
-              locks[id]=true;
-              actor2paramid[actors.front()]=id;
-              actors.pop();
-            }else{
-              syncRequest.push_back(
-                  std::make_tuple(id, identity, msg));
-            }
-          }
-          break;
-        case kStop:
-            nstop++;
-          break;
-        default: LOG(ERROR)<<"Unknown msg type "<<type; break;
-      }
-    }else{
-      zactor_t* actor=(zactor_t*)which;
-      actors.push(actor);
-      zmsg_t* msg=zactor_recv(actor);
-      zmsg_send(&msg, router);
-      locks[actor2paramid[actor]]=false;
-    }
-
-    for(auto it=getRequest.begin();it!=getRequest.end();){
-      int id=std::get<0>(*it);
-      if(params.find(id)!=params.end()){
-        zframe_t* identity=std::get<1>(*it);
-        zmsg_t* msg=std::get<2>(*it);
-        CHECK_NOTNULL(msg);
-        zmsg_t* reply=params[id]->HandleGetMsg(&msg);
-        zmsg_pushstrf(reply, "%d", id);
-        zmsg_pushstrf(reply, "%d", kGet);
-        zmsg_prepend(reply, &identity);
-        zmsg_send(&reply, router);
-        it=getRequest.erase(it);
+      if(PeekHeader(msg)->type==kBatch){
+        // fan out msgs of one batch as if they were sent separately
+        for(zmsg_t* part: UnpackBatch(&msg)){
+          zframe_t* dup=zframe_dup(identity);
+          nstop+=HandleMsg(dup, part);
+        }
+        zframe_destroy(&identity);
       }else{
-        it++;
+        nstop+=HandleMsg(identity, msg);
       }
-    }
-    if(actors.empty()){
-      CHECK_EQ(0,zpoller_remove(poller, router));
-      zactor_t* actor=(zactor_t*)zpoller_wait(poller, -1);
-      actors.push(actor);
-      zmsg_t* msg=zactor_recv(actor);
-      zmsg_send(&msg, router);
-      CHECK_EQ(0,zpoller_add(poller, router));
-      locks[actor2paramid[actor]]=false;
-    }
-    for(auto it=syncRequest.begin();it!=syncRequest.end();){
-      int id=std::get<0>(*it);
-      if(!locks[id]){
-        CHECK(!actors.empty());
-        zframe_t* identity=std::get<1>(*it);
-        zmsg_t* msg=std::get<2>(*it);
-        CHECK_NOTNULL(msg);
-        zmsg_prepend(msg, &identity);
-        zmsg_pushstrf(msg, "%d", id);
-        zactor_send(actors.front(), &msg);
-        locks[id]=true;
-        actor2paramid[actors.front()]=id;
-        actors.pop();
-        it=syncRequest.erase(it);
-      }else{
-        it++;
-      }
-    }
-
-    // stop all actors
-    if(nstop==cluster_->nworkers()&&actors.size()==nactors){
-      while(!actors.empty()){
-        zactor_t* actor=actors.front();
-        zactor_destroy(&actor);
-        actors.pop();
-      }
-      LOG(ERROR)<<"Server is shuting down";
+    }else if(which==replies){
+      ForwardReplies(replies, router);
+    }else if(nstop==cluster_->nworkers()&&Idle()){
+      // stop all server threads after all replies are forwarded
       break;
     }
   }
+  {
+    std::unique_lock<std::mutex> lck(mtx_);
+    running_=false;
+    cv_.notify_all();
+  }
+  for(auto& th: threads)
+    th.join();
+  zpoller_remove(poller, router);
+  while(zpoller_wait(poller, 0)==replies)
+    ForwardReplies(replies, router);
+  LOG(ERROR)<<"Server is shuting down";
   zpoller_destroy(&poller);
+  zsock_destroy(&replies);
 }
 
 } /* singa */
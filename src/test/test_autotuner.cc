@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include "worker/autotuner.h"
+using namespace singa;
+using std::string;
+
+extern "C" int openblas_get_num_threads();
+
+class AutotunerTest: public ::testing::Test{
+ protected:
+  virtual void SetUp(){
+    path_="/tmp/test_autotuner."+std::to_string(getpid());
+    std::remove(path_.c_str());
+  }
+  virtual void TearDown(){
+    std::remove(path_.c_str());
+  }
+  void WriteCache(const string& key, const string& choice){
+    std::ofstream ofs(path_);
+    ofs<<key<<"\t"<<choice<<"\n";
+  }
+  ConvShape Shape(int batchsize, int channels, int size, int num_filters,
+      int kernel, int pad){
+    int conv=size+2*pad-kernel+1;
+    return ConvShape{batchsize, channels, size, size, num_filters, kernel, pad,
+      1, conv, conv};
+  }
+
+  string path_;
+};
+
+TEST_F(AutotunerTest, ConvChoiceIsLoaded){
+  // a choice the tuner would hardly make, hence it is not timed again
+  ConvShape shape=Shape(2, 16, 8, 16, 3, 1);
+  ASSERT_TRUE(ConvEngineSupports(ConvolutionProto::kDirect, shape));
+  WriteCache("conv 2 16 8 8 16 3 1 1", "kDirect 3");
+  Autotuner tuner(path_);
+  ConvolutionProto proto;
+  ConvolutionProto tuned=tuner.TuneConv(shape, proto);
+  EXPECT_EQ(ConvolutionProto::kDirect, tuned.engine());
+  EXPECT_EQ(3, tuned.col_block());
+}
+
+TEST_F(AutotunerTest, UnsupportedChoiceIsTunedAgain){
+  // Winograd does not support 5x5 kernels
+  ConvShape shape=Shape(1, 3, 9, 4, 5, 2);
+  ASSERT_FALSE(ConvEngineSupports(ConvolutionProto::kWinograd, shape));
+  WriteCache("conv 1 3 9 9 4 5 2 1", "kWinograd 0");
+  Autotuner tuner(path_);
+  ConvolutionProto tuned=tuner.TuneConv(shape, ConvolutionProto());
+  EXPECT_NE(ConvolutionProto::kWinograd, tuned.engine());
+  EXPECT_TRUE(ConvEngineSupports(tuned.engine(), shape));
+}
+
+TEST_F(AutotunerTest, ConvChoiceIsSavedAndReloaded){
+  ConvShape shape=Shape(2, 3, 7, 5, 3, 1);
+  ConvolutionProto tuned;
+  {
+    Autotuner tuner(path_);
+    tuned=tuner.TuneConv(shape, ConvolutionProto());
+    tuner.Save();
+  }
+  Autotuner tuner(path_);
+  ConvolutionProto reloaded=tuner.TuneConv(shape, ConvolutionProto());
+  EXPECT_EQ(tuned.engine(), reloaded.engine());
+  EXPECT_EQ(tuned.col_block(), reloaded.col_block());
+}
+
+TEST_F(AutotunerTest, BlasThreadsAreLoaded){
+  WriteCache("blas 4 9x31x100", "3");
+  Autotuner tuner(path_);
+  tuner.AddGemm(9, 31, 100);
+  tuner.TuneBlasThreads(4);
+  EXPECT_EQ(3, openblas_get_num_threads());
+  // a stale choice larger than the max thread count is tuned again
+  WriteCache("blas 2 9x31x100", "3");
+  Autotuner retuner(path_);
+  retuner.AddGemm(9, 31, 100);
+  retuner.TuneBlasThreads(2);
+  EXPECT_LE(openblas_get_num_threads(), 2);
+}
+
+TEST_F(AutotunerTest, ChoicesOfOtherProcsAreKept){
+  ConvShape shape=Shape(2, 3, 7, 5, 3, 1);
+  Autotuner tuner(path_);
+  tuner.TuneConv(shape, ConvolutionProto());
+  // saved by another proc after this tuner loaded the cache
+  WriteCache("conv 2 16 8 8 16 3 1 1", "kDirect 3");
+  tuner.Save();
+  Autotuner reloaded(path_);
+  ConvolutionProto other=reloaded.TuneConv(Shape(2, 16, 8, 16, 3, 1),
+      ConvolutionProto());
+  EXPECT_EQ(ConvolutionProto::kDirect, other.engine());
+  EXPECT_EQ(3, other.col_block());
+  std::ifstream tmp(path_+".tmp."+std::to_string(getpid()));
+  EXPECT_FALSE(tmp.is_open());
+}
@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "utils/codec.h"
+using namespace singa;
+using std::vector;
+
+// odd sizes exercise the scalar tails after the SIMD kernels
+const int kSizes[]={1, 7, 8, 33, 255, 256, 257, 1000};
+
+vector<float> RandomFloats(int n, float scale, unsigned seed){
+  std::mt19937 gen(seed);
+  std::normal_distribution<float> dist(0.f, scale);
+  vector<float> ret(n);
+  for(auto& x: ret)
+    x=dist(gen);
+  return ret;
+}
+
+vector<float> RoundTrip(WireFormat fmt, const vector<float>& src){
+  int n=src.size();
+  vector<char> buf(EncodedSize(fmt, n));
+  vector<float> ret(n);
+  Encode(fmt, src.data(), n, buf.data());
+  Decode(fmt, buf.data(), n, ret.data());
+  return ret;
+}
+
+TEST(CodecTest, EncodedSize){
+  EXPECT_EQ(4*100u, EncodedSize(UpdaterProto::kFloat32, 100));
+  EXPECT_EQ(2*100u, EncodedSize(UpdaterProto::kFloat16, 100));
+  EXPECT_EQ(2*100u, EncodedSize(UpdaterProto::kBFloat16, 100));
+  EXPECT_EQ(4+100u, EncodedSize(UpdaterProto::kInt8, 100));
+  EXPECT_EQ(4*2+257u, EncodedSize(UpdaterProto::kInt8, 257));
+}
+
+TEST(CodecTest, Float32IsExact){
+  for(int n: kSizes){
+    vector<float> src=RandomFloats(n, 1.f, n);
+    vector<float> dst=RoundTrip(UpdaterProto::kFloat32, src);
+    EXPECT_EQ(0, memcmp(src.data(), dst.data(), sizeof(float)*n));
+  }
+}
+
+TEST(CodecTest, Float16ErrorBound){
+  for(int n: kSizes){
+    vector<float> src=RandomFloats(n, 10.f, n);
+    vector<float> dst=RoundTrip(UpdaterProto::kFloat16, src);
+    for(int i=0;i<n;i++){
+      // 10 mantissa bits, rounded to nearest
+      EXPECT_LE(std::fabs(dst[i]-src[i]), std::fabs(src[i])/2048.f+1e-7f)
+        <<"n="<<n<<" i="<<i;
+    }
+  }
+}
+
+TEST(CodecTest, Float16Special){
+  vector<float> src{0.f, -0.f, 1.f, -2.f, 65504.f, 1e6f, -1e6f, 6e-8f, 1e-9f,
+    INFINITY, -INFINITY, 0.5f, 0.333251953125f};
+  vector<float> dst=RoundTrip(UpdaterProto::kFloat16, src);
+  EXPECT_EQ(0.f, dst[0]);
+  EXPECT_TRUE(std::signbit(dst[1]));
+  EXPECT_EQ(1.f, dst[2]);
+  EXPECT_EQ(-2.f, dst[3]);
+  EXPECT_EQ(65504.f, dst[4]);
+  EXPECT_TRUE(std::isinf(dst[5])&&dst[5]>0);
+  EXPECT_TRUE(std::isinf(dst[6])&&dst[6]<0);
+  // smallest subnormal half is 2^-24
+  EXPECT_FLOAT_EQ(std::ldexp(1.f, -24), dst[7]);
+  EXPECT_EQ(0.f, dst[8]);
+  EXPECT_TRUE(std::isinf(dst[9])&&dst[9]>0);
+  EXPECT_TRUE(std::isinf(dst[10])&&dst[10]<0);
+  EXPECT_EQ(0.5f, dst[11]);
+  EXPECT_EQ(0.333251953125f, dst[12]);
+}
+
+TEST(CodecTest, BFloat16ErrorBound){
+  for(int n: kSizes){
+    vector<float> src=RandomFloats(n, 1e3f, n);
+    vector<float> dst=RoundTrip(UpdaterProto::kBFloat16, src);
+    for(int i=0;i<n;i++){
+      // 7 mantissa bits, rounded to nearest
+      EXPECT_LE(std::fabs(dst[i]-src[i]), std::fabs(src[i])/256.f)
+        <<"n="<<n<<" i="<<i;
+    }
+  }
+}
+
+TEST(CodecTest, BFloat16RoundToNearestEven){
+  // exactly halfway between two bfloat16 values
+  float lo=1.f, hi=1.f+1.f/128, mid=1.f+1.f/256;
+  float odd=1.f+3.f/256;
+  vector<float> dst=RoundTrip(UpdaterProto::kBFloat16,
+      vector<float>{mid, odd, -mid, 3.f});
+  EXPECT_EQ(lo, dst[0]);
+  EXPECT_EQ(1.f+2.f/128, dst[1]);
+  EXPECT_EQ(-lo, dst[2]);
+  EXPECT_EQ(3.f, dst[3]);
+  EXPECT_NE(hi, dst[0]);
+}
+
+TEST(CodecTest, Int8ErrorBound){
+  for(int n: kSizes){
+    vector<float> src=RandomFloats(n, 0.1f, n);
+    vector<float> dst=RoundTrip(UpdaterProto::kInt8, src);
+    for(int b=0;b*kInt8Block<n;b++){
+      int start=b*kInt8Block, end=std::min(n, start+kInt8Block);
+      float absmax=0.f;
+      for(int i=start;i<end;i++)
+        absmax=std::max(absmax, std::fabs(src[i]));
+      // half a quantization step of the block, plus float rounding
+      float bound=absmax/127.f/2*1.001f;
+      for(int i=start;i<end;i++)
+        EXPECT_LE(std::fabs(dst[i]-src[i]), bound)<<"n="<<n<<" i="<<i;
+    }
+  }
+}
+
+TEST(CodecTest, Int8KeepsBlockMax){
+  // the largest magnitude of each block is recovered (almost) exactly,
+  // and a zero block stays zero
+  vector<float> src(2*kInt8Block, 0.f);
+  for(int i=0;i<kInt8Block;i++)
+    src[i]=0.01f*(i%7)-0.03f;
+  src[100]=-5.f;
+  vector<float> dst=RoundTrip(UpdaterProto::kInt8, src);
+  EXPECT_NEAR(-5.f, dst[100], 1e-5f);
+  for(int i=kInt8Block;i<2*kInt8Block;i++)
+    EXPECT_EQ(0.f, dst[i]);
+}
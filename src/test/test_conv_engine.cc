@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "worker/conv_engine.h"
+using namespace singa;
+using std::vector;
+
+/**
+ * Outputs of one engine for the same inputs.
+ */
+struct ConvResult{
+  vector<float> data, gweight, gsrc;
+};
+
+class ConvEngineTest: public ::testing::Test{
+ protected:
+  void Init(int batchsize, int channels, int height, int width,
+      int num_filters, int kernel, int pad, int stride){
+    shape_=ConvShape{batchsize, channels, height, width, num_filters, kernel,
+      pad, stride, (height+2*pad-kernel)/stride+1,
+      (width+2*pad-kernel)/stride+1};
+    std::mt19937 gen(batchsize*1000+channels*100+height*10+kernel);
+    std::uniform_real_distribution<float> dist(-1.f, 1.f);
+    src_.resize(batchsize*channels*height*width);
+    weight_.resize(num_filters*channels*kernel*kernel);
+    grad_.resize(batchsize*num_filters*shape_.conv_height*shape_.conv_width);
+    for(vector<float>* v: {&src_, &weight_, &grad_})
+      for(float& x: *v)
+        x=dist(gen);
+  }
+
+  ConvResult Run(ConvolutionProto::Engine type){
+    ConvolutionProto proto;
+    auto engine=CreateConvEngine(type, shape_, proto);
+    EXPECT_EQ(type, engine->type());
+    ConvResult ret;
+    ret.data.resize(grad_.size());
+    ret.gweight.resize(weight_.size());
+    ret.gsrc.resize(src_.size());
+    // the epilogue must visit every image exactly once
+    vector<int> visits(shape_.batchsize, 0);
+    engine->Forward(true, src_.data(), weight_.data(), ret.data.data(),
+        [&](int n, int nb, float* data){
+          EXPECT_EQ(ret.data.data()+n*grad_.size()/shape_.batchsize, data);
+          for(int k=n;k<n+nb;k++)
+            visits.at(k)++;
+        });
+    for(int k=0;k<shape_.batchsize;k++)
+      EXPECT_EQ(1, visits[k]);
+    engine->Backward(src_.data(), weight_.data(), grad_.data(),
+        ret.gweight.data(), ret.gsrc.data());
+    return ret;
+  }
+
+  /**
+   * Naive convolution by definition.
+   */
+  ConvResult Reference(){
+    const ConvShape& s=shape_;
+    ConvResult ret;
+    ret.data.assign(grad_.size(), 0.f);
+    ret.gweight.assign(weight_.size(), 0.f);
+    ret.gsrc.assign(src_.size(), 0.f);
+    for(int n=0;n<s.batchsize;n++)
+      for(int f=0;f<s.num_filters;f++)
+        for(int y=0;y<s.conv_height;y++)
+          for(int x=0;x<s.conv_width;x++){
+            int o=((n*s.num_filters+f)*s.conv_height+y)*s.conv_width+x;
+            for(int c=0;c<s.channels;c++)
+              for(int i=0;i<s.kernel;i++)
+                for(int j=0;j<s.kernel;j++){
+                  int h=y*s.stride-s.pad+i, w=x*s.stride-s.pad+j;
+                  if(h<0||h>=s.height||w<0||w>=s.width)
+                    continue;
+                  int si=((n*s.channels+c)*s.height+h)*s.width+w;
+                  int wi=((f*s.channels+c)*s.kernel+i)*s.kernel+j;
+                  ret.data[o]+=src_[si]*weight_[wi];
+                  ret.gweight[wi]+=src_[si]*grad_[o];
+                  ret.gsrc[si]+=weight_[wi]*grad_[o];
+                }
+          }
+    return ret;
+  }
+
+  void ExpectNear(const vector<float>& expected, const vector<float>& actual,
+      const char* name){
+    ASSERT_EQ(expected.size(), actual.size());
+    for(size_t i=0;i<expected.size();i++)
+      ASSERT_NEAR(expected[i], actual[i], 1e-4f*(1+std::fabs(expected[i])))
+        <<name<<"["<<i<<"]";
+  }
+
+  void ExpectNear(const ConvResult& expected, const ConvResult& actual){
+    ExpectNear(expected.data, actual.data, "data");
+    ExpectNear(expected.gweight, actual.gweight, "gweight");
+    ExpectNear(expected.gsrc, actual.gsrc, "gsrc");
+  }
+
+  /**
+   * Compare im2col with the reference, and other engines supporting the
+   * shape with im2col.
+   */
+  void CheckEngines(){
+    ConvResult im2col=Run(ConvolutionProto::kIm2col);
+    ExpectNear(Reference(), im2col);
+    for(auto type: {ConvolutionProto::kDirect, ConvolutionProto::kWinograd}){
+      if(ConvEngineSupports(type, shape_)){
+        SCOPED_TRACE(ConvolutionProto::Engine_Name(type));
+        ExpectNear(im2col, Run(type));
+      }
+    }
+  }
+
+  ConvShape shape_;
+  vector<float> src_, weight_, grad_;
+};
+
+TEST_F(ConvEngineTest, Kernel3NoPad){
+  Init(2, 17, 7, 10, 18, 3, 0, 1);
+  CheckEngines();
+}
+
+TEST_F(ConvEngineTest, Kernel3Pad1){
+  Init(2, 3, 9, 8, 5, 3, 1, 1);
+  CheckEngines();
+}
+
+TEST_F(ConvEngineTest, Kernel3Pad2OddSize){
+  // odd output sizes leave partial Winograd tiles
+  Init(1, 16, 7, 5, 16, 3, 2, 1);
+  CheckEngines();
+}
+
+TEST_F(ConvEngineTest, Kernel5Pad2){
+  Init(3, 4, 11, 11, 6, 5, 2, 1);
+  CheckEngines();
+}
+
+TEST_F(ConvEngineTest, Kernel1){
+  Init(2, 3, 8, 8, 7, 1, 0, 1);
+  CheckEngines();
+}
+
+TEST_F(ConvEngineTest, Stride2){
+  // only im2col supports strides
+  Init(2, 3, 11, 9, 4, 3, 1, 2);
+  CheckEngines();
+}
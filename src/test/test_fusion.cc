@@ -0,0 +1,188 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include "worker/neuralnet.h"
+#include "utils/factory.h"
+#include "utils/singleton.h"
+#include "mshadow/tensor.h"
+using namespace singa;
+using std::string;
+using std::vector;
+
+/**
+ * Source layer of the test nets, whose shape is set by the test.
+ */
+class TestInputLayer: public Layer{
+ public:
+  static vector<int> shape;
+  virtual void Setup(const LayerProto& proto, const vector<SLayer>& srclayers){
+    data_.Reshape(shape);
+    grad_.Reshape(shape);
+  }
+  virtual void SetupAfterPartition(const LayerProto& proto,
+      const vector<int> &shape, const vector<SLayer>& srclayers){
+    Setup(proto, srclayers);
+  }
+  virtual void ComputeFeature(bool training, const vector<SLayer>& srclayers){}
+  virtual void ComputeGradient(const vector<SLayer>& srclayers){}
+};
+vector<int> TestInputLayer::shape;
+
+/**
+ * Outputs of one net for the same inputs.
+ */
+struct NetResult{
+  vector<float> data, gsrc;
+  vector<vector<float>> gparams;
+};
+
+class FusionTest: public ::testing::Test{
+ protected:
+  static void SetUpTestCase(){
+    NeuralNet::RegistryLayers();
+    NeuralNet::RegistryParam("RandomSync");
+    Singleton<Factory<Layer>>::Instance()->Register("kTestInput",
+        CreateInstance(TestInputLayer, Layer));
+  }
+
+  LayerProto* AddLayer(const string& name, const string& type,
+      const string& src){
+    LayerProto* layer=proto_.add_layer();
+    layer->set_name(name);
+    layer->set_type(type);
+    if(src.size())
+      layer->add_srclayers(src);
+    return layer;
+  }
+  void AddParams(LayerProto* layer){
+    layer->add_param()->set_name(layer->name()+"_weight");
+    layer->add_param()->set_name(layer->name()+"_bias");
+  }
+  void AddInput(const vector<int>& shape){
+    TestInputLayer::shape=shape;
+    AddLayer("input", "kTestInput", "");
+  }
+  void AddInnerProduct(const string& name, const string& src, int num_output){
+    LayerProto* layer=AddLayer(name, "kInnerProduct", src);
+    layer->mutable_inner_product_param()->set_num_output(num_output);
+    AddParams(layer);
+  }
+  void AddConvolution(const string& name, const string& src, int num_filters,
+      int kernel, int pad){
+    LayerProto* layer=AddLayer(name, "kConvolution", src);
+    auto* conv=layer->mutable_convolution_param();
+    conv->set_num_filters(num_filters);
+    conv->set_kernel(kernel);
+    conv->set_pad(pad);
+    AddParams(layer);
+  }
+  void AddDropout(const string& name, const string& src){
+    AddLayer(name, "kDropout", src)->mutable_dropout_param()
+      ->set_dropout_ratio(0.3f);
+  }
+
+  /**
+   * Run one forward and backward pass on fixed inputs, params, output
+   * gradients and dropout masks.
+   * @param fused number of layers expected to be fused
+   * @param shared number of layers expected to share the data of their src
+   */
+  NetResult Run(bool fuse_layers, bool inplace, int fused, int shared){
+    NetProto proto=proto_;
+    proto.set_fuse_layers(fuse_layers);
+    proto.set_inplace(inplace);
+    NeuralNet net(proto);
+    const auto& layers=net.layers();
+    int nfused=0, nshared=0;
+    for(size_t i=1;i<layers.size();i++){
+      nfused+=layers[i]->fused();
+      nshared+=layers[i]->data().cpu_data()
+        ==layers[i-1]->data(layers[i].get()).cpu_data();
+    }
+    EXPECT_EQ(fused, nfused);
+    EXPECT_EQ(shared, nshared);
+
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> dist(-1.f, 1.f);
+    Blob<float>* src=layers.front()->mutable_data();
+    for(int i=0;i<src->count();i++)
+      src->mutable_cpu_data()[i]=dist(gen);
+    for(auto& param: net.params())
+      for(int i=0;i<param->size();i++)
+        param->mutable_cpu_data()[i]=dist(gen)*0.5f;
+    ASingleton<mshadow::Random<mshadow::cpu>>::Instance()->Seed(1);
+    for(auto& layer: layers)
+      layer->ComputeFeature(true);
+
+    NetResult ret;
+    const Blob<float>& data=layers.back()->data();
+    ret.data.assign(data.cpu_data(), data.cpu_data()+data.count());
+    Blob<float>* grad=layers.back()->mutable_grad();
+    for(int i=0;i<grad->count();i++)
+      grad->mutable_cpu_data()[i]=dist(gen);
+    for(auto it=layers.rbegin();it!=layers.rend();it++)
+      (*it)->ComputeGradient();
+    const Blob<float>& gsrc=layers.front()->grad();
+    ret.gsrc.assign(gsrc.cpu_data(), gsrc.cpu_data()+gsrc.count());
+    for(auto& param: net.params())
+      ret.gparams.push_back(vector<float>(param->mutable_cpu_grad(),
+            param->mutable_cpu_grad()+param->size()));
+    return ret;
+  }
+
+  void ExpectNear(const vector<float>& expected, const vector<float>& actual,
+      const char* name){
+    ASSERT_EQ(expected.size(), actual.size());
+    for(size_t i=0;i<expected.size();i++)
+      ASSERT_NEAR(expected[i], actual[i], 1e-4f*(1+std::fabs(expected[i])))
+        <<name<<"["<<i<<"]";
+  }
+
+  void ExpectNear(const NetResult& expected, const NetResult& actual){
+    ExpectNear(expected.data, actual.data, "data");
+    ExpectNear(expected.gsrc, actual.gsrc, "gsrc");
+    ASSERT_EQ(expected.gparams.size(), actual.gparams.size());
+    for(size_t i=0;i<expected.gparams.size();i++)
+      ExpectNear(expected.gparams[i], actual.gparams[i], "gparam");
+  }
+
+  NetProto proto_;
+};
+
+TEST_F(FusionTest, InnerProductReLUDropout){
+  // more outputs than a fused block, and a partial last block
+  AddInput(vector<int>{9, 31});
+  AddInnerProduct("ip", "input", 1000);
+  AddLayer("relu", "kReLU", "ip");
+  AddDropout("dropout", "relu");
+  ExpectNear(Run(false, false, 0, 0), Run(true, false, 2, 0));
+}
+
+TEST_F(FusionTest, ConvolutionReLU){
+  AddInput(vector<int>{3, 4, 9, 7});
+  AddConvolution("conv", "input", 5, 3, 1);
+  AddLayer("relu", "kReLU", "conv");
+  ExpectNear(Run(false, false, 0, 0), Run(true, false, 1, 0));
+}
+
+TEST_F(FusionTest, InplaceInnerProductDropoutReLU){
+  AddInput(vector<int>{9, 31});
+  AddInnerProduct("ip", "input", 1000);
+  AddDropout("dropout", "ip");
+  AddLayer("relu", "kReLU", "dropout");
+  NetResult expected=Run(false, false, 0, 0);
+  ExpectNear(expected, Run(false, true, 0, 2));
+  ExpectNear(expected, Run(true, true, 2, 2));
+}
+
+TEST_F(FusionTest, InplaceConvolutionTanh){
+  // Tanh computes its gradient from its own output, which it then shares
+  AddInput(vector<int>{3, 4, 9, 7});
+  AddConvolution("conv", "input", 5, 3, 1);
+  AddLayer("tanh", "kTanh", "conv");
+  NetResult expected=Run(false, false, 0, 0);
+  ExpectNear(expected, Run(false, true, 0, 1));
+  ExpectNear(expected, Run(true, true, 1, 1));
+}
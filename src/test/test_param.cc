@@ -0,0 +1,291 @@
+#include <gtest/gtest.h>
+#include <czmq.h>
+#include <cmath>
+#include <random>
+#include <set>
+#include <vector>
+#include "utils/param.h"
+#include "utils/router.h"
+#include "utils/updater.h"
+using namespace singa;
+using std::vector;
+
+class RandomSyncParamTest: public RandomSyncParam{
+ public:
+  using RandomSyncParam::RandomSample;
+};
+
+class TopKSyncParamTest: public TopKSyncParam{
+ public:
+  using TopKSyncParam::TopK;
+};
+
+vector<float> RandomDelta(int n, unsigned seed){
+  std::mt19937 gen(seed);
+  std::normal_distribution<float> dist(0.f, 1.f);
+  vector<float> ret(n);
+  for(auto& x: ret)
+    x=dist(gen);
+  return ret;
+}
+
+/**
+ * Check that idx are distinct and no unselected value is larger (in
+ * magnitude) than a selected one.
+ */
+void CheckTopK(const vector<float>& delta, const vector<int>& idx){
+  std::set<int> selected(idx.begin(), idx.end());
+  ASSERT_EQ(idx.size(), selected.size());
+  float minsel=INFINITY, maxunsel=0.f;
+  for(int i=0;i<static_cast<int>(delta.size());i++){
+    if(selected.count(i))
+      minsel=std::min(minsel, std::fabs(delta[i]));
+    else
+      maxunsel=std::max(maxunsel, std::fabs(delta[i]));
+  }
+  if(!idx.empty()){
+    EXPECT_GE(minsel, maxunsel);
+  }
+}
+
+TEST(RandomSyncParamTest, SampleCoverage){
+  RandomSyncParamTest param;
+  // sizes not a multiple of the 64-float sample blocks have a short block
+  for(int n: {1, 63, 64, 65, 1000, 4097, 100003}){
+    for(int m: {1, n/3, n-1, n, n+5}){
+      if(m<=0)
+        continue;
+      for(unsigned seed: {0u, 1u, 12345u, 4294967295u}){
+        auto segments=param.RandomSample(seed, m, n);
+        vector<char> covered(n, 0);
+        int total=0;
+        for(auto& seg: segments){
+          ASSERT_GE(seg.first, 0);
+          ASSERT_GT(seg.second, 0);
+          ASSERT_LE(seg.first+seg.second, n);
+          for(int i=seg.first;i<seg.first+seg.second;i++){
+            ASSERT_EQ(0, covered[i])<<"n="<<n<<" m="<<m<<" seed="<<seed;
+            covered[i]=1;
+          }
+          total+=seg.second;
+        }
+        EXPECT_EQ(std::min(m, n), total)<<"n="<<n<<" m="<<m<<" seed="<<seed;
+        // the server regenerates the same sample from the seed
+        EXPECT_EQ(segments, param.RandomSample(seed, m, n));
+      }
+    }
+  }
+}
+
+TEST(RandomSyncParamTest, SampleVariesWithSeed){
+  RandomSyncParamTest param;
+  const int n=100003, m=1000;
+  std::set<int> starts;
+  for(unsigned seed=0;seed<20;seed++)
+    starts.insert(param.RandomSample(seed, m, n).at(0).first);
+  EXPECT_GT(starts.size(), 10u);
+}
+
+TEST(TopKSyncParamTest, Exact){
+  // all magnitudes are sampled for n<=1024, hence exactly k are selected
+  TopKSyncParamTest param;
+  vector<float> delta=RandomDelta(1000, 1);
+  for(int k: {1, 10, 100, 999}){
+    vector<int> idx=param.TopK(delta, k);
+    EXPECT_EQ(k, static_cast<int>(idx.size()));
+    CheckTopK(delta, idx);
+  }
+}
+
+TEST(TopKSyncParamTest, Approximate){
+  TopKSyncParamTest param;
+  vector<float> delta=RandomDelta(100000, 2);
+  for(int k: {10, 1000, 20000}){
+    vector<int> idx=param.TopK(delta, k);
+    EXPECT_EQ(k, static_cast<int>(idx.size()));
+    CheckTopK(delta, idx);
+  }
+}
+
+TEST(TopKSyncParamTest, Ties){
+  // mostly zero deltas, hence the sampled threshold is usually 0
+  TopKSyncParamTest param;
+  const int n=100000;
+  vector<float> delta(n, 0.f), nonzero=RandomDelta(n/100, 16);
+  for(size_t i=0;i<nonzero.size();i++)
+    delta[i*100+7]=nonzero[i];
+  for(int k: {100, 1000, 5000}){
+    vector<int> idx=param.TopK(delta, k);
+    EXPECT_EQ(k, static_cast<int>(idx.size()));
+    CheckTopK(delta, idx);
+  }
+}
+
+TEST(TopKSyncParamTest, Boundary){
+  TopKSyncParamTest param;
+  vector<float> delta=RandomDelta(50, 3);
+  EXPECT_TRUE(param.TopK(delta, 0).empty());
+  EXPECT_EQ(50u, param.TopK(delta, 50).size());
+  EXPECT_EQ(50u, param.TopK(delta, 80).size());
+  // ties are broken arbitrarily but exactly k are returned
+  vector<float> ones(100, 1.f);
+  EXPECT_EQ(30u, param.TopK(ones, 30).size());
+}
+
+/**
+ * One sync round between a worker and a server Param, with msgs sent over
+ * an inproc socket as zero-copy frames are only resolved by SendMsg.
+ */
+class SyncRoundTest: public ::testing::Test{
+ protected:
+  virtual void SetUp(){
+    server_sock_=zsock_new_pair("@inproc://test_param");
+    worker_sock_=zsock_new_pair(">inproc://test_param");
+  }
+  virtual void TearDown(){
+    zsock_destroy(&worker_sock_);
+    zsock_destroy(&server_sock_);
+  }
+  zmsg_t* Transfer(zmsg_t* msg, zsock_t* from, zsock_t* to){
+    SendMsg(from, &msg);
+    return zmsg_recv(to);
+  }
+  /**
+   * worker data is snapshot+delta and delta is reset to data-snapshot as
+   * computed by the worker; server data is serverdata.
+   */
+  void SetupParams(Param* worker, Param* server, const vector<float>& snapshot,
+      vector<float>* delta, const vector<float>& serverdata){
+    int n=delta->size();
+    ParamProto proto;
+    worker->Setup(proto, vector<int>{n}, 0);
+    server->Setup(proto, vector<int>{n}, 0);
+    float* wd=worker->mutable_cpu_data();
+    float* sd=static_cast<RandomSyncParam*>(worker)->mutable_cpu_snapshot();
+    float* pd=server->mutable_cpu_data();
+    for(int i=0;i<n;i++){
+      sd[i]=snapshot[i];
+      wd[i]=snapshot[i]+delta->at(i);
+      delta->at(i)=wd[i]-sd[i];
+      pd[i]=serverdata[i];
+    }
+  }
+  /**
+   * @return true if a sync msg is generated
+   */
+  bool SyncRound(Param* worker, Param* server, float sample_ratio){
+    zmsg_t* msg=worker->GenSyncMsgFromWorker(sample_ratio);
+    if(msg==nullptr)
+      return false;
+    zmsg_t* req=Transfer(msg, worker_sock_, server_sock_);
+    zmsg_t* reply=server->HandleSyncMsg(&req);
+    EXPECT_EQ(UpdaterProto::kFloat32, PeekHeader(reply)->format);
+    reply=Transfer(reply, server_sock_, worker_sock_);
+    worker->ParseSyncMsgFromPS(&reply);
+    return true;
+  }
+
+  zsock_t *server_sock_, *worker_sock_;
+};
+
+TEST_F(SyncRoundTest, TopKFloat32){
+  const int n=1000, k=100;
+  vector<float> snapshot=RandomDelta(n, 4), delta=RandomDelta(n, 5),
+    serverdata=RandomDelta(n, 6);
+  TopKSyncParamTest worker, server;
+  SetupParams(&worker, &server, snapshot, &delta, serverdata);
+  vector<float> w(worker.mutable_cpu_data(), worker.mutable_cpu_data()+n);
+  ASSERT_TRUE(SyncRound(&worker, &server, 1.f*k/n));
+
+  const float* wd=worker.mutable_cpu_data();
+  const float* sd=worker.mutable_cpu_snapshot();
+  const float* pd=server.mutable_cpu_data();
+  vector<int> idx=worker.TopK(delta, k);
+  std::set<int> selected(idx.begin(), idx.end());
+  for(int i=0;i<n;i++){
+    if(selected.count(i)){
+      // the server adds the delta; the worker moves to the old server
+      // weights plus its own delta
+      EXPECT_EQ(serverdata[i]+delta[i], pd[i]);
+      EXPECT_EQ(w[i]+(serverdata[i]-snapshot[i]), wd[i]);
+      EXPECT_EQ(wd[i], sd[i]);
+    }else{
+      EXPECT_EQ(serverdata[i], pd[i]);
+      EXPECT_EQ(w[i], wd[i]);
+      EXPECT_EQ(snapshot[i], sd[i]);
+    }
+  }
+}
+
+TEST_F(SyncRoundTest, TopKInt8KeepsResidual){
+  const int n=1000, k=300;
+  vector<float> snapshot=RandomDelta(n, 7), delta=RandomDelta(n, 8),
+    serverdata=RandomDelta(n, 9);
+  TopKSyncParamTest worker, server;
+  SetupParams(&worker, &server, snapshot, &delta, serverdata);
+  vector<float> w(worker.mutable_cpu_data(), worker.mutable_cpu_data()+n);
+  worker.set_wire_format(UpdaterProto::kInt8);
+  ASSERT_TRUE(SyncRound(&worker, &server, 1.f*k/n));
+
+  const float* wd=worker.mutable_cpu_data();
+  const float* sd=worker.mutable_cpu_snapshot();
+  const float* pd=server.mutable_cpu_data();
+  vector<int> idx=worker.TopK(delta, k);
+  float absmax=0.f;
+  for(int i: idx)
+    absmax=std::max(absmax, std::fabs(delta[i]));
+  for(int i: idx){
+    // the reply is not quantized, hence the worker keeps its full delta
+    EXPECT_EQ(w[i]+(serverdata[i]-snapshot[i]), wd[i]);
+    // the snapshot is what the server has received
+    EXPECT_EQ(pd[i], sd[i]);
+    // and the quantization error is left in the next delta
+    EXPECT_LE(std::fabs(wd[i]-sd[i]), absmax/127.f);
+    EXPECT_NEAR(delta[i], wd[i]-sd[i]+(pd[i]-serverdata[i]), 1e-5f);
+  }
+}
+
+TEST_F(SyncRoundTest, TopKSkipsEmptySample){
+  const int n=100;
+  vector<float> snapshot=RandomDelta(n, 10), delta=RandomDelta(n, 11),
+    serverdata=RandomDelta(n, 12);
+  TopKSyncParamTest worker, server;
+  SetupParams(&worker, &server, snapshot, &delta, serverdata);
+  // n*sample_ratio truncates to 0
+  EXPECT_FALSE(SyncRound(&worker, &server, 0.005f));
+  for(int i=0;i<n;i++)
+    EXPECT_EQ(snapshot[i], worker.mutable_cpu_snapshot()[i]);
+}
+
+TEST_F(SyncRoundTest, ServerUpdateAppliesMeanGradient){
+  const int n=100;
+  const float lr=0.1f;
+  vector<float> data=RandomDelta(n, 13), grad1=RandomDelta(n, 14),
+    grad2=RandomDelta(n, 15);
+  ParamProto proto;
+  RandomSyncParam worker;
+  auto server=std::make_shared<RandomSyncParam>();
+  worker.Setup(proto, vector<int>{n}, 0);
+  server->Setup(proto, vector<int>{n}, 0);
+  for(int i=0;i<n;i++)
+    server->mutable_cpu_data()[i]=data[i];
+  // two workers push their gradients of step 0
+  int step;
+  for(auto* grad: {&grad1, &grad2}){
+    zmsg_t* msg=worker.GenUpdateMsgFromWorker(0, 1.f, grad->data());
+    zmsg_t* req=Transfer(msg, worker_sock_, server_sock_);
+    server->HandleUpdateMsg(&req, &step);
+  }
+  EXPECT_EQ(0, step);
+  // SGD does not use grad_scale, hence the mean must be applied by the server
+  UpdaterProto updater_proto;
+  updater_proto.set_type(UpdaterProto::kSGD);
+  updater_proto.set_base_learning_rate(lr);
+  shared_ptr<Updater> updater=CreateUpdater(updater_proto);
+  server->AverageUpdates();
+  updater->Update(step, server, 1.f);
+  server->ClearUpdates();
+  for(int i=0;i<n;i++)
+    EXPECT_NEAR(data[i]-lr*(grad1[i]+grad2[i])/2,
+        server->mutable_cpu_data()[i], 1e-5f);
+}
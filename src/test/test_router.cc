@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+#include <czmq.h>
+#include <cstring>
+#include <vector>
+#include "utils/router.h"
+using namespace singa;
+using std::vector;
+
+TEST(RouterTest, ZeroCopyFrameIsSentAsMemory){
+  zsock_t* server=zsock_new_pair("@inproc://test_router_zerocopy");
+  zsock_t* worker=zsock_new_pair(">inproc://test_router_zerocopy");
+  vector<float> data{1.f, 2.f, 3.f, 4.f, 5.f};
+  PinCounter pins;
+  zmsg_t* msg=zmsg_new();
+  zmsg_addmem(msg, "abc", 3);
+  pins.AddFrame(msg, data.data(), sizeof(float)*data.size());
+  EXPECT_EQ(1, pins.count());
+  EXPECT_EQ(3+sizeof(float)*data.size(), MsgSize(msg));
+
+  SendMsg(worker, &msg);
+  EXPECT_EQ(nullptr, msg);
+  zmsg_t* recv=zmsg_recv(server);
+  ASSERT_EQ(2u, zmsg_size(recv));
+  zmsg_first(recv);
+  zframe_t* frame=zmsg_next(recv);
+  ASSERT_EQ(sizeof(float)*data.size(), zframe_size(frame));
+  EXPECT_EQ(0, memcmp(data.data(), zframe_data(frame), zframe_size(frame)));
+  zmsg_destroy(&recv);
+  // ZMQ releases the frame once it is consumed
+  pins.Wait();
+  EXPECT_EQ(0, pins.count());
+  zsock_destroy(&worker);
+  zsock_destroy(&server);
+}
+
+TEST(RouterTest, DestroyMsgReleasesZeroCopyFrames){
+  vector<float> data(100, 1.f);
+  PinCounter pins;
+  zmsg_t* msg=zmsg_new();
+  pins.AddFrame(msg, data.data(), sizeof(float)*50);
+  pins.AddFrame(msg, data.data()+50, sizeof(float)*50);
+  EXPECT_EQ(2, pins.count());
+  DestroyMsg(&msg);
+  EXPECT_EQ(nullptr, msg);
+  EXPECT_EQ(0, pins.count());
+}
+
+TEST(RouterTest, FailedSendReleasesZeroCopyFrames){
+  // no peer is connected, hence sending fails immediately
+  zsock_t* push=zsock_new_push("@inproc://test_router_nopeer");
+  zsock_set_sndtimeo(push, 0);
+  vector<float> data(10, 1.f);
+  PinCounter pins;
+  zmsg_t* msg=zmsg_new();
+  // the first frame fails and the rest are not sent
+  pins.AddFrame(msg, data.data(), sizeof(float)*data.size());
+  zmsg_addmem(msg, "abc", 3);
+  pins.AddFrame(msg, data.data(), sizeof(float)*data.size());
+  SendMsg(push, &msg);
+  EXPECT_EQ(nullptr, msg);
+  EXPECT_EQ(0, pins.count());
+  zsock_destroy(&push);
+}
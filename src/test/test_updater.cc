@@ -0,0 +1,182 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <vector>
+#include "utils/param.h"
+#include "utils/updater.h"
+#include "mshadow/tensor.h"
+#include "mshadow/cxxnet_op.h"
+using namespace singa;
+using namespace mshadow;
+using namespace mshadow::expr;
+using std::vector;
+
+/**
+ * Reference updaters, i.e., the mshadow expressions used before the fused
+ * kernels. grad is modified in place by the weight decay as before.
+ */
+struct RefState{
+  vector<float> data, grad, history, update;
+};
+
+void RefUpdate(const UpdaterProto& proto, int step, float lr, float wd,
+    float grad_scale, RefState* st){
+  Shape<1> s=Shape1(st->data.size());
+  Tensor<cpu, 1> data(st->data.data(), s), grad(st->grad.data(), s);
+  Tensor<cpu, 1> history(st->history.data(), s), update(st->update.data(), s);
+  float momentum=proto.momentum(), delta=proto.delta(), rho=proto.rho();
+  TensorContainer<cpu, 1> tmp(s);
+  switch(proto.type()){
+    case UpdaterProto::kSGD:
+      if(wd>0)
+        grad+=data*wd;
+      if(momentum>0){
+        if(step==0) history=0;
+        history=history*momentum+lr*grad;
+        data-=history;
+      }else{
+        data-=lr*grad;
+      }
+      break;
+    case UpdaterProto::kNesterov:
+      if(step==0) history=0;
+      if(wd>0)
+        grad+=data*wd;
+      Copy(tmp, history);
+      history=history*momentum+lr*grad;
+      tmp=history*(1+momentum)-tmp*momentum;
+      data-=tmp;
+      break;
+    case UpdaterProto::kAdaGrad:
+      if(step==0) history=0;
+      history+=F<op::square>(grad*grad_scale);
+      if(wd>0)
+        grad+=data*wd;
+      data-=lr*grad/(F<op::sqrtop>(history, delta));
+      break;
+    case UpdaterProto::kRMSProp:
+      if(step==0) history=0;
+      history=history*rho+(1-rho)*F<op::square>(grad*grad_scale);
+      if(wd>0)
+        grad+=data*wd;
+      data-=lr*grad/(F<op::sqrtop>(history, delta));
+      break;
+    case UpdaterProto::kAdaDelta:
+      if(wd>0)
+        grad+=data*wd;
+      if(step==0){
+        history=0;
+        update=0;
+      }
+      history=history*rho+(1-rho)*F<op::square>(grad*grad_scale);
+      tmp=grad*F<op::sqrtop>(update, delta)/F<op::sqrtop>(history, delta);
+      update=rho*update+(1-rho)*F<op::square>(tmp);
+      data-=tmp;
+      break;
+    default:
+      FAIL()<<"Unknown updater "<<proto.type();
+  }
+}
+
+void ExpectNear(const vector<float>& expected, const float* actual,
+    const char* name){
+  for(size_t i=0;i<expected.size();i++)
+    EXPECT_NEAR(expected[i], actual[i], 1e-5f*(1+std::fabs(expected[i])))
+      <<name<<"["<<i<<"]";
+}
+
+/**
+ * Run a few steps of the Updater and the reference, the first by slices
+ * of odd lengths and offsets to cover both the vectorized (Float8, used if
+ * the CPU supports AVX) and the scalar (Float1) loops of the kernels.
+ */
+void CheckUpdater(const UpdaterProto& proto){
+  const int n=203, nsteps=4;
+  const float lr_mult=0.5f, wd_mult=2.f, grad_scale=0.25f;
+  ParamProto pp;
+  pp.set_learning_rate_multiplier(lr_mult);
+  pp.set_weight_decay_multiplier(wd_mult);
+  auto param=std::make_shared<RandomSyncParam>();
+  param->Setup(pp, vector<int>{n}, 0);
+  shared_ptr<Updater> updater=CreateUpdater(proto);
+  updater->InitState(param);
+  param->InitState(true, true);
+
+  std::mt19937 gen(proto.type());
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  RefState ref;
+  ref.data.resize(n);
+  ref.history.assign(n, 0.f);
+  ref.update.assign(n, 0.f);
+  for(int i=0;i<n;i++)
+    ref.data[i]=param->mutable_cpu_data()[i]=dist(gen);
+  for(int step=0;step<nsteps;step++){
+    ref.grad.resize(n);
+    for(int i=0;i<n;i++)
+      ref.grad[i]=param->mutable_cpu_grad()[i]=dist(gen);
+    for(int offset=0, len=1;offset<n;offset+=len, len+=7)
+      updater->UpdateSlice(step, param, grad_scale, offset,
+          std::min(len, n-offset));
+    RefUpdate(proto, step, proto.base_learning_rate()*lr_mult,
+        proto.weight_decay()*wd_mult, grad_scale, &ref);
+    ExpectNear(ref.data, param->mutable_cpu_data(), "data");
+    if(proto.type()!=UpdaterProto::kSGD||proto.momentum()>0)
+      ExpectNear(ref.history, param->mutable_cpu_history(), "history");
+    if(proto.type()==UpdaterProto::kAdaDelta)
+      ExpectNear(ref.update, param->mutable_cpu_update(), "update");
+  }
+}
+
+UpdaterProto MakeProto(UpdaterProto::Type type, float momentum, float wd){
+  UpdaterProto proto;
+  proto.set_type(type);
+  proto.set_base_learning_rate(0.1f);
+  proto.set_momentum(momentum);
+  proto.set_weight_decay(wd);
+  proto.set_delta(1e-6f);
+  proto.set_rho(0.9f);
+  return proto;
+}
+
+TEST(UpdaterTest, SGD){
+  CheckUpdater(MakeProto(UpdaterProto::kSGD, 0.f, 0.f));
+  CheckUpdater(MakeProto(UpdaterProto::kSGD, 0.f, 0.01f));
+  CheckUpdater(MakeProto(UpdaterProto::kSGD, 0.9f, 0.f));
+  CheckUpdater(MakeProto(UpdaterProto::kSGD, 0.9f, 0.01f));
+}
+
+TEST(UpdaterTest, Nesterov){
+  CheckUpdater(MakeProto(UpdaterProto::kNesterov, 0.9f, 0.f));
+  CheckUpdater(MakeProto(UpdaterProto::kNesterov, 0.9f, 0.01f));
+}
+
+TEST(UpdaterTest, AdaGrad){
+  CheckUpdater(MakeProto(UpdaterProto::kAdaGrad, 0.f, 0.f));
+  CheckUpdater(MakeProto(UpdaterProto::kAdaGrad, 0.f, 0.01f));
+}
+
+TEST(UpdaterTest, RMSProp){
+  CheckUpdater(MakeProto(UpdaterProto::kRMSProp, 0.f, 0.f));
+  CheckUpdater(MakeProto(UpdaterProto::kRMSProp, 0.f, 0.01f));
+}
+
+TEST(UpdaterTest, AdaDelta){
+  CheckUpdater(MakeProto(UpdaterProto::kAdaDelta, 0.f, 0.f));
+  CheckUpdater(MakeProto(UpdaterProto::kAdaDelta, 0.f, 0.01f));
+}
+
+TEST(UpdaterTest, ReleaseState){
+  ParamProto pp;
+  auto param=std::make_shared<RandomSyncParam>();
+  param->Setup(pp, vector<int>{64}, 0);
+  shared_ptr<Updater> updater=CreateUpdater(
+      MakeProto(UpdaterProto::kAdaDelta, 0.f, 0.f));
+  updater->InitState(param);
+  EXPECT_EQ(64, param->history().count());
+  param->ReleaseState();
+  EXPECT_EQ(0, param->history().count());
+  // shaped again if the Param is updated locally afterwards
+  updater->InitState(param);
+  EXPECT_EQ(64, param->history().count());
+}
@@ -28,6 +28,8 @@ Cluster::Cluster(const ClusterProto &cluster, string hostfile, int procsid) {
 void Cluster::SetupFolders(const ClusterProto &cluster){
   // create visulization folder
   mkdir(visualization_folder().c_str(),  S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  // create log folder
+  mkdir(log_folder().c_str(),  S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 }
 
 void Cluster::SetupGroups(const ClusterProto &cluster){
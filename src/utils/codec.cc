@@ -0,0 +1,337 @@
+#include <glog/logging.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#define SINGA_X86_SIMD
+#include <immintrin.h>
+#endif
+#include "utils/codec.h"
+
+namespace singa {
+
+/*************************scalar conversions*********************************/
+inline uint32_t FloatBits(float f){
+  uint32_t x;
+  memcpy(&x, &f, sizeof(float));
+  return x;
+}
+inline float BitsFloat(uint32_t x){
+  float f;
+  memcpy(&f, &x, sizeof(float));
+  return f;
+}
+
+inline uint16_t FloatToHalf(float f){
+  uint32_t x=FloatBits(f);
+  uint16_t sign=(x>>16)&0x8000;
+  uint32_t fexp=(x>>23)&0xff, mant=x&0x7fffff;
+  if(fexp==0xff) // inf or nan
+    return sign|0x7c00|(mant?0x200:0);
+  int exp=fexp-127+15;
+  if(exp>=31) // overflow
+    return sign|0x7c00;
+  if(exp<=0){ // subnormal half
+    if(exp<-10)
+      return sign;
+    mant|=0x800000;
+    int shift=14-exp;
+    uint32_t h=mant>>shift, rem=mant&((1u<<shift)-1), half=1u<<(shift-1);
+    if(rem>half||(rem==half&&(h&1)))
+      h++;
+    return sign|h;
+  }
+  // rounding may carry into the exponent, which is still correct
+  uint32_t h=(exp<<10)|(mant>>13), rem=mant&0x1fff;
+  if(rem>0x1000||(rem==0x1000&&(h&1)))
+    h++;
+  return sign|h;
+}
+
+inline float HalfToFloat(uint16_t h){
+  uint32_t sign=(h&0x8000)<<16;
+  int exp=(h>>10)&0x1f;
+  uint32_t mant=h&0x3ff;
+  if(exp==0){
+    if(mant==0)
+      return BitsFloat(sign);
+    exp=1;
+    while(!(mant&0x400)){
+      mant<<=1;
+      exp--;
+    }
+    mant&=0x3ff;
+  }else if(exp==31){
+    return BitsFloat(sign|0x7f800000|(mant<<13));
+  }
+  return BitsFloat(sign|((exp-15+127)<<23)|(mant<<13));
+}
+
+// nan is not treated specially to keep the same result as the SIMD kernel
+inline uint16_t FloatToBFloat(float f){
+  uint32_t x=FloatBits(f);
+  return (x+0x7fff+((x>>16)&1))>>16;
+}
+
+inline float BFloatToFloat(uint16_t h){
+  return BitsFloat(static_cast<uint32_t>(h)<<16);
+}
+
+/****************************SIMD kernels**********************************/
+// The AVX2/F16C kernels are compiled with target attributes and selected at
+// runtime, hence the binary still runs on CPUs without these extensions.
+// Each kernel processes a prefix of the input and returns its length; the
+// scalar loops below handle the rest.
+#ifdef SINGA_X86_SIMD
+#define SINGA_TARGET_AVX2 __attribute__((target("avx2,f16c")))
+
+static bool HasAVX2(){
+  static const bool ret=(__builtin_cpu_init(),
+      __builtin_cpu_supports("avx2")&&__builtin_cpu_supports("f16c"));
+  return ret;
+}
+
+SINGA_TARGET_AVX2
+static int EncodeHalfAVX2(const float* src, int n, uint16_t* dst){
+  int i=0;
+  for(;i+8<=n;i+=8){
+    __m128i h=_mm256_cvtps_ph(_mm256_loadu_ps(src+i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i), h);
+  }
+  return i;
+}
+
+SINGA_TARGET_AVX2
+static int DecodeHalfAVX2(const uint16_t* src, int n, float* dst){
+  int i=0;
+  for(;i+8<=n;i+=8){
+    __m128i h=_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(h));
+  }
+  return i;
+}
+
+SINGA_TARGET_AVX2
+static int EncodeBFloatAVX2(const float* src, int n, uint16_t* dst){
+  int i=0;
+  const __m256i one=_mm256_set1_epi32(1), bias=_mm256_set1_epi32(0x7fff);
+  for(;i+8<=n;i+=8){
+    __m256i x=_mm256_castps_si256(_mm256_loadu_ps(src+i));
+    __m256i lsb=_mm256_and_si256(_mm256_srli_epi32(x, 16), one);
+    x=_mm256_srli_epi32(_mm256_add_epi32(x, _mm256_add_epi32(bias, lsb)), 16);
+    // pack within 128-bit lanes, then gather the low half of both lanes
+    x=_mm256_permute4x64_epi64(_mm256_packus_epi32(x, x), 0xd8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i),
+        _mm256_castsi256_si128(x));
+  }
+  return i;
+}
+
+SINGA_TARGET_AVX2
+static int DecodeBFloatAVX2(const uint16_t* src, int n, float* dst){
+  int i=0;
+  for(;i+8<=n;i+=8){
+    __m256i x=_mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i)));
+    _mm256_storeu_ps(dst+i, _mm256_castsi256_ps(_mm256_slli_epi32(x, 16)));
+  }
+  return i;
+}
+
+SINGA_TARGET_AVX2
+static int AbsMaxAVX2(const float* src, int n, float* ret){
+  int i=0;
+  const __m256 absmask=_mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 m=_mm256_setzero_ps();
+  for(;i+8<=n;i+=8)
+    m=_mm256_max_ps(m, _mm256_and_ps(_mm256_loadu_ps(src+i), absmask));
+  float buf[8];
+  _mm256_storeu_ps(buf, m);
+  for(int k=0;k<8;k++)
+    *ret=std::max(*ret, buf[k]);
+  return i;
+}
+
+SINGA_TARGET_AVX2
+static int QuantizeAVX2(const float* src, int n, float inv, int8_t* dst){
+  int i=0;
+  const __m256 vinv=_mm256_set1_ps(inv);
+  const __m256i perm=_mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  for(;i+32<=n;i+=32){
+    __m256i q0=_mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src+i), vinv));
+    __m256i q1=_mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src+i+8), vinv));
+    __m256i q2=_mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src+i+16), vinv));
+    __m256i q3=_mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src+i+24), vinv));
+    // packing works within 128-bit lanes, hence the permutation
+    __m256i q=_mm256_packs_epi16(_mm256_packs_epi32(q0, q1),
+        _mm256_packs_epi32(q2, q3));
+    q=_mm256_permutevar8x32_epi32(q, perm);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst+i), q);
+  }
+  return i;
+}
+
+SINGA_TARGET_AVX2
+static int DequantizeAVX2(const int8_t* src, int n, float scale, float* dst){
+  int i=0;
+  const __m256 vscale=_mm256_set1_ps(scale);
+  for(;i+8<=n;i+=8){
+    __m256i q=_mm256_cvtepi8_epi32(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src+i)));
+    _mm256_storeu_ps(dst+i, _mm256_mul_ps(_mm256_cvtepi32_ps(q), vscale));
+  }
+  return i;
+}
+#endif  // SINGA_X86_SIMD
+
+/******************************kernels*************************************/
+static void EncodeHalf(const float* src, int n, uint16_t* dst){
+  int i=0;
+#ifdef SINGA_X86_SIMD
+  if(HasAVX2())
+    i=EncodeHalfAVX2(src, n, dst);
+#endif
+  for(;i<n;i++)
+    dst[i]=FloatToHalf(src[i]);
+}
+
+static void DecodeHalf(const uint16_t* src, int n, float* dst){
+  int i=0;
+#ifdef SINGA_X86_SIMD
+  if(HasAVX2())
+    i=DecodeHalfAVX2(src, n, dst);
+#endif
+  for(;i<n;i++)
+    dst[i]=HalfToFloat(src[i]);
+}
+
+static void EncodeBFloat(const float* src, int n, uint16_t* dst){
+  int i=0;
+#ifdef SINGA_X86_SIMD
+  if(HasAVX2())
+    i=EncodeBFloatAVX2(src, n, dst);
+#endif
+  for(;i<n;i++)
+    dst[i]=FloatToBFloat(src[i]);
+}
+
+static void DecodeBFloat(const uint16_t* src, int n, float* dst){
+  int i=0;
+#ifdef SINGA_X86_SIMD
+  if(HasAVX2())
+    i=DecodeBFloatAVX2(src, n, dst);
+#endif
+  for(;i<n;i++)
+    dst[i]=BFloatToFloat(src[i]);
+}
+
+static float AbsMax(const float* src, int n){
+  float ret=0.f;
+  int i=0;
+#ifdef SINGA_X86_SIMD
+  if(HasAVX2())
+    i=AbsMaxAVX2(src, n, &ret);
+#endif
+  for(;i<n;i++)
+    ret=std::max(ret, std::fabs(src[i]));
+  return ret;
+}
+
+static void EncodeInt8(const float* src, int n, float* scales, int8_t* dst){
+  for(int b=0;b*kInt8Block<n;b++){
+    int start=b*kInt8Block, end=std::min(n, start+kInt8Block);
+    float scale=AbsMax(src+start, end-start)/127.f;
+    float inv=scale>0.f?1.f/scale:0.f;
+    scales[b]=scale;
+    int i=start;
+#ifdef SINGA_X86_SIMD
+    if(HasAVX2())
+      i+=QuantizeAVX2(src+start, end-start, inv, dst+start);
+#endif
+    for(;i<end;i++){
+      long q=std::lrint(src[i]*inv);
+      dst[i]=static_cast<int8_t>(std::max(-127L, std::min(127L, q)));
+    }
+  }
+}
+
+static void DecodeInt8(const float* scales, const int8_t* src, int n,
+    float* dst){
+  for(int b=0;b*kInt8Block<n;b++){
+    int start=b*kInt8Block, end=std::min(n, start+kInt8Block);
+    float scale=scales[b];
+    int i=start;
+#ifdef SINGA_X86_SIMD
+    if(HasAVX2())
+      i+=DequantizeAVX2(src+start, end-start, scale, dst+start);
+#endif
+    for(;i<end;i++)
+      dst[i]=src[i]*scale;
+  }
+}
+
+/****************************interface*************************************/
+size_t EncodedSize(WireFormat fmt, int count){
+  switch(fmt){
+    case UpdaterProto::kFloat32:
+      return sizeof(float)*count;
+    case UpdaterProto::kFloat16:
+    case UpdaterProto::kBFloat16:
+      return sizeof(uint16_t)*count;
+    case UpdaterProto::kInt8:
+      return sizeof(float)*((count+kInt8Block-1)/kInt8Block)+count;
+    default:
+      LOG(FATAL)<<"Unknown wire format "<<fmt;
+  }
+  return 0;
+}
+
+void Encode(WireFormat fmt, const float* src, int count, void* dst){
+  switch(fmt){
+    case UpdaterProto::kFloat32:
+      memcpy(dst, src, sizeof(float)*count);
+      break;
+    case UpdaterProto::kFloat16:
+      EncodeHalf(src, count, static_cast<uint16_t*>(dst));
+      break;
+    case UpdaterProto::kBFloat16:
+      EncodeBFloat(src, count, static_cast<uint16_t*>(dst));
+      break;
+    case UpdaterProto::kInt8:
+      {
+        // block scales first, then the quantized values
+        float* scales=static_cast<float*>(dst);
+        int nblocks=(count+kInt8Block-1)/kInt8Block;
+        EncodeInt8(src, count, scales, reinterpret_cast<int8_t*>(scales+nblocks));
+      }
+      break;
+    default:
+      LOG(FATAL)<<"Unknown wire format "<<fmt;
+  }
+}
+
+void Decode(WireFormat fmt, const void* src, int count, float* dst){
+  switch(fmt){
+    case UpdaterProto::kFloat32:
+      memcpy(dst, src, sizeof(float)*count);
+      break;
+    case UpdaterProto::kFloat16:
+      DecodeHalf(static_cast<const uint16_t*>(src), count, dst);
+      break;
+    case UpdaterProto::kBFloat16:
+      DecodeBFloat(static_cast<const uint16_t*>(src), count, dst);
+      break;
+    case UpdaterProto::kInt8:
+      {
+        const float* scales=static_cast<const float*>(src);
+        int nblocks=(count+kInt8Block-1)/kInt8Block;
+        DecodeInt8(scales, reinterpret_cast<const int8_t*>(scales+nblocks),
+            count, dst);
+      }
+      break;
+    default:
+      LOG(FATAL)<<"Unknown wire format "<<fmt;
+  }
+}
+} /* singa */
@@ -2,6 +2,7 @@
 #include <cmath>
 #include <chrono>
 #include <random>
+#include <algorithm>
 #include "utils/param.h"
 #include "mshadow/tensor.h"
 #include "utils/singleton.h"
@@ -10,54 +11,168 @@ using std::vector;
 using std::string;
 namespace singa {
 
-int64_t Param::ps_handle_sync=0;
 int64_t Param::worker_gen_sync=0;
 int64_t Param::worker_handle_sync=0;
 Param::Param(){
   owner_=this;
   fan_in_=0;
+  slice_=0;
+  wire_format_=UpdaterProto::kFloat32;
+  nupdates_=0;
 }
 
 Param::~Param(){}
 
 zmsg_t* Param::HandlePutMsg(zmsg_t** msg){
-  char* name=zmsg_popstr(*msg);
-  CHECK(name);
-  name_=string(name);
-  delete name;
+  MsgHeader header=PopHeader(*msg);
+  slice_=header.slice;
+  WaitUnpinned();
+  int id=proto_.id();
+  zframe_t* protoframe=zmsg_pop(*msg);
+  CHECK(protoframe);
+  proto_.ParseFromArray(zframe_data(protoframe), zframe_size(protoframe));
+  proto_.set_id(id);
+  name_=proto_.name();
+  zframe_destroy(&protoframe);
 
   zframe_t* dataframe=zmsg_pop(*msg);
-  data_.Reshape(vector<int>{(int)(zframe_size(dataframe)/sizeof(float))});
+  CHECK_EQ(zframe_size(dataframe), header.count*sizeof(float));
+  vector<int> shape{header.count};
+  data_.Reshape(shape);
   memcpy(data_.mutable_cpu_data(), zframe_data(dataframe),
           zframe_size(dataframe));
+  // grad and states are shaped only if the Updater runs on the server
   zframe_destroy(&dataframe);
   zmsg_destroy(msg);
   return nullptr;
 }
 
+int Param::HandleUpdateMsg(zmsg_t** msg, int* step){
+  MsgHeader header=PopHeader(*msg);
+  *step=header.version;
+  float scale=header.value;
+  int count=header.count;
+  zframe_t* gradframe=zmsg_pop(*msg);
+  CHECK_EQ(count, size());
+  CHECK_EQ(zframe_size(gradframe), count*sizeof(float));
+  if(grad_.count()!=count)
+    grad_.ReshapeLike(data_);
+  Tensor<cpu, 1> grad(grad_.mutable_cpu_data(), Shape1(count));
+  Tensor<cpu, 1> worker((float*)zframe_data(gradframe), Shape1(count));
+  if(nupdates_==0)
+    grad=worker*scale;
+  else
+    grad+=worker*scale;
+  zframe_destroy(&gradframe);
+  zmsg_destroy(msg);
+  return ++nupdates_;
+}
+
+void Param::AverageUpdates(){
+  CHECK_GT(nupdates_, 0);
+  if(nupdates_==1)
+    return;
+  Tensor<cpu, 1> grad(grad_.mutable_cpu_data(), Shape1(grad_.count()));
+  grad*=1.0f/nupdates_;
+}
+
+zmsg_t* Param::GenUpdateReply(int step){
+  zmsg_t* ret=zmsg_new();
+  PushHeader(ret, MsgHeader{kUpdate, id(), step, slice_, 0, size(), 0.f});
+  AddPinnedFrame(ret, data_.mutable_cpu_data(), data_.count());
+  return ret;
+}
+
+zmsg_t* Param::GenUpdateMsgFromWorker(int step, float grad_scale,
+    float* grad){
+  int64_t start=zclock_mono();
+  zmsg_t* msg=zmsg_new();
+  PushHeader(msg, MsgHeader{kUpdate, id(), step, slice_, 0, size(), grad_scale});
+  if(grad==nullptr)
+    grad=grad_.mutable_cpu_data();
+  AddPinnedFrame(msg, grad, size());
+  worker_gen_sync+=zclock_mono()-start;
+  return msg;
+}
+
+void Param::ParseUpdateMsgFromPS(zmsg_t** msg){
+  int64_t start=zclock_mono();
+  MsgHeader header=PopHeader(*msg);
+  CHECK_EQ(header.slice, slice_);
+  zframe_t* frame=zmsg_pop(*msg);
+  CHECK_EQ(zframe_size(frame), size()*sizeof(float));
+  memcpy(mutable_cpu_data(), zframe_data(frame), zframe_size(frame));
+  zframe_destroy(&frame);
+  zmsg_destroy(msg);
+  worker_handle_sync+=zclock_mono()-start;
+}
+
 zmsg_t* Param::HandleGetMsg(zmsg_t** msg){
-  char* name=zmsg_popstr(*msg);
+  MsgHeader header=PopHeader(*msg);
   zmsg_destroy(msg);
-  CHECK_STREQ(name_.c_str(), name);
+  CHECK_EQ(header.slice, slice_);
 
   zmsg_t* ret=zmsg_new();
-  zmsg_addstr(ret, name);
-  zmsg_addmem(ret, data_.mutable_cpu_data(), data_.count()*sizeof(float));
-  delete name;
+  header.count=size();
+  PushHeader(ret, header);
+  AddPinnedFrame(ret, data_.mutable_cpu_data(), data_.count());
   return ret;
 }
 
 
+float* Param::DecodeFrame(zframe_t* frame, int fmt, int count,
+    vector<float>* buf){
+  CHECK_EQ(zframe_size(frame), EncodedSize(WireFormat(fmt), count));
+  if(fmt==UpdaterProto::kFloat32)
+    return reinterpret_cast<float*>(zframe_data(frame));
+  buf->resize(count);
+  Decode(WireFormat(fmt), zframe_data(frame), count, buf->data());
+  return buf->data();
+}
+
+void Param::AddEncodedFrame(zmsg_t* msg, const float* src, int count,
+    vector<float>* decoded){
+  size_t size=EncodedSize(wire_format_, count);
+  void* buf=malloc(size);
+  Encode(wire_format_, src, count, buf);
+  if(decoded!=nullptr){
+    decoded->resize(count);
+    Decode(wire_format_, buf, count, decoded->data());
+  }
+  AddZeroCopyFrame(msg, buf, size, [](void* data, void* hint){ free(data); });
+}
+
+void Param::SetFloat32Reply(zmsg_t* msg, zframe_t* frame, const float* src,
+    int count){
+  MsgHeader* header=PeekHeader(msg);
+  if(header->format==UpdaterProto::kFloat32)
+    return;
+  CHECK(frame==zmsg_last(msg));
+  zmsg_remove(msg, frame);
+  zframe_destroy(&frame);
+  zmsg_addmem(msg, src, sizeof(float)*count);
+  header->format=UpdaterProto::kFloat32;
+}
+
 void Param::Setup(const ParamProto& proto, const vector<int>& shape,
     int fan_in){
   data_.Reshape(shape);
   grad_.Reshape(shape);
-  history_.Reshape(shape);
-  update_.Reshape(shape);
   proto_=proto;
   fan_in_=fan_in;
 }
 
+void Param::SetupSlice(Param* other, int offset, int len){
+  CHECK_LE(offset+len, other->size());
+  proto_=other->proto_;
+  data_.Reshape(vector<int>{len});
+  data_.set_cpu_data(other->mutable_cpu_data()+offset);
+  grad_.Reshape(vector<int>{len});
+  grad_.set_cpu_data(other->mutable_cpu_grad()+offset);
+  pins_=other->pins_;
+  fan_in_=0;
+}
+
 void Param::Init(){
   Tensor<cpu, 1> data(data_.mutable_cpu_data(), Shape1(data_.count()));
   unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
@@ -99,72 +214,105 @@ void Param::Init(){
 }
 
 /**************************RandomSyncParam********************************/
-const vector<int> RandomSyncParam::RandomSample(int seed, int m, int n){
-  vector<int> samples(m);
-  std::mt19937 gen(seed);
-  std::uniform_real_distribution<float> dist(0.f,1.f);
-  for(int i=0,k=0;i<n&&k<m;i++)
-    if((m-k)*1.0f/(n-i)>dist(gen)){
-      samples[k++]=i;
-    }
-  return samples;
+// num of contiguous floats per sampled block
+const int kSampleBlock=64;
+
+inline uint64_t MixBits(uint64_t x){
+  x+=0x9e3779b97f4a7c15ULL;
+  x=(x^(x>>30))*0xbf58476d1ce4e5b9ULL;
+  x=(x^(x>>27))*0x94d049bb133111ebULL;
+  return x^(x>>31);
+}
+
+inline int64_t Gcd(int64_t a, int64_t b){
+  while(b){
+    int64_t t=a%b;
+    a=b;
+    b=t;
+  }
+  return a;
+}
+
+const vector<std::pair<int, int>> RandomSyncParam::RandomSample(unsigned seed,
+    int m, int n){
+  vector<std::pair<int, int>> segments;
+  if(m>=n){
+    segments.push_back(std::make_pair(0, n));
+    return segments;
+  }
+  // blocks are visited in the order of a random affine permutation
+  // j -> (a*j+b)%nblocks, which has no duplicates if a is coprime to nblocks
+  int64_t nblocks=(n+kSampleBlock-1)/kSampleBlock;
+  uint64_t h=MixBits(seed);
+  int64_t b=h%nblocks, a=1+MixBits(h)%nblocks;
+  while(Gcd(a, nblocks)!=1)
+    a++;
+  for(int64_t j=0, left=m;left>0;j++){
+    int start=(a*j+b)%nblocks*kSampleBlock;
+    int len=std::min<int64_t>(left, std::min(kSampleBlock, n-start));
+    segments.push_back(std::make_pair(start, len));
+    left-=len;
+  }
+  return segments;
 }
 
 zmsg_t* RandomSyncParam::HandleSyncMsg(zmsg_t** msg){
-  int64_t start=zclock_mono();
-  char* control=zframe_strdup(zmsg_first(*msg));
-  int seed, count;
-  sscanf(control, "%d-%d", &seed,&count);
-  delete control;
+  // the header is kept for the reply
+  const MsgHeader* header=PeekHeader(*msg);
+  unsigned seed=header->seed;
+  WaitUnpinned();
+  int count=header->count, fmt=header->format;
   zframe_t* syncframe=zmsg_next(*msg);
-  CHECK_EQ(zframe_size(syncframe), count*sizeof(float));
-  float* syncptr=(float*)zframe_data(syncframe);
+  vector<float> buf;
+  float* syncptr=DecodeFrame(syncframe, fmt, count, &buf);
   float* dptr=data_.mutable_cpu_data();
   int k=0;
-  if(count==data_.count()){
-    for(int idx=0;idx<count;idx++){
-      float x=dptr[idx];
-      dptr[idx]+=syncptr[k];
-      syncptr[k]=x;
-      k++;
-    }
-  }else{
-    for(int idx: RandomSample(seed, count, data_.count())){
-      float x=dptr[idx];
-      dptr[idx]+=syncptr[k];
-      syncptr[k]=x;
-      k++;
+  for(auto& seg: RandomSample(seed, count, data_.count())){
+    float* d=dptr+seg.first;
+    float* s=syncptr+k;
+    for(int i=0;i<seg.second;i++){
+      float x=d[i];
+      d[i]+=s[i];
+      s[i]=x;
     }
+    k+=seg.second;
   }
   CHECK_EQ(k,count);
-  CHECK_EQ(zframe_size(syncframe), count*sizeof(float));
-  ps_handle_sync+=zclock_mono()-start;
+  SetFloat32Reply(*msg, syncframe, syncptr, count);
   return *msg;
 }
 
 zmsg_t *RandomSyncParam::GenSyncMsgFromWorker(float sample_ratio){
   int64_t start=zclock_mono();
+  int m=data_.count()*sample_ratio;
+  if(m==0)
+    return nullptr;
   zmsg_t* msg=zmsg_new();
   unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-  int m=data_.count()*sample_ratio;
-  zmsg_addstrf(msg, "%u-%d", seed, m);
-  float* updateptr=new float[m];
+  PushHeader(msg, MsgHeader{kSync, id(), 0, slice_, seed, m, sample_ratio,
+      wire_format_});
+  // the buffer is sent without copying and freed by ZMQ
+  float* updateptr=static_cast<float*>(malloc(sizeof(float)*m));
   float* dptr=data_.mutable_cpu_data();
   float* sdptr=snapshot_.mutable_cpu_data();
   int k=0;
-  if(m==data_.count()){
-    for(int idx=0;idx<m;idx++)
-      updateptr[k++]=dptr[idx]-sdptr[idx];
-  }else{
-    const vector<int> samples=RandomSample(seed, m, data_.count());
-    for(int idx:samples){
-      updateptr[k++]=dptr[idx]-sdptr[idx];
-    }
+  for(auto& seg: RandomSample(seed, m, data_.count())){
+    const float* d=dptr+seg.first;
+    const float* sd=sdptr+seg.first;
+    float* u=updateptr+k;
+    for(int i=0;i<seg.second;i++)
+      u[i]=d[i]-sd[i];
+    k+=seg.second;
   }
   CHECK_EQ(k,m);
-  zframe_t* frame=zframe_new(updateptr, sizeof(float)*m);
-  zmsg_append(msg, &frame);
-  delete updateptr;
+  if(wire_format_==UpdaterProto::kFloat32){
+    AddZeroCopyFrame(msg, updateptr, sizeof(float)*m,
+        [](void* data, void* hint){ free(data); });
+    sent_.clear();
+  }else{
+    AddEncodedFrame(msg, updateptr, m, &sent_);
+    free(updateptr);
+  }
   worker_gen_sync+=zclock_mono()-start;
   return msg;
 }
@@ -172,28 +320,34 @@ zmsg_t *RandomSyncParam::GenSyncMsgFromWorker(float sample_ratio){
 void RandomSyncParam::ParseSyncMsgFromPS(zmsg_t** msg){
   int64_t start=zclock_mono();
   //LOG(ERROR)<<"worker sync "<<id();
-  char* control=zmsg_popstr(*msg);
-  int seed, count;
-  sscanf(control, "%u-%d", &seed, &count);
-  //LOG(ERROR)<<"worker sync "<<id()<<" "<<control;
-  delete control;
+  MsgHeader header=PopHeader(*msg);
+  unsigned seed=header.seed;
+  int count=header.count;
   zframe_t* psdataframe=zmsg_pop(*msg);
-  CHECK_EQ(zframe_size(psdataframe), count*sizeof(float));
-  float* psdptr=(float*)zframe_data(psdataframe);
+  vector<float> buf;
+  float* psdptr=DecodeFrame(psdataframe, header.format, count, &buf);
   float* dptr=data_.mutable_cpu_data();
   float* sdptr=snapshot_.mutable_cpu_data();
   int k=0;
-  if(count==data_.count()){
-    for(int idx=0;idx<count;idx++){
-      dptr[idx]+=psdptr[k++]-sdptr[idx];
-      sdptr[idx]=dptr[idx];
-    }
-  }else{
-    for(int idx: RandomSample(seed, count, data_.count())){
-      dptr[idx]+=psdptr[k++]-sdptr[idx];
-      sdptr[idx]=dptr[idx];
+  for(auto& seg: RandomSample(seed, count, data_.count())){
+    float* d=dptr+seg.first;
+    float* sd=sdptr+seg.first;
+    const float* ps=psdptr+k;
+    if(sent_.empty()){
+      for(int i=0;i<seg.second;i++){
+        d[i]+=ps[i]-sd[i];
+        sd[i]=d[i];
+      }
+    }else{
+      const float* q=sent_.data()+k;
+      for(int i=0;i<seg.second;i++){
+        d[i]+=ps[i]-sd[i];
+        sd[i]=ps[i]+q[i];
+      }
     }
+    k+=seg.second;
   }
+  sent_.clear();
   zframe_destroy(&psdataframe);
   worker_handle_sync+=zclock_mono()-start;
   zmsg_destroy(msg);
@@ -206,34 +360,185 @@ void RandomSyncParam::Setup(const ParamProto& proto, const vector<int>& shape,
   snapshot_.Reshape(shape);
 }
 
+void RandomSyncParam::SetupSlice(Param* other, int offset, int len){
+  Param::SetupSlice(other, offset, len);
+  snapshot_.Reshape(vector<int>{len});
+  snapshot_.set_cpu_data(
+      static_cast<RandomSyncParam*>(other)->mutable_cpu_snapshot()+offset);
+}
+
 void RandomSyncParam::Init(){
   Param::Init();
   memcpy(snapshot_.mutable_cpu_data(), data_.mutable_cpu_data(),
       sizeof(float)*data_.count());
 }
 
+/**************************TopKSyncParam**********************************/
+const vector<int> TopKSyncParam::TopK(const vector<float>& delta, int k){
+  return TopK(delta.data(), nullptr, delta.size(), k);
+}
+
+const vector<int> TopKSyncParam::TopK(const float* dptr, const float* sdptr,
+    int n, int k){
+  vector<int> ret;
+  if(k>=n){
+    for(int i=0;i<n;i++)
+      ret.push_back(i);
+    return ret;
+  }
+  if(k<=0)
+    return ret;
+  // magnitudes of the delta are computed on the fly instead of buffered
+  auto mag=[dptr, sdptr](int i){
+    return std::fabs(sdptr==nullptr?dptr[i]:dptr[i]-sdptr[i]);
+  };
+  // estimate the threshold from a sample, slightly lowered to get at least
+  // k candidates with high probability
+  int nsamples=std::min(n, std::max(1024, 8*k));
+  vector<float> samples(nsamples);
+  // different coordinates are sampled every round
+  std::mt19937 gen(round_++);
+  std::uniform_int_distribution<int> dist(0, n-1);
+  for(int i=0;i<nsamples;i++)
+    samples[i]=mag(nsamples==n?i:dist(gen));
+  int rank=std::min(nsamples-1, static_cast<int>(1.2f*k*nsamples/n));
+  std::nth_element(samples.begin(), samples.begin()+rank, samples.end(),
+      std::greater<float>());
+  float threshold=samples[rank];
+  // values tied with the threshold (e.g., many zero deltas) are not
+  // candidates, otherwise the exact selection may run over almost all n
+  for(int i=0;i<n;i++)
+    if(mag(i)>threshold)
+      ret.push_back(i);
+  auto larger=[&mag](int a, int b){return mag(a)>mag(b);};
+  if(static_cast<int>(ret.size())>k){
+    std::nth_element(ret.begin(), ret.begin()+k, ret.end(), larger);
+    ret.resize(k);
+    return ret;
+  }
+  // fill up with the ties, then, if the threshold is overestimated, with
+  // the largest of the rest
+  for(int i=0;i<n&&static_cast<int>(ret.size())<k;i++)
+    if(mag(i)==threshold)
+      ret.push_back(i);
+  if(static_cast<int>(ret.size())<k){
+    vector<int> rest;
+    for(int i=0;i<n;i++)
+      if(mag(i)<threshold)
+        rest.push_back(i);
+    int m=k-ret.size();
+    std::nth_element(rest.begin(), rest.begin()+m, rest.end(), larger);
+    ret.insert(ret.end(), rest.begin(), rest.begin()+m);
+  }
+  return ret;
+}
+
+zmsg_t* TopKSyncParam::HandleSyncMsg(zmsg_t** msg){
+  // the header and the indices are kept for the reply
+  const MsgHeader* header=PeekHeader(*msg);
+  int count=header->count, fmt=header->format;
+  WaitUnpinned();
+  zframe_t* idxframe=zmsg_next(*msg);
+  zframe_t* syncframe=zmsg_next(*msg);
+  CHECK_EQ(zframe_size(idxframe), count*sizeof(int));
+  const int* idxptr=reinterpret_cast<int*>(zframe_data(idxframe));
+  vector<float> buf;
+  float* syncptr=DecodeFrame(syncframe, fmt, count, &buf);
+  float* dptr=data_.mutable_cpu_data();
+  for(int k=0;k<count;k++){
+    int idx=idxptr[k];
+    CHECK_LT(idx, data_.count());
+    float x=dptr[idx];
+    dptr[idx]+=syncptr[k];
+    syncptr[k]=x;
+  }
+  SetFloat32Reply(*msg, syncframe, syncptr, count);
+  return *msg;
+}
+
+zmsg_t *TopKSyncParam::GenSyncMsgFromWorker(float sample_ratio){
+  int64_t start=zclock_mono();
+  int n=data_.count();
+  const float* dptr=data_.mutable_cpu_data();
+  const float* sdptr=snapshot_.mutable_cpu_data();
+  const vector<int> indices=TopK(dptr, sdptr, n,
+      static_cast<int>(n*sample_ratio));
+  int m=indices.size();
+  if(m==0)
+    return nullptr;
+  // the buffer is sent without copying and freed by ZMQ
+  float* values=static_cast<float*>(malloc(sizeof(float)*m));
+  for(int k=0;k<m;k++)
+    values[k]=dptr[indices[k]]-sdptr[indices[k]];
+  zmsg_t* msg=zmsg_new();
+  PushHeader(msg, MsgHeader{kSync, id(), 0, slice_, 0, m, sample_ratio,
+      wire_format_});
+  zmsg_addmem(msg, indices.data(), sizeof(int)*m);
+  if(wire_format_==UpdaterProto::kFloat32){
+    AddZeroCopyFrame(msg, values, sizeof(float)*m,
+        [](void* data, void* hint){ free(data); });
+    sent_.clear();
+  }else{
+    AddEncodedFrame(msg, values, m, &sent_);
+    free(values);
+  }
+  worker_gen_sync+=zclock_mono()-start;
+  return msg;
+}
+
+void TopKSyncParam::ParseSyncMsgFromPS(zmsg_t** msg){
+  int64_t start=zclock_mono();
+  MsgHeader header=PopHeader(*msg);
+  int count=header.count;
+  zframe_t* idxframe=zmsg_pop(*msg);
+  zframe_t* psdataframe=zmsg_pop(*msg);
+  CHECK_EQ(zframe_size(idxframe), count*sizeof(int));
+  const int* idxptr=reinterpret_cast<int*>(zframe_data(idxframe));
+  vector<float> buf;
+  float* psdptr=DecodeFrame(psdataframe, header.format, count, &buf);
+  float* dptr=data_.mutable_cpu_data();
+  float* sdptr=snapshot_.mutable_cpu_data();
+  for(int k=0;k<count;k++){
+    int idx=idxptr[k];
+    dptr[idx]+=psdptr[k]-sdptr[idx];
+    sdptr[idx]=sent_.empty()?dptr[idx]:psdptr[k]+sent_[k];
+  }
+  sent_.clear();
+  zframe_destroy(&idxframe);
+  zframe_destroy(&psdataframe);
+  zmsg_destroy(msg);
+  worker_handle_sync+=zclock_mono()-start;
+}
+
 /***************************ElasticParam************************************/
 zmsg_t* ElasticParam::HandleSyncMsg(zmsg_t** msg){
-  int64_t start=zclock_mono();
-  char* control=zframe_strdup(zmsg_first(*msg));
-  float alpha;int count;
-  sscanf(control, "%f-%d", &alpha,&count);
-  delete control;
+  // the header is kept for the reply
+  const MsgHeader* header=PeekHeader(*msg);
+  float alpha=header->value;
+  WaitUnpinned();
+  int count=header->count, fmt=header->format;
   zframe_t* syncframe=zmsg_next(*msg);
   CHECK_EQ(size(), count);
+  vector<float> buf;
   Tensor<cpu, 1> server(data_.mutable_cpu_data(), Shape1(count));
-  Tensor<cpu, 1> worker((float*)zframe_data(syncframe), Shape1(count));
+  Tensor<cpu, 1> worker(DecodeFrame(syncframe, fmt, count, &buf),
+      Shape1(count));
   worker=(worker-server)*alpha;
   server+=worker;
-  ps_handle_sync+=zclock_mono()-start;
+  // the server moved by exactly the diff, so must the worker
+  SetFloat32Reply(*msg, syncframe, worker.dptr, count);
   return *msg;
 }
 
 zmsg_t *ElasticParam::GenSyncMsgFromWorker(float alpha){
   int64_t start=zclock_mono();
   zmsg_t* msg=zmsg_new();
-  zmsg_addstrf(msg, "%f-%d", alpha, size());
-  zmsg_addmem(msg, mutable_cpu_data(), sizeof(float)*size());
+  PushHeader(msg, MsgHeader{kSync, id(), 0, slice_, 0, size(), alpha,
+      wire_format_});
+  if(wire_format_==UpdaterProto::kFloat32)
+    AddPinnedFrame(msg, mutable_cpu_data(), size());
+  else
+    AddEncodedFrame(msg, mutable_cpu_data(), size());
   worker_gen_sync+=zclock_mono()-start;
   return msg;
 }
@@ -241,13 +546,12 @@ zmsg_t *ElasticParam::GenSyncMsgFromWorker(float alpha){
 void ElasticParam::ParseSyncMsgFromPS(zmsg_t** msg){
   int64_t start=zclock_mono();
   //LOG(ERROR)<<"worker sync "<<id();
-  char* control=zmsg_popstr(*msg);
-  float alpha;int count;
-  sscanf(control, "%f-%d", &alpha, &count);
-  delete control;
+  MsgHeader header=PopHeader(*msg);
+  int count=header.count;
   zframe_t* frame=zmsg_pop(*msg);
-  CHECK_EQ(zframe_size(frame), count*sizeof(float));
-  Tensor<cpu, 1> diff((float*)zframe_data(frame), Shape1(count));
+  vector<float> buf;
+  Tensor<cpu, 1> diff(DecodeFrame(frame, header.format, count, &buf),
+      Shape1(count));
   Tensor<cpu, 1> data(mutable_cpu_data(), Shape1(count));
   data-=diff;
   zframe_destroy(&frame);
@@ -1,8 +1,191 @@
 #include <glog/logging.h>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include "utils/router.h"
 
 namespace singa {
+/**
+ * Memory referenced by a zero-copy frame, which is sent as a zmq_msg_t by
+ * SendMsg.
+ */
+struct ZeroCopyFrame{
+  uint64_t id;
+  void* data;
+  size_t size;
+  zmq_free_fn* ffn;
+  void* hint;
+};
+/**
+ * Content of placeholder frames. Only frames of this size starting with
+ * kZeroCopyTag are looked up in the registry, hence other frames do not
+ * take the lock.
+ */
+struct Placeholder{
+  uint64_t tag;
+  uint64_t id;
+};
+const uint64_t kZeroCopyTag=0x59504f434f52455aULL; // "ZEROCOPY"
+// zero-copy frames not sent yet, keyed by their placeholder zframe; frames
+// keep their address when moved between msgs (e.g., into batches), hence
+// the placeholder is identified by its address, not only by its content
+static std::mutex zerocopy_mtx;
+static std::unordered_map<const zframe_t*, ZeroCopyFrame> zerocopy_frames;
+static uint64_t zerocopy_id=0;
+
+/**
+ * @return true if the frame is a zero-copy placeholder and copy it into zc;
+ * the placeholder is unregistered if erase is true.
+ */
+static bool FindZeroCopyFrame(zframe_t* frame, ZeroCopyFrame* zc,
+    bool erase){
+  if(zframe_size(frame)!=sizeof(Placeholder))
+    return false;
+  Placeholder ph;
+  memcpy(&ph, zframe_data(frame), sizeof(Placeholder));
+  if(ph.tag!=kZeroCopyTag)
+    return false;
+  std::unique_lock<std::mutex> lck(zerocopy_mtx);
+  auto it=zerocopy_frames.find(frame);
+  // the id rejects a frame copied from a placeholder, or allocated at the
+  // address of a placeholder sent before
+  if(it==zerocopy_frames.end()||ph.id!=it->second.id)
+    return false;
+  *zc=it->second;
+  if(erase)
+    zerocopy_frames.erase(it);
+  return true;
+}
+
+void AddZeroCopyFrame(zmsg_t* msg, void* data, size_t size,
+    zmq_free_fn* ffn, void* hint){
+  ZeroCopyFrame zc;
+  zc.data=data;
+  zc.size=size;
+  zc.ffn=ffn;
+  zc.hint=hint;
+  zframe_t* frame;
+  {
+    std::unique_lock<std::mutex> lck(zerocopy_mtx);
+    zc.id=++zerocopy_id;
+    Placeholder ph{kZeroCopyTag, zc.id};
+    frame=zframe_new(&ph, sizeof(Placeholder));
+    zerocopy_frames[frame]=zc;
+  }
+  zmsg_append(msg, &frame);
+}
+
+void SendMsg(zsock_t* sock, zmsg_t** msg){
+  size_t nframes=zmsg_size(*msg);
+  ZeroCopyFrame zc;
+  for(size_t i=0;i<nframes;i++){
+    zframe_t* frame=zmsg_pop(*msg);
+    bool more=i+1<nframes;
+    int rc;
+    if(FindZeroCopyFrame(frame, &zc, true)){
+      zmq_msg_t part;
+      zmq_msg_init_data(&part, zc.data, zc.size, zc.ffn, zc.hint);
+      rc=zmq_msg_send(&part, zsock_resolve(sock), more?ZMQ_SNDMORE:0);
+      // ZMQ takes the part only if it is sent; closing it calls ffn
+      if(rc<0)
+        zmq_msg_close(&part);
+      zframe_destroy(&frame);
+    }else{
+      rc=zframe_send(&frame, sock, more?ZFRAME_MORE:0);
+      // the frame is kept if it is not sent
+      if(frame!=nullptr)
+        zframe_destroy(&frame);
+    }
+    if(rc<0){
+      LOG(ERROR)<<"Failed to send msg: "<<zmq_strerror(zmq_errno());
+      break;
+    }
+  }
+  // the frames left after a failure are released
+  DestroyMsg(msg);
+}
+
+void DestroyMsg(zmsg_t** msg){
+  ZeroCopyFrame zc;
+  for(zframe_t* frame=zmsg_first(*msg);frame;frame=zmsg_next(*msg))
+    if(FindZeroCopyFrame(frame, &zc, true)&&zc.ffn!=nullptr)
+      zc.ffn(zc.data, zc.hint);
+  zmsg_destroy(msg);
+}
+
+size_t MsgSize(zmsg_t* msg){
+  size_t size=0;
+  ZeroCopyFrame zc;
+  for(zframe_t* frame=zmsg_first(msg);frame;frame=zmsg_next(msg)){
+    if(FindZeroCopyFrame(frame, &zc, false))
+      size+=zc.size;
+    else
+      size+=zframe_size(frame);
+  }
+  return size;
+}
+
+void AddToBatch(zmsg_t* batch, zmsg_t** msg){
+  PeekHeader(batch)->count++;
+  int nframes=zmsg_size(*msg);
+  zmsg_addmem(batch, &nframes, sizeof(int));
+  for(int i=0;i<nframes;i++){
+    zframe_t* frame=zmsg_pop(*msg);
+    zmsg_append(batch, &frame);
+  }
+  zmsg_destroy(msg);
+}
+
+vector<zmsg_t*> UnpackBatch(zmsg_t** batch){
+  MsgHeader header=PopHeader(*batch);
+  CHECK_EQ(header.type, kBatch);
+  vector<zmsg_t*> parts;
+  for(int k=0;k<header.count;k++){
+    zframe_t* frame=zmsg_pop(*batch);
+    CHECK_EQ(zframe_size(frame), sizeof(int));
+    int nframes=*reinterpret_cast<int*>(zframe_data(frame));
+    zframe_destroy(&frame);
+    zmsg_t* msg=zmsg_new();
+    for(int i=0;i<nframes;i++){
+      frame=zmsg_pop(*batch);
+      zmsg_append(msg, &frame);
+    }
+    parts.push_back(msg);
+  }
+  zmsg_destroy(batch);
+  return parts;
+}
+
+void PinCounter::AddFrame(zmsg_t* msg, void* data, size_t size){
+  {
+    std::unique_lock<std::mutex> lck(state_->mtx);
+    state_->count++;
+  }
+  // the hint keeps the state alive until ZMQ releases the frame
+  AddZeroCopyFrame(msg, data, size, &PinCounter::Release,
+      new std::shared_ptr<State>(state_));
+}
+
+void PinCounter::Release(void* data, void* hint){
+  auto* state=static_cast<std::shared_ptr<State>*>(hint);
+  {
+    std::unique_lock<std::mutex> lck((*state)->mtx);
+    if(--(*state)->count==0)
+      (*state)->cv.notify_all();
+  }
+  delete state;
+}
+
+void PinCounter::Wait() const{
+  std::unique_lock<std::mutex> lck(state_->mtx);
+  state_->cv.wait(lck, [&]{return state_->count==0;});
+}
+
+int PinCounter::count() const{
+  std::unique_lock<std::mutex> lck(state_->mtx);
+  return state_->count;
+}
 
 Router::Router(int port):port_(port), last_recv_node_(nullptr){
   router_=zsock_new(ZMQ_ROUTER);
@@ -87,7 +270,7 @@ bool Router::Bind(string addr, size_t expected_connections){
 
 void Router::Send(zmsg_t* msg, int serverid){
   zmsg_pushstr(msg, nodes_[serverid].first.c_str());
-  zmsg_send(&msg, router_);
+  SendMsg(router_, &msg);
 }
 
   /**
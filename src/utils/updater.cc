@@ -1,14 +1,33 @@
 
+#include <cmath>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#define SINGA_X86_SIMD
+#include <immintrin.h>
+#endif
 #include "utils/updater.h"
-#include "mshadow/tensor.h"
-#include "mshadow/cxxnet_op.h"
 #include "proto/model.pb.h"
-using namespace mshadow;
-using namespace mshadow::expr;
 
 namespace  singa {
 
 float Updater::GetLearningRate(int step){
+  // all Params of one step share the learning rate; the cache packs the
+  // step (high 32 bits) and the rate (low 32 bits) to be updated atomically
+  uint64_t cache=lr_cache_.load();
+  float ret=0.;
+  if(static_cast<int>(cache>>32)==step){
+    uint32_t bits=static_cast<uint32_t>(cache);
+    memcpy(&ret, &bits, sizeof(float));
+    return ret;
+  }
+  ret=ComputeLearningRate(step);
+  uint32_t bits;
+  memcpy(&bits, &ret, sizeof(float));
+  lr_cache_.store((static_cast<uint64_t>(static_cast<uint32_t>(step))<<32)|bits);
+  return ret;
+}
+
+float Updater::ComputeLearningRate(int step){
   float ret = 0., r = 0., base=proto_.base_learning_rate();
   int freq=0;
   switch (proto_.learning_rate_change_method()) {
@@ -50,6 +69,192 @@ float Updater::GetLearningRate(int step){
   return ret;
 }
 
+shared_ptr<Updater> CreateUpdater(const UpdaterProto& proto){
+  shared_ptr<Updater> updater;
+  switch(proto.type()){
+    case UpdaterProto_Type_kAdaGrad:
+    updater=std::make_shared<AdaGradUpdater>();
+    break;
+    case UpdaterProto_Type_kAdaDelta:
+    updater=std::make_shared<AdaDeltaUpdater>();
+    break;
+    case UpdaterProto_Type_kNesterov:
+    updater=std::make_shared<NesterovUpdater>();
+    break;
+    case UpdaterProto_Type_kSGD:
+    updater=std::make_shared<SGDUpdater>();
+    break;
+    case UpdaterProto_Type_kRMSProp:
+    updater=std::make_shared<RMSPropUpdater>();
+    break;
+    default:
+    LOG(FATAL)<<"Unknow updater "<<proto.type();
+  }
+  updater->Init(proto);
+  return updater;
+}
+
+/****************************fused kernels*********************************/
+// Each kernel updates one element (Float1) or 8 elements (Float8) in a single
+// pass, i.e., data, grad and the states are read and written once per step.
+// The L2 regularization (wd>0) is applied on the fly without writing grad.
+// Float8 is compiled for AVX regardless of the build flags and used only if
+// the CPU supports it, as the codecs in codec.cc.
+struct Float1{
+  float v;
+  Float1(float x):v(x){}
+  static Float1 Load(const float* p){return Float1(*p);}
+  void Store(float* p) const{*p=v;}
+};
+inline Float1 operator+(Float1 a, Float1 b){return Float1(a.v+b.v);}
+inline Float1 operator-(Float1 a, Float1 b){return Float1(a.v-b.v);}
+inline Float1 operator*(Float1 a, Float1 b){return Float1(a.v*b.v);}
+inline Float1 operator/(Float1 a, Float1 b){return Float1(a.v/b.v);}
+inline Float1 Sqrt(Float1 a){return Float1(std::sqrt(a.v));}
+
+#ifdef SINGA_X86_SIMD
+#define SINGA_TARGET_AVX __attribute__((target("avx")))
+struct Float8{
+  __m256 v;
+  SINGA_TARGET_AVX Float8(__m256 x):v(x){}
+  SINGA_TARGET_AVX Float8(float x):v(_mm256_set1_ps(x)){}
+  SINGA_TARGET_AVX static Float8 Load(const float* p){
+    return Float8(_mm256_loadu_ps(p));
+  }
+  SINGA_TARGET_AVX void Store(float* p) const{_mm256_storeu_ps(p, v);}
+};
+SINGA_TARGET_AVX inline Float8 operator+(Float8 a, Float8 b){
+  return _mm256_add_ps(a.v, b.v);
+}
+SINGA_TARGET_AVX inline Float8 operator-(Float8 a, Float8 b){
+  return _mm256_sub_ps(a.v, b.v);
+}
+SINGA_TARGET_AVX inline Float8 operator*(Float8 a, Float8 b){
+  return _mm256_mul_ps(a.v, b.v);
+}
+SINGA_TARGET_AVX inline Float8 operator/(Float8 a, Float8 b){
+  return _mm256_div_ps(a.v, b.v);
+}
+SINGA_TARGET_AVX inline Float8 Sqrt(Float8 a){return _mm256_sqrt_ps(a.v);}
+
+static bool HasAVX(){
+  static const bool ret=(__builtin_cpu_init(), __builtin_cpu_supports("avx"));
+  return ret;
+}
+
+/**
+ * Run the kernel on blocks of 8 elements. Flattened, i.e., Apply<Float8>
+ * and the Float8 operators are inlined, hence they are compiled for AVX.
+ * @return num of elements updated.
+ */
+template<typename Kernel>
+SINGA_TARGET_AVX __attribute__((flatten))
+int RunKernelAVX(const Kernel& kernel, int len){
+  int i=0;
+  for(;i+8<=len;i+=8)
+    kernel.template Apply<Float8>(i);
+  return i;
+}
+#endif
+
+template<typename Kernel>
+void RunKernel(const Kernel& kernel, int len){
+  int i=0;
+#ifdef SINGA_X86_SIMD
+  if(HasAVX())
+    i=RunKernelAVX(kernel, len);
+#endif
+  for(;i<len;i++)
+    kernel.template Apply<Float1>(i);
+}
+
+/**
+ * Arrays and hyper-parameters of one contiguous range of a Param.
+ * The states are zero at step 0 (reset), hence they are not loaded.
+ */
+struct KernelArgs{
+  float *data, *grad, *history, *update;
+  float lr, wd, grad_scale;
+  bool reset;
+};
+
+struct SGDKernel: public KernelArgs{
+  float momentum;
+  template<typename V> void Apply(int i) const{
+    V d=V::Load(data+i), g=V::Load(grad+i)+wd*d;
+    if(momentum>0){
+      V h=reset?V(0.f):V::Load(history+i);
+      h=h*momentum+lr*g;
+      h.Store(history+i);
+      (d-h).Store(data+i);
+    }else{
+      (d-lr*g).Store(data+i);
+    }
+  }
+};
+
+struct NesterovKernel: public KernelArgs{
+  float momentum;
+  template<typename V> void Apply(int i) const{
+    V d=V::Load(data+i), g=V::Load(grad+i)+wd*d;
+    V h0=reset?V(0.f):V::Load(history+i);
+    V h=h0*momentum+lr*g;
+    h.Store(history+i);
+    (d-(h*(1+momentum)-h0*momentum)).Store(data+i);
+  }
+};
+
+struct AdaGradKernel: public KernelArgs{
+  float delta;
+  template<typename V> void Apply(int i) const{
+    V d=V::Load(data+i), g=V::Load(grad+i), gs=g*grad_scale;
+    V h=(reset?V(0.f):V::Load(history+i))+gs*gs;
+    h.Store(history+i);
+    (d-lr*(g+wd*d)/Sqrt(h+delta)).Store(data+i);
+  }
+};
+
+struct RMSPropKernel: public KernelArgs{
+  float delta, rho;
+  template<typename V> void Apply(int i) const{
+    V d=V::Load(data+i), g=V::Load(grad+i), gs=g*grad_scale;
+    V h=(reset?V(0.f):V::Load(history+i))*rho+(1-rho)*(gs*gs);
+    h.Store(history+i);
+    (d-lr*(g+wd*d)/Sqrt(h+delta)).Store(data+i);
+  }
+};
+
+struct AdaDeltaKernel: public KernelArgs{
+  float delta, rho;
+  template<typename V> void Apply(int i) const{
+    V d=V::Load(data+i), g=V::Load(grad+i)+wd*d, gs=g*grad_scale;
+    V h=(reset?V(0.f):V::Load(history+i))*rho+(1-rho)*(gs*gs);
+    V u=reset?V(0.f):V::Load(update+i);
+    V t=g*Sqrt(u+delta)/Sqrt(h+delta);
+    h.Store(history+i);
+    (rho*u+(1-rho)*(t*t)).Store(update+i);
+    (d-t).Store(data+i);
+  }
+};
+
+/**
+ * Fill the arrays and the decayed hyper-parameters of the range.
+ */
+template<typename Kernel>
+void SetupKernel(Updater* updater, int step, shared_ptr<Param> param,
+    float grad_scale, int offset, float weight_decay, bool history,
+    bool update, Kernel* kernel){
+  kernel->data=param->mutable_cpu_data()+offset;
+  kernel->grad=param->mutable_cpu_grad()+offset;
+  kernel->history=history?param->mutable_cpu_history()+offset:nullptr;
+  kernel->update=update?param->mutable_cpu_update()+offset:nullptr;
+  kernel->lr=updater->GetLearningRate(step)*param->learning_rate_multiplier();
+  float wd=weight_decay*param->weight_decay_multiplier();
+  kernel->wd=wd>0?wd:0.f;
+  kernel->grad_scale=grad_scale;
+  kernel->reset=step==0;
+}
+
 /***********************SGD with momentum******************************/
 void SGDUpdater::Init(const UpdaterProto& proto){
   Updater::Init(proto);
@@ -59,23 +264,14 @@ void SGDUpdater::Init(const UpdaterProto& proto){
   weight_decay_=proto.weight_decay();
 }
 
-void SGDUpdater::Update(int step, shared_ptr<Param> param, float grad_scale){
-  Shape<1> s=Shape1(param->size());
-  Tensor<cpu, 1> data(param->mutable_cpu_data(), s);
-  Tensor<cpu, 1> grad(param->mutable_cpu_grad(), s);
-  float lr=GetLearningRate(step)*param->learning_rate_multiplier();
-  float wd=weight_decay_*param->weight_decay_multiplier();
-  if(wd>0){ // L2 regularization
-    grad+=data*wd;
-  }
-  if(momentum_>0){
-    Tensor<cpu, 1> history(param->mutable_cpu_history(), s);
-    if(step==0) history=0;
-    history=history*momentum_+lr*grad;
-    data-=history;
-  }else{
-    data-=lr*grad;
-  }
+void SGDUpdater::UpdateSlice(int step, shared_ptr<Param> param,
+    float grad_scale, int offset, int len){
+  SGDKernel kernel;
+  // the gradient scale is not applied, as before
+  SetupKernel(this, step, param, grad_scale, offset, weight_decay_,
+      momentum_>0, false, &kernel);
+  kernel.momentum=momentum_;
+  RunKernel(kernel, len);
 }
 
 /***********************Nesterov******************************/
@@ -83,25 +279,17 @@ void NesterovUpdater::Init(const UpdaterProto& proto){
   Updater::Init(proto);
   base_lr_=proto.base_learning_rate();
   CHECK_GT(base_lr_, 0);
+  momentum_=proto.momentum();
   weight_decay_=proto.weight_decay();
 }
 
-void NesterovUpdater::Update(int step, shared_ptr<Param> param, float grad_scale){
-  Shape<1> s=Shape1(param->size());
-  Tensor<cpu, 1> data(param->mutable_cpu_data(), s);
-  Tensor<cpu, 1> grad(param->mutable_cpu_grad(), s);
-  Tensor<cpu, 1> history(param->mutable_cpu_history(), s);
-  TensorContainer<cpu, 1> tmp(s);
-  if(step==0) history=0;
-  float lr=GetLearningRate(step)*param->learning_rate_multiplier();
-  float wd=weight_decay_*param->weight_decay_multiplier();
-  if(wd>0){ // L2 regularization
-    grad+=data*wd;
-  }
-  Copy(tmp, history);
-  history=history*momentum_+lr*grad;
-  tmp=history*(1+momentum_)-tmp*momentum_;
-  data-=tmp;
+void NesterovUpdater::UpdateSlice(int step, shared_ptr<Param> param,
+    float grad_scale, int offset, int len){
+  NesterovKernel kernel;
+  SetupKernel(this, step, param, grad_scale, offset, weight_decay_, true,
+      false, &kernel);
+  kernel.momentum=momentum_;
+  RunKernel(kernel, len);
 }
 /***********************AdaGrad******************************/
 void AdaGradUpdater::Init(const UpdaterProto& proto){
@@ -112,19 +300,13 @@ void AdaGradUpdater::Init(const UpdaterProto& proto){
   weight_decay_=proto.weight_decay();
 }
 
-void AdaGradUpdater::Update(int step, shared_ptr<Param> param, float grad_scale){
-  Shape<1> s=Shape1(param->size());
-  Tensor<cpu, 1> data(param->mutable_cpu_data(), s);
-  Tensor<cpu, 1> grad(param->mutable_cpu_grad(), s);
-  Tensor<cpu, 1> history(param->mutable_cpu_history(), s);
-  if(step==0) history=0;
-  history+=F<op::square>(grad*grad_scale);
-  float lr=GetLearningRate(step)*param->learning_rate_multiplier();
-  float wd=weight_decay_*param->weight_decay_multiplier();
-  if(wd>0){ // L2 regularization
-    grad+=data*wd;
-  }
-  data-=lr*grad/(F<op::sqrtop>(history,delta_));
+void AdaGradUpdater::UpdateSlice(int step, shared_ptr<Param> param,
+    float grad_scale, int offset, int len){
+  AdaGradKernel kernel;
+  SetupKernel(this, step, param, grad_scale, offset, weight_decay_, true,
+      false, &kernel);
+  kernel.delta=delta_;
+  RunKernel(kernel, len);
 }
 
 /***********************RMSProp******************************/
@@ -137,19 +319,14 @@ void RMSPropUpdater::Init(const UpdaterProto& proto){
   weight_decay_=proto.weight_decay();
 }
 
-void RMSPropUpdater::Update(int step, shared_ptr<Param> param, float grad_scale){
-  Shape<1> s=Shape1(param->size());
-  Tensor<cpu, 1> data(param->mutable_cpu_data(), s);
-  Tensor<cpu, 1> grad(param->mutable_cpu_grad(), s);
-  Tensor<cpu, 1> history(param->mutable_cpu_history(), s);
-  if(step==0) history=0;
-  history=history*rho_+(1-rho_)*F<op::square>(grad*grad_scale);
-  float lr=GetLearningRate(step)*param->learning_rate_multiplier();
-  float wd=weight_decay_*param->weight_decay_multiplier();
-  if(wd>0){ // L2 regularization
-    grad+=data*wd;
-  }
-  data-=lr*grad/(F<op::sqrtop>(history,delta_));
+void RMSPropUpdater::UpdateSlice(int step, shared_ptr<Param> param,
+    float grad_scale, int offset, int len){
+  RMSPropKernel kernel;
+  SetupKernel(this, step, param, grad_scale, offset, weight_decay_, true,
+      false, &kernel);
+  kernel.delta=delta_;
+  kernel.rho=rho_;
+  RunKernel(kernel, len);
 }
 
 /***********************AdaDelta******************************/
@@ -160,25 +337,14 @@ void AdaDeltaUpdater::Init(const UpdaterProto& proto){
   weight_decay_=proto.weight_decay();
 }
 
-void AdaDeltaUpdater::Update(int step, shared_ptr<Param> param, float grad_scale){
-  Shape<1> s=Shape1(param->size());
-  Tensor<cpu, 1> data(param->mutable_cpu_data(), s);
-  Tensor<cpu, 1> grad(param->mutable_cpu_grad(), s);
-  Tensor<cpu, 1> history(param->mutable_cpu_history(), s);
-  Tensor<cpu, 1> update(param->mutable_cpu_update(), s);
-  TensorContainer<cpu, 1> tmp(s);
-  float wd=weight_decay_*param->weight_decay_multiplier();
-  if(wd>0){ // L2 regularization
-    grad+=data*wd;
-  }
-  if(step==0){
-    history=0;
-    update=0;
-  }
-  history=history*rho_+(1-rho_)*F<op::square>(grad*grad_scale);
-  tmp=grad*F<op::sqrtop>(update, delta_)/F<op::sqrtop>(history, delta_);
-  update=rho_*update+(1-rho_)*F<op::square>(tmp);
-  data-=tmp;
+void AdaDeltaUpdater::UpdateSlice(int step, shared_ptr<Param> param,
+    float grad_scale, int offset, int len){
+  AdaDeltaKernel kernel;
+  SetupKernel(this, step, param, grad_scale, offset, weight_decay_, true,
+      true, &kernel);
+  kernel.delta=delta_;
+  kernel.rho=rho_;
+  RunKernel(kernel, len);
 }
 
 } /* singa */
@@ -0,0 +1,32 @@
+#include "utils/workspace.h"
+
+namespace singa {
+Workspace* Workspace::Get(){
+  static thread_local Workspace workspace;
+  return &workspace;
+}
+
+float* Workspace::Borrow(int k, size_t size, const void* owner,
+    int64_t stamp){
+  if(k>=static_cast<int>(buffers_.size()))
+    buffers_.resize(k+1);
+  Buffer& buf=buffers_[k];
+  if(size>static_cast<size_t>(buf.blob.count()))
+    buf.blob.Reshape(vector<int>{static_cast<int>(size)});
+  buf.owner=owner;
+  buf.stamp=stamp;
+  return buf.blob.mutable_cpu_data();
+}
+
+bool Workspace::Holds(int k, const void* owner, int64_t stamp) const{
+  return k<static_cast<int>(buffers_.size())&&owner!=nullptr
+    &&buffers_[k].owner==owner&&buffers_[k].stamp==stamp;
+}
+
+size_t Workspace::size() const{
+  size_t bytes=0;
+  for(auto& buf: buffers_)
+    bytes+=buf.blob.count()*sizeof(float);
+  return bytes;
+}
+}  // namespace singa
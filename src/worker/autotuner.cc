@@ -0,0 +1,211 @@
+#include <glog/logging.h>
+#include <czmq.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include "mshadow/tensor.h"
+#include "utils/common.h"
+#include "worker/autotuner.h"
+
+// OpenBLAS is linked, see LIBRARIES in the Makefile
+extern "C" void openblas_set_num_threads(int num_threads);
+
+using namespace mshadow;
+using namespace mshadow::expr;
+
+namespace singa {
+// num of timed runs of each candidate after the warmup run
+const int kRuns=3;
+
+Autotuner::Autotuner(const string& path): path_(path), dirty_(false){
+  Load(&cache_);
+  if(cache_.size())
+    LOG(INFO)<<"Loaded "<<cache_.size()<<" autotuning choices from "<<path_;
+}
+
+void Autotuner::Load(std::map<string, string>* cache) const{
+  std::ifstream ifs(path_);
+  string line;
+  while(std::getline(ifs, line)){
+    size_t pos=line.find('\t');
+    if(pos!=string::npos)
+      (*cache)[line.substr(0, pos)]=line.substr(pos+1);
+  }
+}
+
+template<typename Func>
+int64_t Autotuner::Time(Func func){
+  // the first run allocates buffers and warms up caches
+  func();
+  int64_t best=-1;
+  for(int i=0;i<kRuns;i++){
+    int64_t start=zclock_usecs();
+    func();
+    int64_t t=zclock_usecs()-start;
+    if(best<0||t<best)
+      best=t;
+  }
+  return best;
+}
+
+static void FillRandom(vector<float>* vec, std::mt19937* gen){
+  std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+  for(float& x: *vec)
+    x=dist(*gen);
+}
+
+ConvolutionProto Autotuner::TuneConv(const ConvShape& s,
+    const ConvolutionProto& proto){
+  string key=StringPrintf("conv %d %d %d %d %d %d %d %d", s.batchsize,
+      s.channels, s.height, s.width, s.num_filters, s.kernel, s.pad, s.stride);
+  ConvolutionProto tuned(proto);
+  auto it=cache_.find(key);
+  if(it!=cache_.end()){
+    std::istringstream is(it->second);
+    string name;
+    int block;
+    ConvolutionProto::Engine type;
+    if(is>>name>>block&&ConvolutionProto::Engine_Parse(name, &type)
+        &&ConvEngineSupports(type, s)){
+      tuned.set_engine(type);
+      tuned.set_col_block(block);
+      return tuned;
+    }
+    LOG(ERROR)<<"Invalid autotuning choice '"<<it->second<<"' for "<<key;
+  }
+
+  std::mt19937 gen(0);
+  vector<float> src(s.batchsize*s.channels*s.height*s.width), gsrc(src.size());
+  vector<float> weight(s.num_filters*s.channels*s.kernel*s.kernel),
+    gweight(weight.size());
+  vector<float> data(s.batchsize*s.num_filters*s.conv_height*s.conv_width),
+    grad(data.size());
+  FillRandom(&src, &gen);
+  FillRandom(&weight, &gen);
+  FillRandom(&grad, &gen);
+  // (engine, col_block), col_block 1 for im2col of one image at a time
+  vector<std::pair<ConvolutionProto::Engine, int>> candidates{
+    {ConvolutionProto::kIm2col, 1}, {ConvolutionProto::kIm2col, 0},
+    {ConvolutionProto::kDirect, 0}, {ConvolutionProto::kWinograd, 0}};
+  int64_t best=-1;
+  for(auto& candidate: candidates){
+    if(!ConvEngineSupports(candidate.first, s))
+      continue;
+    ConvolutionProto setting(proto);
+    setting.set_engine(candidate.first);
+    setting.set_col_block(candidate.second);
+    shared_ptr<ConvEngine> engine=CreateConvEngine(candidate.first, s, setting);
+    int64_t t=Time([&](){
+        engine->Forward(true, src.data(), weight.data(), data.data(),
+          nullptr);
+        engine->Backward(src.data(), weight.data(), grad.data(),
+          gweight.data(), gsrc.data());
+        });
+    LOG(INFO)<<key<<" "<<ConvolutionProto::Engine_Name(candidate.first)
+      <<" col_block "<<candidate.second<<": "<<t<<" us";
+    if(best<0||t<best){
+      best=t;
+      tuned=setting;
+    }
+  }
+  cache_[key]=ConvolutionProto::Engine_Name(tuned.engine())+" "
+    +std::to_string(tuned.col_block());
+  dirty_=true;
+  LOG(INFO)<<"Autotuned "<<key<<": "<<cache_[key];
+  return tuned;
+}
+
+void Autotuner::AddGemm(int batchsize, int vdim, int hdim){
+  gemms_.push_back(vector<int>{batchsize, vdim, hdim});
+}
+
+void Autotuner::TuneBlasThreads(int maxthreads){
+  if(gemms_.empty())
+    return;
+  string key="blas "+std::to_string(maxthreads);
+  for(auto& g: gemms_)
+    key+=StringPrintf(" %dx%dx%d", g[0], g[1], g[2]);
+  int nthreads=0;
+  auto it=cache_.find(key);
+  if(it!=cache_.end())
+    nthreads=atoi(it->second.c_str());
+  if(nthreads<=0||nthreads>maxthreads){
+    vector<int> candidates;
+    for(int n=1;n<maxthreads;n*=2)
+      candidates.push_back(n);
+    candidates.push_back(maxthreads);
+    std::mt19937 gen(0);
+    int64_t best=-1;
+    for(int n: candidates){
+      openblas_set_num_threads(n);
+      int64_t total=0;
+      for(auto& g: gemms_){
+        vector<float> src(g[0]*g[1]), gsrc(src.size());
+        vector<float> weight(g[1]*g[2]), gweight(weight.size());
+        vector<float> data(g[0]*g[2]), grad(data.size());
+        FillRandom(&src, &gen);
+        FillRandom(&weight, &gen);
+        FillRandom(&grad, &gen);
+        Tensor<cpu, 2> srct(src.data(), Shape2(g[0], g[1]));
+        Tensor<cpu, 2> gsrct(gsrc.data(), Shape2(g[0], g[1]));
+        Tensor<cpu, 2> weightt(weight.data(), Shape2(g[1], g[2]));
+        Tensor<cpu, 2> gweightt(gweight.data(), Shape2(g[1], g[2]));
+        Tensor<cpu, 2> datat(data.data(), Shape2(g[0], g[2]));
+        Tensor<cpu, 2> gradt(grad.data(), Shape2(g[0], g[2]));
+        // GEMMs of InnerProductLayer::ComputeFeature and ComputeGradient
+        total+=Time([&](){
+            datat=dot(srct, weightt);
+            gweightt=dot(srct.T(), gradt);
+            gsrct=dot(gradt, weightt.T());
+            });
+      }
+      LOG(INFO)<<key<<" "<<n<<" threads: "<<total<<" us";
+      if(best<0||total<best){
+        best=total;
+        nthreads=n;
+      }
+    }
+    cache_[key]=std::to_string(nthreads);
+    dirty_=true;
+    LOG(INFO)<<"Autotuned "<<key<<": "<<nthreads<<" threads";
+  }
+  openblas_set_num_threads(nthreads);
+  gemms_.clear();
+}
+
+void Autotuner::Save(){
+  if(!dirty_)
+    return;
+  // keep the choices saved by other procs since the cache was loaded
+  std::map<string, string> merged;
+  Load(&merged);
+  for(auto& entry: cache_)
+    merged[entry.first]=entry.second;
+  // the file is replaced atomically, hence readers never see a partial
+  // file and concurrent writers do not interleave
+  string tmp=path_+".tmp."+std::to_string(getpid());
+  {
+    std::ofstream ofs(tmp);
+    if(!ofs.is_open()){
+      LOG(ERROR)<<"Cannot write autotuning cache "<<tmp;
+      return;
+    }
+    for(auto& entry: merged)
+      ofs<<entry.first<<"\t"<<entry.second<<"\n";
+    if(!ofs.flush()){
+      LOG(ERROR)<<"Cannot write autotuning cache "<<tmp;
+      std::remove(tmp.c_str());
+      return;
+    }
+  }
+  if(std::rename(tmp.c_str(), path_.c_str())){
+    LOG(ERROR)<<"Cannot replace autotuning cache "<<path_;
+    std::remove(tmp.c_str());
+    return;
+  }
+  cache_.swap(merged);
+  dirty_=false;
+}
+}  // namespace singa
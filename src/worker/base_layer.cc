@@ -28,10 +28,12 @@ void Layer::SetupAfterPartition(){
     <<IntVecToString(shape)<<"--"<<IntVecToString(data_.shape());
 }
 void Layer::ComputeFeature(bool training){
-  ComputeFeature(training, srclayers_);
+  if(!fused_)
+    ComputeFeature(training, srclayers_);
 }
 void Layer::ComputeGradient(){
-  ComputeGradient(srclayers_);
+  if(!fused_)
+    ComputeGradient(srclayers_);
 }
 
 void Layer::ToProto(LayerProto *proto, bool copyData) {
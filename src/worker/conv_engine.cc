@@ -0,0 +1,462 @@
+#include <glog/logging.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include "mshadow/tensor.h"
+#include "utils/workspace.h"
+#include "worker/conv_engine.h"
+
+using namespace mshadow;
+using namespace mshadow::expr;
+
+namespace singa {
+// column buffers of one layer take at most this many Bytes and
+// 1/kColBufferShare of the available memory if not configured
+const size_t kMaxColBuffer=size_t(128)<<20;
+const size_t kColBufferShare=16;
+// num of filters whose output rows are accumulated together by the direct
+// engine, sharing the loaded input rows
+const int kFilterBlock=4;
+// the direct engine is chosen for inputs with at most this many channels,
+// which are too thin for GEMM to pay off
+const int kMaxDirectChannels=32;
+// Winograd is chosen if both channels and filters are at least this many,
+// such that its 16 GEMMs per image are large enough
+const int kMinWinogradChannels=16;
+// ids of Workspace buffers; engines of different layers share them
+enum ConvBuffer{
+  kColData=0, kColGrad=1, kColOut=2,
+  kFlipped=0, kTransWeight=1, kTiles=2, kTileOut=3
+};
+
+/*************************Im2colConvEngine**********************************/
+void Im2colConvEngine::Setup(const ConvShape& shape,
+    const ConvolutionProto& proto){
+  ConvEngine::Setup(shape, proto);
+  col_height_=shape.channels*shape.kernel*shape.kernel;
+  col_width_=shape.conv_height*shape.conv_width;
+  col_block_=proto.col_block()>0?std::min(proto.col_block(), shape.batchsize)
+    :ColBlockSize(proto.col_buffer_mb());
+  col_cached_=false;
+  col_stamp_=0;
+}
+
+int Im2colConvEngine::ColBlockSize(int buffer_mb){
+  size_t persample=(2*col_height_+shape_.num_filters)*col_width_*sizeof(float);
+  size_t budget=size_t(buffer_mb)<<20;
+  if(buffer_mb<=0){
+    budget=kMaxColBuffer;
+    long pages=sysconf(_SC_AVPHYS_PAGES), pagesize=sysconf(_SC_PAGESIZE);
+    if(pages>0&&pagesize>0)
+      budget=std::min(budget, size_t(pages)*pagesize/kColBufferShare);
+  }
+  return std::max(1, std::min(shape_.batchsize,
+        static_cast<int>(budget/persample)));
+}
+
+void Im2colConvEngine::Forward(bool training, const float* srcptr,
+    const float* weightptr, float* dataptr, const ConvEpilogue& epilogue){
+  const ConvShape& s=shape_;
+  Tensor<cpu, 4> src(const_cast<float*>(srcptr),
+      Shape4(s.batchsize, s.channels, s.height, s.width));
+  Tensor<cpu, 3> data(dataptr, Shape3(s.batchsize, s.num_filters, col_width_));
+  Tensor<cpu, 2> weight(const_cast<float*>(weightptr),
+      Shape2(s.num_filters, col_height_));
+  Workspace* ws=Workspace::Get();
+  float* coldata=ws->Borrow(kColData, col_height_*col_block_*col_width_, this,
+      ++col_stamp_);
+  float* colout=ws->Borrow(kColOut, s.num_filters*col_block_*col_width_);
+  // lower a block of images into one matrix, hence one large GEMM per block
+  for(int n=0;n<s.batchsize;n+=col_block_){
+    int nb=std::min(col_block_, s.batchsize-n);
+    Tensor<cpu, 2> col(coldata, Shape2(col_height_, nb*col_width_));
+    Tensor<cpu, 2> out(colout, Shape2(s.num_filters, nb*col_width_));
+    if(s.pad>0)
+      col=unpack_patch2col(pad(src.Slice(n, n+nb), s.pad), s.kernel, s.stride);
+    else
+      col=unpack_patch2col(src.Slice(n, n+nb), s.kernel, s.stride);
+    out=dot(weight, col);
+    for(int k=0;k<nb;k++)
+      for(int f=0;f<s.num_filters;f++)
+        memcpy(data[n+k][f].dptr, out[f].dptr+k*col_width_,
+            col_width_*sizeof(float));
+    if(epilogue)
+      epilogue(n, nb, data[n].dptr);
+  }
+  // backward reuses the columns if the whole batch fits into one block
+  col_cached_=training&&col_block_>=s.batchsize;
+}
+
+void Im2colConvEngine::Backward(const float* srcptr, const float* weightptr,
+    const float* gradptr, float* gweightptr, float* gsrcptr){
+  const ConvShape& s=shape_;
+  Tensor<cpu, 4> src(const_cast<float*>(srcptr),
+      Shape4(s.batchsize, s.channels, s.height, s.width));
+  Tensor<cpu, 2> weight(const_cast<float*>(weightptr),
+      Shape2(s.num_filters, col_height_));
+  Tensor<cpu, 3> grad(const_cast<float*>(gradptr),
+      Shape3(s.batchsize, s.num_filters, col_width_));
+  Tensor<cpu, 2> gweight(gweightptr, Shape2(s.num_filters, col_height_));
+  Tensor<cpu, 4> gsrc(gsrcptr,
+      Shape4(s.batchsize, s.channels, s.height, s.width));
+
+  gweight=0.0f;
+  Workspace* ws=Workspace::Get();
+  // the columns are kept if no other layer has borrowed the buffer since
+  // the Forward of this layer (on this thread)
+  bool cached=col_cached_&&ws->Holds(kColData, this, col_stamp_);
+  float* coldata=ws->Borrow(kColData, col_height_*col_block_*col_width_, this,
+      col_stamp_);
+  float* colout=ws->Borrow(kColOut, s.num_filters*col_block_*col_width_);
+  float* colgrad=nullptr;
+  if(gsrcptr!=nullptr)
+    colgrad=ws->Borrow(kColGrad, col_height_*col_block_*col_width_);
+  Shape<2> imgshape=Shape2(s.height, s.width);
+  for(int n=0;n<s.batchsize;n+=col_block_){
+    int nb=std::min(col_block_, s.batchsize-n);
+    Tensor<cpu, 2> col(coldata, Shape2(col_height_, nb*col_width_));
+    Tensor<cpu, 2> gout(colout, Shape2(s.num_filters, nb*col_width_));
+    if(!cached){
+      if(s.pad>0)
+        col=unpack_patch2col(pad(src.Slice(n, n+nb), s.pad), s.kernel,
+            s.stride);
+      else
+        col=unpack_patch2col(src.Slice(n, n+nb), s.kernel, s.stride);
+    }
+    for(int k=0;k<nb;k++)
+      for(int f=0;f<s.num_filters;f++)
+        memcpy(gout[f].dptr+k*col_width_, grad[n+k][f].dptr,
+            col_width_*sizeof(float));
+    gweight+=dot(gout, col.T());
+
+    if(gsrcptr!=nullptr){
+      Tensor<cpu, 2> gcol(colgrad, Shape2(col_height_, nb*col_width_));
+      gcol=dot(weight.T(), gout);
+      Tensor<cpu, 4> gsrcblock=gsrc.Slice(n, n+nb);
+      Shape<4> padshape=gsrcblock.shape;
+      padshape[0]+=2*s.pad;padshape[1]+=2*s.pad;
+      gsrcblock=crop(pack_col2patch(gcol, padshape, s.kernel, s.stride),
+          imgshape);
+    }
+  }
+  col_cached_=false;
+}
+
+/*************************DirectConvEngine**********************************/
+// o_j[x]+=w[j]*row[x] for x<n, j<kFilterBlock
+static inline void AxpyRows(float* __restrict__ o0, float* __restrict__ o1,
+    float* __restrict__ o2, float* __restrict__ o3,
+    const float* __restrict__ row, const float* w, int n){
+  float w0=w[0], w1=w[1], w2=w[2], w3=w[3];
+  for(int x=0;x<n;x++){
+    float v=row[x];
+    o0[x]+=w0*v;
+    o1[x]+=w1*v;
+    o2[x]+=w2*v;
+    o3[x]+=w3*v;
+  }
+}
+
+static inline void AxpyRow(float* __restrict__ o,
+    const float* __restrict__ row, float w, int n){
+  for(int x=0;x<n;x++)
+    o[x]+=w*row[x];
+}
+
+// dot product with 8 partial sums, which is vectorized
+static inline float Dot(const float* __restrict__ a,
+    const float* __restrict__ b, int n){
+  float s[8]={0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+  int x=0;
+  for(;x+8<=n;x+=8)
+    for(int j=0;j<8;j++)
+      s[j]+=a[x+j]*b[x+j];
+  float sum=((s[0]+s[1])+(s[2]+s[3]))+((s[4]+s[5])+(s[6]+s[7]));
+  for(;x<n;x++)
+    sum+=a[x]*b[x];
+  return sum;
+}
+
+void DirectConvEngine::Convolve(const float* img, int channels, int height,
+    int width, const float* weight, int nfilters, int pad, float* out){
+  const int K=shape_.kernel, KK=K*K;
+  const int oh=height+2*pad-K+1, ow=width+2*pad-K+1;
+  memset(out, 0, sizeof(float)*nfilters*oh*ow);
+  for(int f0=0;f0<nfilters;f0+=kFilterBlock){
+    int nf=std::min(kFilterBlock, nfilters-f0);
+    // output rows of the filter block stay in cache over all channels
+    for(int y=0;y<oh;y++){
+      float* o[kFilterBlock];
+      for(int j=0;j<nf;j++)
+        o[j]=out+((f0+j)*oh+y)*ow;
+      for(int c=0;c<channels;c++){
+        for(int ky=0;ky<K;ky++){
+          int iy=y+ky-pad;
+          if(iy<0||iy>=height)
+            continue;
+          const float* in=img+(c*height+iy)*width;
+          for(int kx=0;kx<K;kx++){
+            // output columns whose input column x+kx-pad is inside the image
+            int begin=std::max(0, pad-kx), end=std::min(ow, width+pad-kx);
+            if(end<=begin)
+              continue;
+            const float* row=in+begin+kx-pad;
+            float w[kFilterBlock];
+            for(int j=0;j<nf;j++)
+              w[j]=weight[((f0+j)*channels+c)*KK+ky*K+kx];
+            if(nf==kFilterBlock){
+              AxpyRows(o[0]+begin, o[1]+begin, o[2]+begin, o[3]+begin, row, w,
+                  end-begin);
+            }else{
+              for(int j=0;j<nf;j++)
+                AxpyRow(o[j]+begin, row, w[j], end-begin);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+void DirectConvEngine::WeightGradient(const float* src, const float* grad,
+    float* gweight){
+  const ConvShape& s=shape_;
+  const int K=s.kernel, KK=K*K, oh=s.conv_height, ow=s.conv_width;
+  memset(gweight, 0, sizeof(float)*s.num_filters*s.channels*KK);
+  for(int n=0;n<s.batchsize;n++){
+    for(int f=0;f<s.num_filters;f++){
+      const float* g=grad+(n*s.num_filters+f)*oh*ow;
+      for(int c=0;c<s.channels;c++){
+        const float* img=src+(n*s.channels+c)*s.height*s.width;
+        float* gw=gweight+(f*s.channels+c)*KK;
+        for(int ky=0;ky<K;ky++){
+          for(int kx=0;kx<K;kx++){
+            int begin=std::max(0, s.pad-kx);
+            int end=std::min(ow, s.width+s.pad-kx);
+            if(end<=begin)
+              continue;
+            float sum=0.f;
+            for(int y=0;y<oh;y++){
+              int iy=y+ky-s.pad;
+              if(iy<0||iy>=s.height)
+                continue;
+              sum+=Dot(g+y*ow+begin, img+iy*s.width+begin+kx-s.pad,
+                  end-begin);
+            }
+            gw[ky*K+kx]+=sum;
+          }
+        }
+      }
+    }
+  }
+}
+
+const float* DirectConvEngine::FlipWeight(const float* weight){
+  const ConvShape& s=shape_;
+  const int K=s.kernel, KK=K*K;
+  float* dst=Workspace::Get()->Borrow(kFlipped, s.channels*s.num_filters*KK);
+  for(int f=0;f<s.num_filters;f++)
+    for(int c=0;c<s.channels;c++)
+      for(int k=0;k<KK;k++)
+        dst[(c*s.num_filters+f)*KK+KK-1-k]=weight[(f*s.channels+c)*KK+k];
+  return dst;
+}
+
+void DirectConvEngine::Forward(bool training, const float* src,
+    const float* weight, float* data, const ConvEpilogue& epilogue){
+  const ConvShape& s=shape_;
+  for(int n=0;n<s.batchsize;n++){
+    float* out=data+n*s.num_filters*s.conv_height*s.conv_width;
+    Convolve(src+n*s.channels*s.height*s.width, s.channels, s.height, s.width,
+        weight, s.num_filters, s.pad, out);
+    if(epilogue)
+      epilogue(n, 1, out);
+  }
+}
+
+void DirectConvEngine::Backward(const float* src, const float* weight,
+    const float* grad, float* gweight, float* gsrc){
+  const ConvShape& s=shape_;
+  WeightGradient(src, grad, gweight);
+  if(gsrc==nullptr)
+    return;
+  // full convolution of grad, whose output is of the image shape
+  const float* flipped=FlipWeight(weight);
+  for(int n=0;n<s.batchsize;n++)
+    Convolve(grad+n*s.num_filters*s.conv_height*s.conv_width, s.num_filters,
+        s.conv_height, s.conv_width, flipped, s.channels, s.kernel-1-s.pad,
+        gsrc+n*s.channels*s.height*s.width);
+}
+
+/*************************WinogradConvEngine********************************/
+const float* WinogradConvEngine::TransformWeight(const float* weight,
+    int nfilters, int channels){
+  float* U=Workspace::Get()->Borrow(kTransWeight, 16*nfilters*channels);
+  const int stride=nfilters*channels;
+  for(int f=0;f<nfilters;f++){
+    for(int c=0;c<channels;c++){
+      const float* g=weight+(f*channels+c)*9;
+      // Gg, G=[1 0 0; .5 .5 .5; .5 -.5 .5; 0 0 1]
+      float t[4][3];
+      for(int j=0;j<3;j++){
+        t[0][j]=g[j];
+        t[1][j]=0.5f*(g[j]+g[3+j]+g[6+j]);
+        t[2][j]=0.5f*(g[j]-g[3+j]+g[6+j]);
+        t[3][j]=g[6+j];
+      }
+      // (Gg)G^T
+      float* u=U+f*channels+c;
+      for(int i=0;i<4;i++){
+        u[(i*4+0)*stride]=t[i][0];
+        u[(i*4+1)*stride]=0.5f*(t[i][0]+t[i][1]+t[i][2]);
+        u[(i*4+2)*stride]=0.5f*(t[i][0]-t[i][1]+t[i][2]);
+        u[(i*4+3)*stride]=t[i][2];
+      }
+    }
+  }
+  return U;
+}
+
+void WinogradConvEngine::Convolve(const float* img, int channels, int height,
+    int width, const float* U, int nfilters, int pad, float* out){
+  const int oh=height+2*pad-2, ow=width+2*pad-2;
+  const int th=(oh+1)/2, tw=(ow+1)/2, ntiles=th*tw;
+  Workspace* ws=Workspace::Get();
+  float* V=ws->Borrow(kTiles, 16*channels*ntiles);
+  float* M=ws->Borrow(kTileOut, 16*nfilters*ntiles);
+  const int vstride=channels*ntiles, mstride=nfilters*ntiles;
+  // input transform B^T d B, B^T=[1 0 -1 0; 0 1 1 0; 0 -1 1 0; 0 1 0 -1]
+  for(int c=0;c<channels;c++){
+    const float* in=img+c*height*width;
+    for(int ty=0;ty<th;ty++){
+      for(int tx=0;tx<tw;tx++){
+        float d[4][4];
+        for(int i=0;i<4;i++){
+          int y=2*ty+i-pad;
+          for(int j=0;j<4;j++){
+            int x=2*tx+j-pad;
+            d[i][j]=(y>=0&&y<height&&x>=0&&x<width)?in[y*width+x]:0.f;
+          }
+        }
+        float t[4][4];
+        for(int j=0;j<4;j++){
+          t[0][j]=d[0][j]-d[2][j];
+          t[1][j]=d[1][j]+d[2][j];
+          t[2][j]=d[2][j]-d[1][j];
+          t[3][j]=d[1][j]-d[3][j];
+        }
+        float* v=V+c*ntiles+ty*tw+tx;
+        for(int i=0;i<4;i++){
+          v[(i*4+0)*vstride]=t[i][0]-t[i][2];
+          v[(i*4+1)*vstride]=t[i][1]+t[i][2];
+          v[(i*4+2)*vstride]=t[i][2]-t[i][1];
+          v[(i*4+3)*vstride]=t[i][1]-t[i][3];
+        }
+      }
+    }
+  }
+  // sum over channels of U.*V, one GEMM per element of the 4x4 tile
+  for(int xi=0;xi<16;xi++){
+    Tensor<cpu, 2> u(const_cast<float*>(U)+xi*nfilters*channels,
+        Shape2(nfilters, channels));
+    Tensor<cpu, 2> v(V+xi*vstride, Shape2(channels, ntiles));
+    Tensor<cpu, 2> m(M+xi*mstride, Shape2(nfilters, ntiles));
+    m=dot(u, v);
+  }
+  // output transform A^T m A, A^T=[1 1 1 0; 0 1 -1 -1]
+  for(int f=0;f<nfilters;f++){
+    float* o=out+f*oh*ow;
+    for(int ty=0;ty<th;ty++){
+      for(int tx=0;tx<tw;tx++){
+        const float* m=M+f*ntiles+ty*tw+tx;
+        float r[2][4];
+        for(int j=0;j<4;j++){
+          float m0=m[j*mstride], m1=m[(4+j)*mstride];
+          float m2=m[(8+j)*mstride], m3=m[(12+j)*mstride];
+          r[0][j]=m0+m1+m2;
+          r[1][j]=m1-m2-m3;
+        }
+        for(int i=0;i<2&&2*ty+i<oh;i++){
+          int y=2*ty+i;
+          o[y*ow+2*tx]=r[i][0]+r[i][1]+r[i][2];
+          if(2*tx+1<ow)
+            o[y*ow+2*tx+1]=r[i][1]-r[i][2]-r[i][3];
+        }
+      }
+    }
+  }
+}
+
+void WinogradConvEngine::Forward(bool training, const float* src,
+    const float* weight, float* data, const ConvEpilogue& epilogue){
+  const ConvShape& s=shape_;
+  const float* U=TransformWeight(weight, s.num_filters, s.channels);
+  for(int n=0;n<s.batchsize;n++){
+    float* out=data+n*s.num_filters*s.conv_height*s.conv_width;
+    Convolve(src+n*s.channels*s.height*s.width, s.channels, s.height, s.width,
+        U, s.num_filters, s.pad, out);
+    if(epilogue)
+      epilogue(n, 1, out);
+  }
+}
+
+void WinogradConvEngine::Backward(const float* src, const float* weight,
+    const float* grad, float* gweight, float* gsrc){
+  const ConvShape& s=shape_;
+  WeightGradient(src, grad, gweight);
+  if(gsrc==nullptr)
+    return;
+  // the flipped weights map num_filters channels to channels filters
+  const float* U=TransformWeight(FlipWeight(weight), s.channels,
+      s.num_filters);
+  for(int n=0;n<s.batchsize;n++)
+    Convolve(grad+n*s.num_filters*s.conv_height*s.conv_width, s.num_filters,
+        s.conv_height, s.conv_width, U, s.channels, 2-s.pad,
+        gsrc+n*s.channels*s.height*s.width);
+}
+
+/***************************************************************************/
+bool ConvEngineSupports(ConvolutionProto::Engine type, const ConvShape& shape){
+  switch(type){
+    case ConvolutionProto::kIm2col:
+      return true;
+    case ConvolutionProto::kDirect:
+      return shape.stride==1&&shape.pad<shape.kernel;
+    case ConvolutionProto::kWinograd:
+      return shape.stride==1&&shape.kernel==3&&shape.pad<3;
+    default:
+      return false;
+  }
+}
+
+ConvolutionProto::Engine ChooseConvEngine(const ConvShape& shape){
+  if(ConvEngineSupports(ConvolutionProto::kWinograd, shape)
+      &&shape.channels>=kMinWinogradChannels
+      &&shape.num_filters>=kMinWinogradChannels)
+    return ConvolutionProto::kWinograd;
+  if(ConvEngineSupports(ConvolutionProto::kDirect, shape)
+      &&shape.kernel<=5&&shape.channels<=kMaxDirectChannels)
+    return ConvolutionProto::kDirect;
+  return ConvolutionProto::kIm2col;
+}
+
+shared_ptr<ConvEngine> CreateConvEngine(ConvolutionProto::Engine type,
+    const ConvShape& shape, const ConvolutionProto& proto){
+  if(type==ConvolutionProto::kAutoEngine)
+    type=ChooseConvEngine(shape);
+  if(!ConvEngineSupports(type, shape)){
+    LOG(ERROR)<<"Convolution engine "<<ConvolutionProto::Engine_Name(type)
+      <<" does not support the setting, fall back to im2col";
+    type=ConvolutionProto::kIm2col;
+  }
+  shared_ptr<ConvEngine> engine;
+  if(type==ConvolutionProto::kDirect)
+    engine=std::make_shared<DirectConvEngine>();
+  else if(type==ConvolutionProto::kWinograd)
+    engine=std::make_shared<WinogradConvEngine>();
+  else
+    engine=std::make_shared<Im2colConvEngine>();
+  engine->Setup(shape, proto);
+  return engine;
+}
+}  // namespace singa
@@ -6,6 +6,7 @@
 #include "mshadow/tensor.h"
 #include "mshadow/cxxnet_op.h"
 #include "worker/layer.h"
+#include "worker/autotuner.h"
 #include "utils/singleton.h"
 #include "utils/factory.h"
 
@@ -13,6 +14,40 @@ using namespace mshadow;
 using namespace mshadow::expr;
 
 namespace singa {
+// num of floats per block run through all fused layers while in cache
+const int kFusedBlock=4096;
+
+/**
+ * Run the fused layers on data[offset, offset+count) of the layer they are
+ * fused into, block by block, each block through all the layers.
+ */
+static void FusedForward(const vector<SLayer>& fused, bool training,
+    int offset, int count, const float* data){
+  for(int k=0;k<count;k+=kFusedBlock){
+    int n=std::min(kFusedBlock, count-k);
+    const float* src=data+k;
+    for(auto& layer: fused){
+      layer->ComputeFeatureBlock(training, offset+k, n, src);
+      src=layer->data().cpu_data()+offset+k;
+    }
+  }
+}
+
+/**
+ * Compute grad[0, count) of the layer the fused layers are fused into from
+ * the grad of the last fused layer, block by block.
+ */
+static void FusedBackward(const vector<SLayer>& fused, int count,
+    float* grad){
+  for(int k=0;k<count;k+=kFusedBlock){
+    int n=std::min(kFusedBlock, count-k);
+    for(int i=fused.size()-1;i>=0;i--){
+      float* gsrc=i>0?fused[i-1]->mutable_grad()->mutable_cpu_data()+k
+        :grad+k;
+      fused[i]->ComputeGradientBlock(k, n, gsrc);
+    }
+  }
+}
 
 /************ Implementation for ConvProductLayer*************************/
 void ConvolutionLayer::Setup(const LayerProto& proto,
@@ -41,8 +76,9 @@ void ConvolutionLayer::Setup(const LayerProto& proto,
   vector<int> shape{batchsize_, num_filters_, conv_height_, conv_width_};
   data_.Reshape(shape);
   grad_.Reshape(shape);
-  col_data_.Reshape(vector<int>{col_height_, col_width_});
-  col_grad_.Reshape(vector<int>{col_height_, col_width_});
+  ConvShape convshape{batchsize_, channels_, height_, width_,
+    num_filters_, kernel_, pad_, stride_, conv_height_, conv_width_};
+  engine_=CreateConvEngine(conv_param.engine(), convshape, conv_param);
 
   Factory<Param>* factory=Singleton<Factory<Param>>::Instance();
   weight_=shared_ptr<Param>(factory->Create("Param"));
@@ -60,66 +96,52 @@ void ConvolutionLayer::SetupAfterPartition(const LayerProto& proto,
   Setup(newproto, srclayers);
 }
 
+void ConvolutionLayer::Autotune(Autotuner* tuner){
+  const ConvolutionProto& conv_param=layer_proto_.convolution_param();
+  // engines other than the default kAutoEngine are pinned by the user
+  if(conv_param.engine()!=ConvolutionProto::kAutoEngine)
+    return;
+  ConvShape shape=engine_->shape();
+  ConvolutionProto tuned=tuner->TuneConv(shape, conv_param);
+  engine_=CreateConvEngine(tuned.engine(), shape, tuned);
+}
+
+bool ConvolutionLayer::Fuse(SLayer layer){
+  if(!layer->is_elementwise())
+    return false;
+  fusedlayers_.push_back(layer);
+  return true;
+}
+
 void ConvolutionLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers){
-  Tensor<cpu, 4> src(srclayers[0]->mutable_data(this)->mutable_cpu_data(),
-      Shape4(batchsize_, channels_, height_, width_));
   Tensor<cpu, 3> data(data_.mutable_cpu_data(),
       Shape3(batchsize_, num_filters_, conv_height_* conv_width_));
-  Tensor<cpu, 2> col(col_data_.mutable_cpu_data(),
-      Shape2(col_height_, col_width_));
-  Tensor<cpu, 2> weight(weight_->mutable_cpu_data(),
-      Shape2(num_filters_, col_height_));
   Tensor<cpu, 1> bias(bias_->mutable_cpu_data(),
       Shape1(num_filters_));
-
-  for(int n=0;n<batchsize_;n++){
-    if(pad_>0)
-      col=unpack_patch2col(pad(src[n], pad_), kernel_, stride_);
-    else
-      col=unpack_patch2col(src[n], kernel_, stride_);
-    data[n]=dot(weight, col);
-  }
-  data+=broadcast<1>(bias, data.shape);
+  int imgsize=num_filters_*conv_height_*conv_width_;
+  engine_->Forward(training, srclayers[0]->mutable_data(this)->cpu_data(),
+      weight_->data().cpu_data(), data.dptr,
+      [&](int n, int nb, float* out){
+        Tensor<cpu, 3> block(out,
+            Shape3(nb, num_filters_, conv_height_* conv_width_));
+        block+=broadcast<1>(bias, block.shape);
+        FusedForward(fusedlayers_, training, n*imgsize, nb*imgsize, out);
+      });
 }
 
 void ConvolutionLayer::ComputeGradient(const vector<SLayer>& srclayers) {
-  Tensor<cpu, 4> src(srclayers[0]->mutable_data(this)->mutable_cpu_data(),
-      Shape4(batchsize_, channels_, height_, width_));
-  Tensor<cpu, 2> col(col_data_.mutable_cpu_data(),
-      Shape2(col_height_, col_width_));
-  Tensor<cpu, 2> weight(weight_->mutable_cpu_data(),
-      Shape2(num_filters_, col_height_));
-
   Blob<float>* gsrcblob=srclayers[0]->mutable_grad(this);
-  Tensor<cpu, 4> gsrc(Shape4(batchsize_, channels_, height_, width_));
-  if(gsrcblob!=nullptr)
-    gsrc.dptr=gsrcblob->mutable_cpu_data();
   Tensor<cpu, 3> grad(grad_.mutable_cpu_data(),
       Shape3(batchsize_, num_filters_, conv_height_* conv_width_));
-  Tensor<cpu, 2> gcol(col_grad_.mutable_cpu_data(),
-      Shape2(col_height_, col_width_));
-  Tensor<cpu, 2> gweight(weight_->mutable_cpu_grad(),
-      Shape2(num_filters_, col_height_));
   Tensor<cpu, 1> gbias(bias_->mutable_cpu_grad(),
       Shape1(num_filters_));
 
-  gweight=0.0f;
+  if(fusedlayers_.size())
+    FusedBackward(fusedlayers_, grad_.count(), grad.dptr);
   gbias=sumall_except_dim<1>(grad);
-  Shape<3> padshape(gsrc.shape.SubShape());
-  padshape[0]+=2*pad_;padshape[1]+=2*pad_;
-  Shape<2> imgshape=Shape2(height_, width_);
-  for(int n=0;n<batchsize_;n++){
-    if(pad_>0)
-      col=unpack_patch2col(pad(src[n], pad_), kernel_, stride_);
-    else
-      col=unpack_patch2col(src[n], kernel_, stride_);
-    gweight+=dot(grad[n], col.T());
-
-    if(gsrcblob!=nullptr){
-      gcol=dot(weight.T(), grad[n]);
-      gsrc[n]=crop(pack_col2patch(gcol, padshape, kernel_, stride_), imgshape);
-    }
-  }
+  engine_->Backward(srclayers[0]->mutable_data(this)->cpu_data(),
+      weight_->data().cpu_data(), grad.dptr, weight_->mutable_cpu_grad(),
+      gsrcblob==nullptr?nullptr:gsrcblob->mutable_cpu_data());
 }
 
 /****************** Implementation for DropoutLayer ***********************/
@@ -140,22 +162,33 @@ void DropoutLayer::SetupAfterPartition(const LayerProto& proto,
 }
 
 void DropoutLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers) {
+  Blob<float>* srcblob=srclayers[0]->mutable_data();
+  CHECK_EQ(srcblob->count(), data_.count());
+  ComputeFeatureBlock(training, 0, data_.count(), srcblob->mutable_cpu_data());
+}
+
+void DropoutLayer::ComputeFeatureBlock(bool training, int offset, int count,
+    const float* srcptr){
   // check training
   float pkeep=1-pdrop_;
-  Tensor<cpu, 1> mask(mask_.mutable_cpu_data(), Shape1(mask_.count()));
+  Tensor<cpu, 1> mask(mask_.mutable_cpu_data()+offset, Shape1(count));
   mask = F<op::threshold>(ASingleton<Random<cpu>>::Instance()\
       ->uniform(mask.shape), pkeep ) * (1.0f/pkeep);
-  Tensor<cpu, 1> data(data_.mutable_cpu_data(), Shape1(data_.count()));
-  Blob<float>* srcblob=srclayers[0]->mutable_data();
-  Tensor<cpu, 1> src(srcblob->mutable_cpu_data(), Shape1(srcblob->count()));
+  Tensor<cpu, 1> data(data_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> src(const_cast<float*>(srcptr), Shape1(count));
   data=src*mask;
 }
 
 void DropoutLayer::ComputeGradient(const vector<SLayer>& srclayers)  {
-  Tensor<cpu, 1> grad(grad_.mutable_cpu_data(), Shape1(data_.count()));
-  Tensor<cpu, 1> mask(mask_.mutable_cpu_data(), Shape1(mask_.count()));
   Blob<float>* gsrcblob=srclayers[0]->mutable_grad();
-  Tensor<cpu, 1> gsrc(gsrcblob->mutable_cpu_data(), Shape1(gsrcblob->count()));
+  CHECK_EQ(gsrcblob->count(), grad_.count());
+  ComputeGradientBlock(0, grad_.count(), gsrcblob->mutable_cpu_data());
+}
+
+void DropoutLayer::ComputeGradientBlock(int offset, int count, float* gsrcptr){
+  Tensor<cpu, 1> grad(grad_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> mask(mask_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> gsrc(gsrcptr, Shape1(count));
   gsrc=grad*mask;
 }
 /**************** Implementation for InnerProductLayer********************/
@@ -183,6 +216,17 @@ void InnerProductLayer::SetupAfterPartition(const LayerProto& proto,
   Setup(newproto, srclayers);
 }
 
+void InnerProductLayer::Autotune(Autotuner* tuner){
+  tuner->AddGemm(batchsize_, vdim_, hdim_);
+}
+
+bool InnerProductLayer::Fuse(SLayer layer){
+  if(!layer->is_elementwise())
+    return false;
+  fusedlayers_.push_back(layer);
+  return true;
+}
+
 void InnerProductLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers) {
   Tensor<cpu, 2> data(data_.mutable_cpu_data(), Shape2(batchsize_,hdim_));
   CHECK_EQ(srclayers[0]->data().count(), batchsize_*vdim_);
@@ -191,8 +235,15 @@ void InnerProductLayer::ComputeFeature(bool training, const vector<SLayer>& srcl
   Tensor<cpu, 2> weight(weight_->mutable_cpu_data(), Shape2(vdim_,hdim_));
   Tensor<cpu, 1> bias(bias_->mutable_cpu_data(), Shape1(hdim_));
   data=dot(src, weight);
-  // repmat: repeat bias vector into batchsize rows
-  data+=repmat(bias, batchsize_);
+  // add the bias and run the fused layers on blocks of rows while in cache
+  int nrows=std::max(1, kFusedBlock/hdim_);
+  for(int r=0;r<batchsize_;r+=nrows){
+    int nr=std::min(nrows, batchsize_-r);
+    Tensor<cpu, 2> block=data.Slice(r, r+nr);
+    // repmat: repeat bias vector into nr rows
+    block+=repmat(bias, nr);
+    FusedForward(fusedlayers_, training, r*hdim_, nr*hdim_, block.dptr);
+  }
 }
 
 void InnerProductLayer::ComputeGradient(const vector<SLayer>& srclayers) {
@@ -203,6 +254,8 @@ void InnerProductLayer::ComputeGradient(const vector<SLayer>& srclayers) {
   Tensor<cpu, 2> gweight(weight_->mutable_cpu_grad(), Shape2(vdim_,hdim_));
   Tensor<cpu, 1> gbias(bias_->mutable_cpu_grad(), Shape1(hdim_));
 
+  if(fusedlayers_.size())
+    FusedBackward(fusedlayers_, batchsize_*hdim_, grad.dptr);
   gbias=sum_rows(grad);
   gweight=dot(src.T(), grad);
   if(srclayers[0]->mutable_grad(this)!=nullptr){
@@ -554,17 +607,26 @@ void ReLULayer::SetupAfterPartition(const LayerProto& proto,
 }
 
 void ReLULayer::ComputeFeature(bool training, const vector<SLayer>& srclayers){
-  Tensor<cpu, 1> data(data_.mutable_cpu_data(), Shape1(data_.count()));
-  Tensor<cpu, 1> src(srclayers[0]->mutable_data(this)->mutable_cpu_data(),
-      Shape1(data_.count()));
+  ComputeFeatureBlock(training, 0, data_.count(),
+      srclayers[0]->mutable_data(this)->mutable_cpu_data());
+}
+
+void ReLULayer::ComputeFeatureBlock(bool training, int offset, int count,
+    const float* srcptr){
+  Tensor<cpu, 1> data(data_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> src(const_cast<float*>(srcptr), Shape1(count));
   data=F<op::relu>(src);
 }
 
 void ReLULayer::ComputeGradient(const vector<SLayer>& srclayers) {
-  Tensor<cpu, 1> grad(grad_.mutable_cpu_data(), Shape1(grad_.count()));
-  Tensor<cpu, 1> data(data_.mutable_cpu_data(), Shape1(data_.count()));
-  Tensor<cpu, 1> gsrc(srclayers[0]->mutable_grad(this)->mutable_cpu_data(),
-      Shape1(data_.count()));
+  ComputeGradientBlock(0, data_.count(),
+      srclayers[0]->mutable_grad(this)->mutable_cpu_data());
+}
+
+void ReLULayer::ComputeGradientBlock(int offset, int count, float* gsrcptr){
+  Tensor<cpu, 1> grad(grad_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> data(data_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> gsrc(gsrcptr, Shape1(count));
   gsrc=F<op::relu_grad>(data)*grad;
 }
 
@@ -686,17 +748,26 @@ void TanhLayer::SetupAfterPartition(const LayerProto& proto,
 
 
 void TanhLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers){
-  Tensor<cpu, 1> data(data_.mutable_cpu_data(), Shape1(data_.count()));
-  Tensor<cpu, 1> src(srclayers[0]->mutable_data(this)->mutable_cpu_data(),
-      Shape1(data_.count()));
+  ComputeFeatureBlock(training, 0, data_.count(),
+      srclayers[0]->mutable_data(this)->mutable_cpu_data());
+}
+
+void TanhLayer::ComputeFeatureBlock(bool training, int offset, int count,
+    const float* srcptr){
+  Tensor<cpu, 1> data(data_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> src(const_cast<float*>(srcptr), Shape1(count));
   data=F<op::stanh>(src);
 }
 
 void TanhLayer::ComputeGradient(const vector<SLayer>& srclayers) {
-  Tensor<cpu, 1> data(data_.mutable_cpu_data(), Shape1(data_.count()));
-  Tensor<cpu, 1> grad(grad_.mutable_cpu_data(), Shape1(grad_.count()));
-  Tensor<cpu, 1> gsrc(srclayers[0]->mutable_grad(this)->mutable_cpu_data(),
-      Shape1(data_.count()));
+  ComputeGradientBlock(0, data_.count(),
+      srclayers[0]->mutable_grad(this)->mutable_cpu_data());
+}
+
+void TanhLayer::ComputeGradientBlock(int offset, int count, float* gsrcptr){
+  Tensor<cpu, 1> data(data_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> grad(grad_.mutable_cpu_data()+offset, Shape1(count));
+  Tensor<cpu, 1> gsrc(gsrcptr, Shape1(count));
   gsrc=F<op::stanh_grad>(data)*grad;
 }
 /********** * Implementation for SoftmaxLossLayer*************************/
@@ -1,10 +1,14 @@
 #include <algorithm>
+#include <mutex>
 #include <queue>
+#include <thread>
 
 #include "worker/neuralnet.h"
 #include "utils/singleton.h"
 #include "utils/factory.h"
 #include "utils/graph.h"
+#include "utils/cluster.h"
+#include "worker/autotuner.h"
 
 
 namespace singa {
@@ -40,6 +44,9 @@ void NeuralNet::RegistryParam(string param_type){
   else if(param_type=="Elastic")
     factory->Register("Param",
         CreateInstance(ElasticParam, Param));
+  else if(param_type=="TopKSync")
+    factory->Register("Param",
+        CreateInstance(TopKSyncParam, Param));
   else LOG(ERROR)<<"Unkown parameter type "<<param_type;
 }
 NeuralNet::NeuralNet(NetProto net_proto, int group_size) {
@@ -66,9 +73,72 @@ NeuralNet::NeuralNet(NetProto net_proto, int group_size) {
     }
   }
 
+  if(net_proto.fuse_layers())
+    FuseLayers();
+  if(net_proto.inplace())
+    SetupInplaceLayers();
+  if(net_proto.autotune())
+    Autotune(net_proto.autotune_cache());
   LOG(INFO)<<"Neural Net constructed";
 }
 
+void NeuralNet::Autotune(const string& cache){
+  auto cluster=Cluster::Get();
+  string path=cache;
+  if(path.size()&&path[0]!='/')
+    path=cluster->workerspace()+"/"+path;
+  Autotuner tuner(path);
+  for(auto& layer: layers_)
+    layer->Autotune(&tuner);
+  // the BLAS thread count is process wide, hence it is tuned once, on the
+  // GEMMs of the train net, which the Worker constructs first; BLAS threads
+  // of the layers run by all executor threads share the cores
+  static std::once_flag blas_tuned;
+  std::call_once(blas_tuned, [&](){
+      int nthreads=std::thread::hardware_concurrency()
+        /cluster->nthreads_per_procs();
+      tuner.TuneBlasThreads(std::max(1, nthreads));
+      });
+  tuner.Save();
+}
+
+void NeuralNet::FuseLayers(){
+  for(auto& layer: layers_){
+    if(layer->fused())
+      continue;
+    shared_ptr<Layer> last=layer;
+    while(last->dstlayers_size()==1){
+      shared_ptr<Layer> next=last->dstlayers()[0];
+      if(!next->is_elementwise()||next->srclayers_size()!=1
+          ||next->locationid()!=layer->locationid()
+          ||next->data().count()!=layer->data().count()
+          ||!layer->Fuse(next))
+        break;
+      next->set_fused(true);
+      LOG(INFO)<<"Fuse layer "<<next->name()<<" into "<<layer->name();
+      last=next;
+    }
+  }
+}
+
+void NeuralNet::SetupInplaceLayers(){
+  for(auto& layer: layers_){
+    if(!layer->is_elementwise()||layer->srclayers_size()!=1)
+      continue;
+    shared_ptr<Layer> src=layer->srclayers()[0];
+    if(src->dstlayers_size()!=1||src->needs_data_in_backward()
+        ||src->locationid()!=layer->locationid()
+        ||src->data(layer.get()).count()!=layer->data().count())
+      continue;
+    Blob<float>* srcgrad=src->mutable_grad(layer.get());
+    if(srcgrad==nullptr)
+      continue;
+    layer->mutable_data()->ShareData(*src->mutable_data(layer.get()));
+    layer->mutable_grad()->ShareData(*srcgrad);
+    LOG(INFO)<<"Run layer "<<layer->name()<<" in place of "<<src->name();
+  }
+}
+
 void NeuralNet::ConstructNeuralNet(const NetProto& net_proto){
   // construct graph, one node for one layer, identified by layer name
   map<string, LayerProto> protos;
@@ -1,3 +1,4 @@
+#include "mshadow/tensor.h"
 #include "utils/cluster.h"
 #include "worker/param_manager.h"
 #include "utils/singleton.h"
@@ -5,52 +6,47 @@
 
 
 namespace singa{
+// executor threads send msgs to the comm thread through this endpoint
+#define kOutboxEndpoint "inproc://singa-param-manager"
+// shared Params smaller than this (floats) are reduced in one task
+const int kMinReduceSlice=16384;
+// Tune reduces the sync cost if executors are blocked by sync replies for
+// more than kMaxBlocked of the step time, and increases the sync quality if
+// blocked for less than kMinBlocked.
+const float kMaxBlocked=0.05f, kMinBlocked=0.01f;
+const float kMinSampleRatio=0.01f;
+const int kMaxSyncFrequency=64;
 
 ParamManager::ParamManager(shared_ptr<NeuralNet> net,
     const UpdaterProto& updater):net_(net){
   shared_ptr<Cluster> cluster=Cluster::Get();
   hogwild_=cluster->nthreads_per_procs()==1||updater.hogwild()?true:false;
   sync_frequency_=updater.sync_frequency();
+  sample_ratio_=1.0f;
+  tune_frequency_=updater.tune_frequency();
+  tune_steps_=0;
+  tune_time_=0;
   warmup_steps_=updater.warmup_steps();
   moving_rate_=updater.moving_rate()/cluster->ngroups();
-  switch(updater.type()){
-    case UpdaterProto_Type_kAdaGrad:
-    updater_=make_shared<AdaGradUpdater>();
-    break;
-    case UpdaterProto_Type_kAdaDelta:
-    updater_=make_shared<AdaDeltaUpdater>();
-    break;
-    case UpdaterProto_Type_kNesterov:
-    updater_=make_shared<NesterovUpdater>();
-    break;
-    case UpdaterProto_Type_kSGD:
-    updater_=make_shared<SGDUpdater>();
-    break;
-    case UpdaterProto_Type_kRMSProp:
-    updater_=make_shared<RMSPropUpdater>();
-    break;
-    default:
-    LOG(FATAL)<<"Unknow updater "<<updater.type();
-  }
-  updater_->Init(updater);
+  update_on_server_=updater.update_on_server()&&cluster->nservers()>0;
+  updater_=CreateUpdater(updater);
+  pending_gets_=0;
 
   int count=0;
+  map<int, int> offsets;
   for(shared_ptr<Layer> layer: net->layers()){
     if(cluster->group_procsid(layer->locationid())==cluster->group_procsid()){
       for(shared_ptr<Param> p: layer->GetParams()){
         int ownerid=p->owner()->id();
-        if(paramid2Offset_.find(ownerid)==paramid2Offset_.end()){
-          paramid2Offset_[p->id()]=count;
-          paramid2Offset_[ownerid]=count;
+        if(offsets.find(ownerid)==offsets.end()){
+          offsets[ownerid]=count;
           count+=p->data().count();
-        }else{
-          paramid2Offset_[p->id()]=paramid2Offset_[ownerid];
+          ownerids_.push_back(ownerid);
         }
-        ownerid2Params_[ownerid].push_back(p);
-        if(ownerid2Params_[ownerid].size()>1)
-          aggregatedUpdates_[ownerid]=0;
-        paramid2version_[p->id()]=0;
-        paramid2Param_[p->id()]=p;
+        AddSlot(ownerid)->shares.push_back(p);
+        ParamSlot* s=AddSlot(p->id());
+        s->param=p;
+        s->ownerid=ownerid;
       }
     }
   }
@@ -60,27 +56,362 @@ ParamManager::ParamManager(shared_ptr<NeuralNet> net,
   param_=shared_ptr<Param>(factory->Create("Param"));
   param_->Setup(pp, vector<int> {count}, 0);
   float* dptr=param_->mutable_cpu_data();
-  for(auto& entry: ownerid2Params_){
-    entry.second.at(0)->data().data()->set_cpu_data(
-        dptr+paramid2Offset_[entry.first]);
+  for(int ownerid: ownerids_){
+    slot(ownerid)->shares.at(0)->data().data()->set_cpu_data(
+        dptr+offsets[ownerid]);
   }
 
   if(cluster->nservers()>0){ // sync with parameter server
+    SliceParams();
+    for(auto& s: slots_)
+      if(s!=nullptr&&s->param!=nullptr)
+        s->param->set_wire_format(updater.wire_format());
+    batches_.resize(cluster->nservers(), nullptr);
+    batchsize_.resize(cluster->nservers(), 0);
+    batchstart_.resize(cluster->nservers(), 0);
+    for(int i=0;i<cluster->nservers();i++){
+      auto group=std::make_shared<SyncGroup>();
+      group->sample_ratio=sample_ratio_;
+      group->sync_frequency=sync_frequency_;
+      group->nbytes=group->nreplies=group->rtt=group->blocked=0;
+      sync_groups_.push_back(group);
+    }
     router_=make_shared<Router>(cluster->router_port());
     for(int i=0;i<cluster->nservers();i++)
       CHECK(router_->Connect(cluster->server_addr(i)));
+    outbox_=zsock_new_pull("@" kOutboxEndpoint);
+    CHECK_NOTNULL(outbox_);
+    comm_thread_=std::thread(&ParamManager::Run, this);
   }
+  running_=true;
+  nslicetasks_=0;
+  for(int i=0;i<cluster->nupdaters_per_procs();i++)
+    updaters_.push_back(std::thread(&ParamManager::RunUpdater, this));
+}
+
+ParamSlot* ParamManager::AddSlot(int id){
+  if(id>=static_cast<int>(slots_.size()))
+    slots_.resize(id+1);
+  if(slots_[id]==nullptr){
+    slots_[id].reset(new ParamSlot());
+    ParamSlot* s=slots_[id].get();
+    s->ownerid=id;
+    int nservers=Cluster::Get()->nservers();
+    s->server=nservers>0?id%nservers:-1;
+    s->offset=0;
+    s->version=0;
+    s->arrivals=s->pending=0;
+    s->synctime=0;
+    s->syncversion=0;
+    s->syncposted=0;
+  }
+  return slots_[id].get();
 }
 
 ParamManager::~ParamManager(){
-  for(int i=0;i<Cluster::Get()->nservers();i++){
+  {
+    std::unique_lock<std::mutex> lck(task_mtx_);
+    running_=false;
+    task_cv_.notify_all();
+  }
+  // queued updates are finished before stopping the updaters
+  for(auto& th: updaters_)
+    th.join();
+  int nservers=Cluster::Get()->nservers();
+  if(nservers==0)
+    return;
+  for(int i=0;i<nservers;i++){
     zmsg_t* msg=zmsg_new();
-    zmsg_addstrf(msg, "%d", kStop);
-    router_->Send(msg, i);
+    PushHeader(msg, MsgHeader{kStop, -1, 0, 0, 0, 0, 0.f});
+    Post(CommCmd{CommCmd::kSend, i, -1, 0, 0.f}, msg);
   }
+  Post(CommCmd{CommCmd::kFlush, -1, -1, 0, 0.f});
   zclock_sleep(2000);
+  Post(CommCmd{CommCmd::kStop, -1, -1, 0, 0.f});
+  comm_thread_.join();
+  for(auto& entry: pushers_)
+    zsock_destroy(&entry.second);
+  zsock_destroy(&outbox_);
+}
+
+zsock_t* ParamManager::outbox(){
+  std::unique_lock<std::mutex> lck(pusher_mtx_);
+  zsock_t*& pusher=pushers_[std::this_thread::get_id()];
+  if(pusher==nullptr){
+    pusher=zsock_new_push(">" kOutboxEndpoint);
+    CHECK_NOTNULL(pusher);
+  }
+  return pusher;
+}
+
+void ParamManager::Post(const CommCmd& cmd, zmsg_t* msg){
+  if(msg==nullptr)
+    msg=zmsg_new();
+  zmsg_pushmem(msg, &cmd, sizeof(CommCmd));
+  SendMsg(outbox(), &msg);
+}
+
+bool ParamManager::HandleCommand(zmsg_t* msg){
+  zframe_t* frame=zmsg_pop(msg);
+  CHECK_EQ(zframe_size(frame), sizeof(CommCmd));
+  CommCmd cmd=*reinterpret_cast<CommCmd*>(zframe_data(frame));
+  zframe_destroy(&frame);
+  bool ret=true;
+  switch(cmd.type){
+    case CommCmd::kSend:
+      SendToServer(msg, cmd.serverid);
+      msg=nullptr;
+      break;
+    case CommCmd::kSync:
+      {
+        shared_ptr<Param> param=slot(cmd.paramid)->param;
+        SyncGroup* group=sync_group(param->owner()->id());
+        // slices of one Param are synced with different servers in parallel
+        for(shared_ptr<Param> p: SyncParams(param)){
+          zmsg_t *syncmsg=nullptr;
+          if(moving_rate_)
+            syncmsg=p->GenSyncMsgFromWorker(moving_rate_);
+          else
+            syncmsg=p->GenSyncMsgFromWorker(group->sample_ratio);
+          if(syncmsg==nullptr){
+            // nothing to sync in this round, as if the reply were applied
+            UpdateVersion(p->id(), cmd.step+1);
+            continue;
+          }
+          // version after applying the reply
+          PeekHeader(syncmsg)->version=cmd.step+1;
+          group->nbytes+=MsgSize(syncmsg);
+          slot(p->id())->synctime=zclock_usecs();
+          SendToServer(syncmsg, server(p->id()));
+        }
+      }
+      break;
+    case CommCmd::kPush:
+      {
+        shared_ptr<Param> param=slot(cmd.paramid)->param;
+        // slices alias the first share, hence the gradients of other
+        // (hogwild) shares are sent from their own memory
+        for(shared_ptr<Param> p: SyncParams(param)){
+          float* grad=param->mutable_cpu_grad()+slot(p->id())->offset;
+          zmsg_t *updatemsg=p->GenUpdateMsgFromWorker(cmd.step, cmd.scale,
+              grad);
+          SendToServer(updatemsg, server(p->id()));
+        }
+      }
+      break;
+    case CommCmd::kFlush:
+      FlushBatches(true);
+      break;
+    case CommCmd::kStop:
+      ret=false;
+      break;
+    default:
+      LOG(ERROR)<<"Unknown command "<<cmd.type;
+  }
+  if(msg!=nullptr)
+    zmsg_destroy(&msg);
+  return ret;
+}
+
+void ParamManager::Run(){
+  zsock_t* router=router_->router();
+  zpoller_t* poller=zpoller_new(router, outbox_, NULL);
+  int timeout=-1;
+  while(true){
+    void* which=zpoller_wait(poller, timeout);
+    if(which==outbox_){
+      zmsg_t* msg=zmsg_recv(outbox_);
+      if(!HandleCommand(msg))
+        break;
+    }else if(which==router){
+      zmsg_t* msg=router_->Recv();
+      if(PeekHeader(msg)->type==kBatch){
+        for(zmsg_t* part: UnpackBatch(&msg))
+          HandleReply(part);
+      }else{
+        HandleReply(msg);
+      }
+    }else if(zpoller_terminated(poller)){
+      LOG(ERROR)<<"ParamManager comm thread is interrupted";
+      break;
+    }
+    // send batches whose flush window is over
+    timeout=FlushBatches(false);
+  }
+  zpoller_destroy(&poller);
+}
+
+void ParamManager::HandleReply(zmsg_t* msg){
+  // the version of a reply is the version after applying it
+  const MsgHeader* header=PeekHeader(msg);
+  int type=header->type, id=header->paramid, version=header->version;
+  ParamSlot* s=slot(id);
+  CHECK(s!=nullptr&&s->param!=nullptr)<<"Unknown Param "<<id;
+  shared_ptr<Param> p=s->param;
+  // memory of the replied Param is not referenced by frames in flight,
+  // hence no WaitUnpinned here, which could block forwarding other msgs
+  if(type==kGet){
+    MsgHeader header=PopHeader(msg);
+    CHECK_EQ(header.slice, p->slice());
+    CHECK_EQ(header.count, p->size());
+    zframe_t* dat=zmsg_pop(msg);
+    CHECK_EQ(zframe_size(dat), p->data().count()*sizeof(float));
+    memcpy(p->mutable_cpu_data(), zframe_data(dat), zframe_size(dat));
+    zframe_destroy(&dat);
+    zmsg_destroy(&msg);
+    // versions are already set by the local updates
+    std::unique_lock<std::mutex> lck(get_mtx_);
+    if(--pending_gets_==0)
+      get_cv_.notify_all();
+    return;
+  }else if(type==kSync){
+    p->ParseSyncMsgFromPS(&msg);
+    SyncGroup* group=sync_group(s->ownerid);
+    group->nreplies++;
+    group->rtt+=zclock_usecs()-s->synctime;
+  }else if(type==kUpdate){
+    p->ParseUpdateMsgFromPS(&msg);
+  }else{
+    LOG(ERROR)<<"Unknown reply type "<<type;
+  }
+  zmsg_destroy(&msg);
+  UpdateVersion(id, version);
+}
+
+
+void ParamManager::SendToServer(zmsg_t* msg, int serverid){
+  auto cluster=Cluster::Get();
+  if(batches_[serverid]==nullptr){
+    batches_[serverid]=zmsg_new();
+    PushHeader(batches_[serverid], MsgHeader{kBatch, -1, 0, 0, 0, 0, 0.f});
+    batchsize_[serverid]=0;
+    batchstart_[serverid]=zclock_mono();
+  }
+  batchsize_[serverid]+=MsgSize(msg);
+  AddToBatch(batches_[serverid], &msg);
+  if(batchsize_[serverid]>=static_cast<size_t>(cluster->largest_message())){
+    router_->Send(batches_[serverid], serverid);
+    batches_[serverid]=nullptr;
+  }
+}
+
+int ParamManager::FlushBatches(bool all){
+  int window=Cluster::Get()->flush_window(), timeout=-1;
+  int64_t now=zclock_mono();
+  for(size_t i=0;i<batches_.size();i++){
+    if(batches_[i]==nullptr)
+      continue;
+    int64_t left=batchstart_[i]+window-now;
+    if(all||left<=0){
+      router_->Send(batches_[i], i);
+      batches_[i]=nullptr;
+    }else if(timeout<0||left<timeout){
+      timeout=left;
+    }
+  }
+  return timeout;
+}
+
+void ParamManager::SliceParams(){
+  int nservers=Cluster::Get()->nservers();
+  Factory<Param>* factory=Singleton<Factory<Param>>::Instance();
+  // slice ids are assigned over all Params of the net, hence they are
+  // consistent among all worker procs.
+  int sliceid=net_->params().size();
+  for(shared_ptr<Param> p: net_->params()){
+    if(p->owner()!=p.get()||p->split_threshold()<=0)
+      continue;
+    int nslices=std::min(nservers,
+        (p->size()+p->split_threshold()-1)/p->split_threshold());
+    if(nslices<=1)
+      continue;
+    // slice boundaries are aligned to the partition dimension
+    const vector<int>& shape=p->data().shape();
+    int64_t unit=1;
+    if(p->partition_dim()>=0)
+      for(size_t k=p->partition_dim()+1;k<shape.size();k++)
+        unit*=shape[k];
+    int64_t nunits=p->size()/unit;
+    ParamSlot* owner=slot(p->id());
+    bool local=owner!=nullptr&&!owner->shares.empty();
+    for(int k=0;k<nslices;k++){
+      int id=sliceid++;
+      if(!local)
+        continue;
+      int64_t start=nunits*k/nslices*unit, end=nunits*(k+1)/nslices*unit;
+      if(k==nslices-1)
+        end=p->size();
+      // the owner Param may not be local, and gradients of shares are
+      // reduced into the first share
+      shared_ptr<Param> slice(factory->Create("Param"));
+      slice->SetupSlice(owner->shares.at(0).get(), start, end-start);
+      slice->set_id(id);
+      slice->set_slice(k);
+      owner->slices.push_back(slice);
+      ParamSlot* s=AddSlot(id);
+      s->param=slice;
+      s->ownerid=p->id();
+      s->offset=start;
+      // spread slices of one Param onto different servers
+      s->server=(p->id()+k)%nservers;
+    }
+    LOG(INFO)<<"Split Param "<<p->name()<<" of "<<p->size()
+      <<" floats into "<<nslices<<" slices";
+  }
+}
+
+int ParamManager::server(int paramid){
+  ParamSlot* s=slot(paramid);
+  if(s!=nullptr)
+    return s->server;
+  return paramid%Cluster::Get()->nservers();
+}
+
+const vector<shared_ptr<Param>> ParamManager::SyncParams(
+    shared_ptr<Param> param){
+  const vector<shared_ptr<Param>>& slices=slot(param->owner()->id())->slices;
+  if(!slices.empty())
+    return slices;
+  return vector<shared_ptr<Param>>{param};
+}
+
+void ParamManager::SetVersion(int id, int version){
+  ParamSlot* s=slot(id);
+  // hogwild shares and replies may finish out of order
+  int old=s->version;
+  while(old<version&&!s->version.compare_exchange_weak(old, version));
+  // lock to avoid missing the notification by a thread about to sleep
+  std::unique_lock<std::mutex> lck(s->mtx);
+  s->cv.notify_all();
 }
 
+void ParamManager::WaitVersion(ParamSlot* s, int step){
+  if(s->version>=step)
+    return;
+  std::unique_lock<std::mutex> lck(s->mtx);
+  s->cv.wait(lck, [&]{return s->version>=step||nslicetasks_>0;});
+}
+
+void ParamManager::UpdateVersion(int id, int step){
+  ParamSlot* s=slot(id);
+  bool shares=!hogwild_;
+  ParamSlot* owner=slot(s->ownerid);
+  // replies of sliced Params are always for slices
+  if(s->ownerid!=id&&!owner->slices.empty()){
+    // wait until all slices of the owner Param are received
+    SetVersion(id, step);
+    for(shared_ptr<Param> slice: owner->slices)
+      if(slot(slice->id())->version<step)
+        return;
+    id=s->ownerid;
+    shares=true;
+  }
+  SetVersion(id, step);
+  if(shares){
+    for(shared_ptr<Param> p: slot(slot(id)->ownerid)->shares)
+      SetVersion(p->id(), step);
+  }
+}
 
 void ParamManager::SyncConfig(float compute_time){
   float modelsize=param_->size()*1.0f*sizeof(float)/1024/1024; //MB
@@ -89,144 +420,325 @@ void ParamManager::SyncConfig(float compute_time){
   sample_ratio_=cluster->bandwidth()*cluster->nservers()/cputhroughput;
   if(sample_ratio_>1.0f)
     sample_ratio_=1.0f;
+  for(auto& group: sync_groups_)
+    group->sample_ratio=sample_ratio_;
   LOG(ERROR)<<"Sample Ratio "<<sample_ratio_;
 }
 
+void ParamManager::Tune(int step, int64_t step_time){
+  if(tune_frequency_<=0||sync_groups_.empty()||update_on_server_
+      ||step<=warmup_steps_)
+    return;
+  tune_time_+=step_time;
+  if(++tune_steps_<tune_frequency_)
+    return;
+  float steptime=tune_time_*1.0f/tune_steps_;
+  int nthreads=Cluster::Get()->nthreads_per_procs();
+  for(size_t i=0;i<sync_groups_.size();i++){
+    SyncGroup* group=sync_groups_[i].get();
+    // blocked time (ms) per step of one executor
+    float blocked=group->blocked/1000.f/nthreads/tune_steps_;
+    float ratio=group->sample_ratio;
+    int freq=group->sync_frequency;
+    if(blocked>kMaxBlocked*steptime){
+      // sync less data, or less often if the sample ratio is already small
+      if(ratio>kMinSampleRatio&&!moving_rate_)
+        ratio=std::max(kMinSampleRatio, ratio*0.7f);
+      else
+        freq=std::min(std::max(sync_frequency_, kMaxSyncFrequency), freq*2);
+    }else if(blocked<kMinBlocked*steptime){
+      if(freq>sync_frequency_)
+        freq=std::max(sync_frequency_, freq/2);
+      else if(!moving_rate_)
+        ratio=std::min(1.0f, ratio*1.2f);
+    }
+    if(ratio!=group->sample_ratio||freq!=group->sync_frequency){
+      float rtt=group->nreplies?group->rtt/1000.f/group->nreplies:0.f;
+      float throughput=group->rtt?group->nbytes*1e6f/1024/1024/group->rtt:0.f;
+      LOG(ERROR)<<StringPrintf("Step %d sync group %zu: step time %.1f ms, "
+          "blocked %.2f ms/step, rtt %.2f ms, throughput %.2f MB/s, "
+          "sample ratio %.3f -> %.3f, sync frequency %d -> %d", step, i,
+          steptime, blocked, rtt, throughput, group->sample_ratio.load(), ratio,
+          group->sync_frequency.load(), freq);
+      group->sample_ratio=ratio;
+      group->sync_frequency=freq;
+    }
+    group->nbytes=group->nreplies=group->rtt=group->blocked=0;
+  }
+  tune_steps_=0;
+  tune_time_=0;
+}
+
 void ParamManager::InitParams(){
-  for(auto& entry: ownerid2Params_){
-    entry.second.at(0)->Init();
-  }
-}
-void ParamManager:: SendParamsToServers(){
-  for(auto &entry: ownerid2Params_){
-    for(shared_ptr<Param> p:entry.second){
-      int id=p->id();
-      zmsg_t* msg=zmsg_new();
-      zmsg_addstrf(msg, "%d", kPut);
-      zmsg_addstrf(msg,"%d",id);
-      zmsg_addstrf(msg,"%s",p->name().c_str());
-      zmsg_addmem(msg, p->mutable_cpu_data(), sizeof(float)*p->data().count());
-      router_->Send(msg, id%Cluster::Get()->nservers());
-      if(!hogwild_)
+  for(int ownerid: ownerids_){
+    slot(ownerid)->shares.at(0)->Init();
+  }
+}
+void ParamManager::WaitUpdates(int step){
+  // help the updater threads with the queued updates
+  for(int ownerid: ownerids_)
+    for(shared_ptr<Param> param: slot(ownerid)->shares){
+      ParamSlot* s=slot(param->id());
+      while(s->version<step)
+        if(!RunUpdateTask(false))
+          WaitVersion(s, step);
+    }
+}
+
+void ParamManager::ReleaseStates(){
+  for(int ownerid: ownerids_)
+    for(shared_ptr<Param> param: slot(ownerid)->shares)
+      param->ReleaseState();
+}
+
+void ParamManager:: SendParamsToServers(int step){
+  // the weights are sent without copying, hence the updates must be done
+  WaitUpdates(step);
+  if(update_on_server_)
+    ReleaseStates();
+  for(int ownerid: ownerids_){
+    ParamSlot* owner=slot(ownerid);
+    for(shared_ptr<Param> param: owner->shares){
+      for(shared_ptr<Param> p: SyncParams(param)){
+        int id=p->id();
+        zmsg_t* msg=zmsg_new();
+        PushHeader(msg, MsgHeader{kPut, id, 0, p->slice(), 0, p->size(), 0.f});
+        // the only message carrying the name and config of the Param
+        string proto;
+        p->proto().SerializeToString(&proto);
+        zmsg_addmem(msg, proto.data(), proto.size());
+        p->AddPinnedFrame(msg, p->mutable_cpu_data(), p->data().count());
+        Post(CommCmd{CommCmd::kSend, server(id), id, 0, 0.f}, msg);
+      }
+      if(!hogwild_||!owner->slices.empty())
         break;
     }
   }
+  Post(CommCmd{CommCmd::kFlush, -1, -1, 0, 0.f});
 }
 
-void ParamManager::GetParamsFromServers(int step){// will be blocked until recv all parameters.
-  for(auto &entry: ownerid2Params_){
-    int id=entry.first;
-    for(shared_ptr<Param> p:entry.second){
-      zmsg_t* msg=zmsg_new();
-      zmsg_addstrf(msg, "%d", kGet);
-      zmsg_addstrf(msg,"%d",id);
-      zmsg_addstrf(msg,"%s",p->name().c_str());
-      router_->Send(msg, id%Cluster::Get()->nservers());
-      if(!hogwild_)
+void ParamManager::GetParamsFromServers(int step){
+  // the replies overwrite the weights, hence the local (warmup) updates
+  // must be done and no frame may reference the weights
+  WaitUpdates(step);
+  if(update_on_server_)
+    ReleaseStates();
+  for(int ownerid: ownerids_)
+    for(shared_ptr<Param> param: slot(ownerid)->shares)
+      param->WaitUnpinned();
+  vector<shared_ptr<Param>> params;
+  for(int ownerid: ownerids_){
+    ParamSlot* owner=slot(ownerid);
+    for(shared_ptr<Param> param: owner->shares){
+      for(shared_ptr<Param> p: SyncParams(param))
+        params.push_back(p);
+      if(!hogwild_||!owner->slices.empty())
         break;
     }
   }
-  size_t nrecv=0, ntotal=hogwild_?paramid2version_.size():ownerid2Params_.size();
-  int id, type;
-  while(nrecv<ntotal){
-    zmsg_t* msg=router_->Recv();
-    char* typestr=zmsg_popstr(msg); sscanf(typestr, "%d", &type); delete typestr;
-    CHECK_EQ(type, kGet);
-    char* idstr=zmsg_popstr(msg);  sscanf(idstr, "%d", &id); delete idstr;
-    CHECK(paramid2Param_.find(id)!=paramid2Param_.end());
-    char* name=zmsg_popstr(msg); //name
-    CHECK_STREQ(name, paramid2Param_[id]->name().c_str());
-    delete name;
-    zframe_t* dat=zmsg_pop(msg);
-    shared_ptr<Param> p=paramid2Param_[id];
-    CHECK_EQ(zframe_size(dat), p->data().count()*sizeof(float));
-    memcpy(p->mutable_cpu_data(), zframe_data(dat), zframe_size(dat));
-    zframe_destroy(&dat);
-    zmsg_destroy(&msg);
-    nrecv++;
-    paramid2version_[p->id()]=step;
-    if(!hogwild_){
-      for(shared_ptr<Param>p: ownerid2Params_.at(p->owner()->id())){
-        paramid2version_[p->id()]=step;
-      }
-    }
+  {
+    std::unique_lock<std::mutex> lck(get_mtx_);
+    pending_gets_=params.size();
   }
+  for(shared_ptr<Param> p: params){
+    int id=p->id();
+    zmsg_t* msg=zmsg_new();
+    PushHeader(msg, MsgHeader{kGet, id, step, p->slice(), 0, 0, 0.f});
+    Post(CommCmd{CommCmd::kSend, server(id), id, step, 0.f}, msg);
+  }
+  Post(CommCmd{CommCmd::kFlush, -1, -1, 0, 0.f});
+  // replies are applied by the comm thread
+  std::unique_lock<std::mutex> lck(get_mtx_);
+  get_cv_.wait(lck, [&]{return pending_gets_==0;});
 }
-bool ParamManager::SyncNow(int step){
+bool ParamManager::SyncNow(int step, shared_ptr<Param> param){
   return Cluster::Get()->nservers()
-    &&(step+1)%sync_frequency_==0
+    &&!update_on_server_
+    &&(step+1)%sync_group(param->owner()->id())->sync_frequency==0
     &&step>warmup_steps_;
 }
+bool ParamManager::UpdateOnServer(int step){
+  return update_on_server_&&step>=warmup_steps_;
+}
 void ParamManager::UpdateParam(shared_ptr<Param> param, int step, int local_threadid){
-  bool sync=SyncNow(step+1);
-  if(hogwild_||ownerid2Params_[param->owner()->id()].size()==1){
+  if(updaters_.empty()){
+    ExecUpdate(param, step);
+    return;
+  }
+  std::unique_lock<std::mutex> lck(task_mtx_);
+  tasks_.push(UpdateTask{param, step, 0, 0});
+  task_cv_.notify_one();
+}
+
+bool ParamManager::RunUpdateTask(bool block){
+  UpdateTask task;
+  {
+    std::unique_lock<std::mutex> lck(task_mtx_);
+    if(block)
+      task_cv_.wait(lck, [&]{return !running_||!tasks_.empty();});
+    if(tasks_.empty())
+      return false;
+    task=tasks_.top();
+    tasks_.pop();
+    if(task.len>0)
+      nslicetasks_--;
+  }
+  if(task.len>0)
+    ReduceSlice(task);
+  else
+    ExecUpdate(task.param, task.step);
+  return true;
+}
+
+void ParamManager::RunUpdater(){
+  while(RunUpdateTask(true));
+}
+
+void ParamManager::ExecUpdate(shared_ptr<Param> param, int step){
+  if(update_on_server_){
+    PushGradients(param, step);
+    return;
+  }
+  bool sync=SyncNow(step+1, param);
+  ParamSlot* owner=slot(param->owner()->id());
+  // hogwild shares update the same slices, which are synced once by the
+  // first share; its replies set the versions of all shares
+  if(sync&&hogwild_&&!owner->slices.empty()&&param!=owner->shares.at(0))
+    sync=false;
+  if(hogwild_||owner->shares.size()==1){
+    param->WaitUnpinned();
     updater_->Update( step, param);
-    paramid2version_[param->id()]=step+(sync==false);
+    SetVersion(param->id(), step+(sync==false));
   }else{
-    bool update=false;
-    const auto& shares =ownerid2Params_[param->owner()->id()];
+    // the last share whose gradients are ready aggregates all shares
+    if(++owner->arrivals==static_cast<int>(owner->shares.size()))
+      ScatterReduce(owner->shares, step);
+    return;
+  }
+  if(sync)
+    PostSync(param, step);
+}
+
+void ParamManager::ScatterReduce(const vector<shared_ptr<Param>>& shares,
+    int step){
+  shared_ptr<Param> param=shares.at(0);
+  ParamSlot* owner=slot(param->owner()->id());
+  int count=param->size();
+  // the weights (or gradients) are not changed until the last msg is sent
+  param->WaitUnpinned();
+  if(!UpdateOnServer(step))
+    updater_->InitState(param);
+  // one slice per sharing thread, aligned to 16 floats for vectorization
+  int nslices=std::max(1, std::min(static_cast<int>(shares.size()),
+        count/kMinReduceSlice));
+  int len=((count+nslices-1)/nslices+15)/16*16;
+  nslices=(count+len-1)/len;
+  owner->arrivals=0;
+  owner->pending=nslices;
+  if(nslices>1){
+    // slices are run by updater threads (if any) and the other sharing
+    // threads, which wait for the Param in WaitUpdate
     {
-      std::unique_lock<std::mutex> lck(mtx_);
-      aggregatedUpdates_[param->owner()->id()]++;
-      update=aggregatedUpdates_[param->owner()->id()] == shares.size();
+      std::unique_lock<std::mutex> lck(task_mtx_);
+      for(int k=1;k<nslices;k++)
+        tasks_.push(UpdateTask{param, step, k*len,
+            std::min(len, count-k*len)});
+      nslicetasks_+=nslices-1;
+      task_cv_.notify_all();
+    }
+    for(shared_ptr<Param> p: shares){
+      ParamSlot* s=slot(p->id());
+      std::unique_lock<std::mutex> lck(s->mtx);
+      s->cv.notify_all();
     }
-    if(update){
-      paramid2version_[shares.at(0)->id()]=step+1;
-      float* accumgrad=shares.at(0)->mutable_cpu_grad();
-      int len=shares.at(0)->data().count();
-      for(size_t k=1;k<shares.size();k++){
-        paramid2version_[shares.at(k)->id()]=step+(sync==false);
-        float* grad=shares.at(k)->mutable_cpu_grad();
-        for(int i=0;i<len;i++)
-          accumgrad[i]+=grad[i];
-      }
-      updater_->Update(step,shares.at(0), 1.0f/shares.size());
-      aggregatedUpdates_[param->owner()->id()]=0;
-      param=shares.at(0);
-    }else
-      sync=false;
   }
-  if(sync){
-    zmsg_t *msg=nullptr;
-    if(moving_rate_)
-      msg=param->GenSyncMsgFromWorker(moving_rate_);
-    else
-      msg=param->GenSyncMsgFromWorker(sample_ratio_);
-    zmsg_pushstrf(msg, "%d", param->id());
-    zmsg_pushstrf(msg, "%d", kSync);
-    router_->Send(msg, param->id()%Cluster::Get()->nservers());
+  ReduceSlice(UpdateTask{param, step, 0, std::min(len, count)});
+  // run the slices no other thread has taken yet
+  while(owner->pending>0&&RunUpdateTask(false));
+}
+
+void ParamManager::ReduceSlice(const UpdateTask& task){
+  ParamSlot* owner=slot(task.param->owner()->id());
+  const auto& shares=owner->shares;
+  mshadow::Shape<1> s=mshadow::Shape1(task.len);
+  mshadow::Tensor<mshadow::cpu, 1> accum(
+      shares.at(0)->mutable_cpu_grad()+task.offset, s);
+  for(size_t k=1;k<shares.size();k++)
+    accum+=mshadow::Tensor<mshadow::cpu, 1>(
+        shares.at(k)->mutable_cpu_grad()+task.offset, s);
+  bool push=UpdateOnServer(task.step);
+  if(!push)
+    updater_->UpdateSlice(task.step, shares.at(0), 1.0f/shares.size(),
+        task.offset, task.len);
+  if(--owner->pending>0)
+    return;
+  // the last slice; versions are set after the whole Param is updated, or
+  // by the reply of the server if the gradients are pushed
+  if(push){
+    Post(CommCmd{CommCmd::kPush, -1, shares.at(0)->id(), task.step,
+        1.0f/shares.size()});
+    return;
   }
+  bool sync=SyncNow(task.step+1, shares.at(0));
+  SetVersion(shares.at(0)->id(), task.step+1);
+  for(size_t k=1;k<shares.size();k++)
+    SetVersion(shares.at(k)->id(), task.step+(sync==false));
+  if(sync)
+    PostSync(shares.at(0), task.step);
+}
+
+void ParamManager::PostSync(shared_ptr<Param> param, int step){
+  ParamSlot* owner=slot(param->owner()->id());
+  owner->syncposted=zclock_usecs();
+  owner->syncversion=step+1;
+  // the sync msgs are generated and sent by the comm thread
+  Post(CommCmd{CommCmd::kSync, -1, param->id(), step, 0.f});
+}
+
+void ParamManager::PushGradients(shared_ptr<Param> param, int step){
+  ParamSlot* owner=slot(param->owner()->id());
+  const auto& shares=owner->shares;
+  if(!hogwild_&&shares.size()>1){
+    // the last share whose gradients are ready aggregates all shares in
+    // parallel slices, and the last slice pushes the sum
+    if(++owner->arrivals==static_cast<int>(shares.size()))
+      ScatterReduce(shares, step);
+    return;
+  }
+  if(!UpdateOnServer(step)){
+    // params are put onto servers after warmup, hence warmup steps are
+    // updated locally
+    param->WaitUnpinned();
+    updater_->Update(step, param);
+    SetVersion(param->id(), step+1);
+    return;
+  }
+  Post(CommCmd{CommCmd::kPush, -1, param->id(), step, 1.0f});
 }
 
 void ParamManager::WaitUpdate(shared_ptr<Param> param, int step, int local_threadid){
-  if(SyncNow(step)){
-    while(paramid2version_[param->id()]<step){
-      zmsg_t* msg=router_->Recv();
-      char* typestr=zmsg_popstr(msg);
-      int type;
-      sscanf(typestr, "%d", &type);
-      delete typestr;
-      CHECK_EQ(type, kSync);
-
-      char* idstr=zmsg_popstr(msg);
-      int id;
-      sscanf(idstr, "%d", &id);
-      delete idstr;
-
-      CHECK(paramid2Param_.find(id)!=paramid2Param_.end());
-      paramid2Param_[id]->ParseSyncMsgFromPS(&msg);
-      zmsg_destroy(&msg);
-      paramid2version_[id]=step;
-      int ownerid=paramid2Param_[id]->owner()->id();
-      if(!hogwild_){
-        for(shared_ptr<Param>p: ownerid2Params_[ownerid]){
-          paramid2version_[p->id()]=step;
-        }
+  if(SyncNow(step, param)||UpdateOnServer(step-1))
+    Post(CommCmd{CommCmd::kFlush, -1, -1, 0, 0.f});
+  ParamSlot* s=slot(param->id());
+  // help the updater threads instead of idling
+  while(s->version<step){
+    if(!RunUpdateTask(false)){
+      // woken up by the updater or comm thread once the Param is updated,
+      // or to reduce slices of shared Params
+      int64_t tick=zclock_usecs();
+      WaitVersion(s, step);
+      // only the time waiting for the sync reply is counted, not the time
+      // waiting for updater threads
+      ParamSlot* owner=slot(param->owner()->id());
+      if(!sync_groups_.empty()&&owner->syncversion==step){
+        int64_t start=std::max(tick, owner->syncposted.load());
+        sync_group(owner->ownerid)->blocked+=
+          std::max<int64_t>(0, zclock_usecs()-start);
       }
     }
   }
-    // wait to recv param ready singal
-  while(paramid2version_[param->id()]<step)
-    Sleep(5);
+  // frames of the last iteration must be sent before the data or gradients
+  // are overwritten
+  param->WaitUnpinned();
 }
 }
@@ -0,0 +1,168 @@
+#include <glog/logging.h>
+#include "worker/scheduler.h"
+#include "utils/cluster.h"
+
+namespace singa{
+LayerScheduler::LayerScheduler(int nthreads){
+  CHECK_GT(nthreads, 0);
+  graph_=nullptr;
+  func_=nullptr;
+  remaining_=0;
+  events_=runs_=0;
+  running_=true;
+  for(int i=0;i<nthreads;i++)
+    queues_.push_back(std::make_shared<TaskQueue>());
+  // thread 0 is the thread calling Run
+  for(int i=1;i<nthreads;i++)
+    threads_.push_back(std::thread(&LayerScheduler::RunThread, this, i));
+}
+
+LayerScheduler::~LayerScheduler(){
+  {
+    std::unique_lock<std::mutex> lck(mtx_);
+    running_=false;
+    cv_.notify_all();
+  }
+  for(auto& th: threads_)
+    th.join();
+}
+
+TaskGraph* LayerScheduler::graph(shared_ptr<NeuralNet> net, bool backward){
+  auto key=std::make_pair(static_cast<const NeuralNet*>(net.get()), backward);
+  auto it=graphs_.find(key);
+  if(it!=graphs_.end())
+    return it->second.get();
+  return BuildGraph(net, backward);
+}
+
+TaskGraph* LayerScheduler::BuildGraph(shared_ptr<NeuralNet> net,
+    bool backward){
+  auto cluster=Cluster::Get();
+  auto graph=std::make_shared<TaskGraph>();
+  map<const Layer*, int> layer2task;
+  for(shared_ptr<Layer> layer: net->layers()){
+    if(cluster->group_procsid(layer->locationid())==cluster->group_procsid()){
+      layer2task[layer.get()]=graph->tasks.size();
+      graph->tasks.push_back(std::unique_ptr<LayerTask>(new LayerTask()));
+      graph->tasks.back()->layer=layer;
+      graph->tasks.back()->ndeps=0;
+    }
+  }
+  for(auto& task: graph->tasks){
+    // layers on other procs are waited for by pulling bridge layers
+    for(shared_ptr<Layer> dep: backward?task->layer->dstlayers()
+        :task->layer->srclayers()){
+      auto it=layer2task.find(dep.get());
+      if(it!=layer2task.end()){
+        graph->tasks[it->second]->successors.push_back(
+            layer2task[task->layer.get()]);
+        task->ndeps++;
+      }
+    }
+  }
+  for(size_t i=0;i<graph->tasks.size();i++)
+    if(graph->tasks[i]->ndeps==0)
+      graph->roots.push_back(i);
+  graphs_[std::make_pair(static_cast<const NeuralNet*>(net.get()), backward)]
+    =graph;
+  return graph.get();
+}
+
+void LayerScheduler::Run(TaskGraph* graph, const TaskFunc& func){
+  if(graph->tasks.empty())
+    return;
+  for(auto& task: graph->tasks)
+    task->pending=task->ndeps;
+  remaining_=graph->tasks.size();
+  {
+    std::unique_lock<std::mutex> lck(mtx_);
+    graph_=graph;
+    func_=&func;
+    runs_++;
+  }
+  // spread the roots, e.g., data layers of different partitions
+  int nthreads=queues_.size();
+  for(size_t i=0;i<graph->roots.size();i++){
+    TaskQueue* q=queues_[i%nthreads].get();
+    std::unique_lock<std::mutex> lck(q->mtx);
+    q->tasks.push_back(graph->roots[i]);
+  }
+  {
+    std::unique_lock<std::mutex> lck(mtx_);
+    events_++;
+    cv_.notify_all();
+  }
+  Execute(0);
+}
+
+void LayerScheduler::RunThread(int threadid){
+  int64_t runs=0;
+  while(true){
+    {
+      std::unique_lock<std::mutex> lck(mtx_);
+      cv_.wait(lck, [&]{return !running_||runs_!=runs;});
+      if(!running_) break;
+      runs=runs_;
+    }
+    Execute(threadid);
+  }
+}
+
+void LayerScheduler::Execute(int threadid){
+  int task;
+  while(remaining_>0){
+    int64_t events;
+    {
+      std::unique_lock<std::mutex> lck(mtx_);
+      if(!running_) return;
+      events=events_;
+    }
+    if(PopTask(threadid, &task)){
+      (*func_)(graph_->tasks[task]->layer, threadid);
+      FinishTask(threadid, task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lck(mtx_);
+    cv_.wait(lck, [&]{return !running_||remaining_==0||events_!=events;});
+  }
+}
+
+bool LayerScheduler::PopTask(int threadid, int* task){
+  int nthreads=queues_.size();
+  // own queue first (newest task), then steal from others (oldest task)
+  for(int k=0;k<nthreads;k++){
+    TaskQueue* q=queues_[(threadid+k)%nthreads].get();
+    std::unique_lock<std::mutex> lck(q->mtx);
+    if(q->tasks.empty())
+      continue;
+    if(k==0){
+      *task=q->tasks.back();
+      q->tasks.pop_back();
+    }else{
+      *task=q->tasks.front();
+      q->tasks.pop_front();
+    }
+    return true;
+  }
+  return false;
+}
+
+void LayerScheduler::FinishTask(int threadid, int task){
+  int nready=0;
+  TaskQueue* q=queues_[threadid].get();
+  for(int succ: graph_->tasks[task]->successors){
+    if(--graph_->tasks[succ]->pending==0){
+      std::unique_lock<std::mutex> lck(q->mtx);
+      q->tasks.push_back(succ);
+      nready++;
+    }
+  }
+  bool done=--remaining_==0;
+  // a single ready task is run by this thread, no need to wake up others
+  if(done||nready>1){
+    std::unique_lock<std::mutex> lck(mtx_);
+    events_++;
+    cv_.notify_all();
+  }
+}
+}  // namespace singa
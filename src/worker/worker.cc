@@ -13,6 +13,7 @@ Worker::Worker(shared_ptr<Cluster> cluster){
 
 void Worker::Start(ModelProto model){
   LOG(ERROR)<<"Worker on "<<cluster_->hostname()<<" is starting...";
+  // constructed first, hence its GEMMs tune the BLAS threads if autotuned
   train_net_=SetupNeuralNet(model.neuralnet(), model.prefetch(), kTrain);
   if(model.test_steps()){
     test_net_=SetupNeuralNet(model.neuralnet(), model.prefetch(), kTest);
@@ -29,14 +30,8 @@ void Worker::Start(ModelProto model){
   pm_=make_shared<ParamManager>(train_net_, model.updater());
   pm_->InitParams(); //init local params
 
-  Setup(0, model); //setup main executor
-  int nthreads=cluster_->nthreads_per_procs();
-  vector<Executor*> executors(nthreads-1);
-  vector<thread> threads;
-  for(size_t i=1;i<executors.size();i++){
-    executors[i]=new Executor(i, model,  cluster_,pm_, train_net_);
-    threads.push_back(thread(&Executor::Run, executors[i], 0));
-  }
+  // layers of all local partitions are run by the scheduler threads
+  Setup(0, model);
 
   // warmup to get computation speed
   Performance perf(train_net_);
@@ -49,17 +44,12 @@ void Worker::Start(ModelProto model){
 
   if(cluster_->nservers()){
     if(cluster_->groupid()==0)
-      pm_->SendParamsToServers();
+      pm_->SendParamsToServers(model.updater().warmup_steps());
     else
       pm_->GetParamsFromServers(model.updater().warmup_steps());
   }
 
   Run(model.updater().warmup_steps());
-  for(auto& th: threads)
-    th.join();
-  for(size_t i=1;i<executors.size();i++){
-    delete executors[i];
-  }
 }
 
 void Worker::Resume() {
@@ -70,6 +60,10 @@ shared_ptr<NeuralNet> Worker::SetupNeuralNet(const NetProto& np, bool prefetch,
     Phase phase){
   NetProto proto;
   proto.set_partition_type(np.partition_type());
+  proto.set_autotune(np.autotune());
+  proto.set_autotune_cache(np.autotune_cache());
+  proto.set_fuse_layers(np.fuse_layers());
+  proto.set_inplace(np.inplace());
   // exclude layers if necessary
   for(auto& layer:np.layer()){
     bool include=true;
@@ -124,32 +118,38 @@ void Executor::Setup(int local_threadid, const ModelProto& model){
   tForward_=tBackward_=tSyncData_=tSyncParam_=0;
   modelproto_=model;
   local_threadid_=local_threadid;
+  scheduler_=std::make_shared<LayerScheduler>(cluster_->nthreads_per_procs());
+  int procsid=cluster_->group_procsid();
   if(model.prefetch()){
     for(auto& layer: train_net_->datalayers()){
-      if(cluster_->group_threadid(local_threadid_)==layer->locationid())
+      if(cluster_->group_procsid(layer->locationid())==procsid)
         localDataLayers_.push_back(layer);
     }
     if(localDataLayers_.size())
       prefetch_thread_=std::thread(Executor::PrefetchData,
           std::ref(localDataLayers_), true,1);
   }
-  int gthreadid=cluster_->group_threadid(local_threadid);
 
-  // for transfer data due to Model Partition
+  // for transfer data due to Model Partition; one pull socket per procs
+  pull_=nullptr;
   for(auto& layer: train_net_->layers()){
-    if(layer->locationid()==gthreadid){
+    if(cluster_->group_procsid(layer->locationid())==procsid){
       int pushloc=-1;
       if(layer->is_bridgesrclayer())
         pushloc=layer->dstlayers()[0]->locationid();
       else if(layer->is_bridgedstlayer())
         pushloc=layer->srclayers()[0]->locationid();
-      if(pushloc!=-1&&push_.find(pushloc)==push_.end()){
-        string endpoint="@tcp://*:"+cluster_->pull_port(local_threadid);
+      if(pushloc==-1)
+        continue;
+      if(pull_==nullptr){
+        string endpoint="@tcp://*:"+cluster_->pull_port(0);
         pull_=zsock_new_pull(endpoint.c_str());
-        string pushaddr=cluster_->group_thread_addr(pushloc);
-        endpoint=">tcp://"+pushaddr
-            +":"+cluster_->pull_port(pushloc%cluster_->nthreads_per_procs());
-        push_[pushloc]= zsock_new_push(endpoint.c_str());
+      }
+      int pushprocs=cluster_->group_procsid(pushloc);
+      if(push_.find(pushprocs)==push_.end()){
+        string endpoint=">tcp://"+cluster_->group_thread_addr(pushloc)
+            +":"+cluster_->pull_port(0);
+        push_[pushprocs]=zsock_new_push(endpoint.c_str());
       }
     }
   }
@@ -190,6 +190,9 @@ void Executor::RunOneBatch(int step, Performance* perf){
   // Test will call Pull which updates the sync time
   // Hence we store the sync time, and restore it later
   float tSyncData=tSyncData_, tSyncParam=tSyncParam_;
+  // the test nets share the weights, which are updated asynchronously
+  if(ValidateNow(step)||TestNow(step))
+    pm_->WaitUpdates(step);
   if(ValidateNow(step)){
     LOG(ERROR)<<"Validation at step "<<step;
     Test(validation_net_, modelproto_.validation_steps(), perf!=nullptr);
@@ -238,67 +241,82 @@ void Executor::Pull(zsock_t* pull, shared_ptr<NeuralNet> net){
 }
 
 void Executor::Forward(shared_ptr<NeuralNet> net, int step,  bool training){
-  auto& layers=net->layers();
-  for(auto& layer: layers){
-    if(cluster_->group_procsid(layer->locationid())==cluster_->group_procsid()){
-      if(layer->is_bridgedstlayer()){
-        auto* dst=static_cast<BridgeDstLayer*>(layer.get());
-        while(!dst->ready())
-          Pull(pull_, train_net_);
-      }
-      if(training){
-        for(shared_ptr<Param> p: layer->GetParams()){
-          pm_->WaitUpdate(p, step, local_threadid_);
-        }
-      }
-      layer->ComputeFeature(training);
-      if(layer->is_bridgesrclayer()){
-        zframe_t* frame=zframe_new(layer->data().cpu_data(),
-            layer->data().count()*sizeof(float));
-        zsock_send(push_[layer->locationid()], "isf",
-            kDataFrame, layer->dstlayers()[0]->name().c_str(), frame);
-        zframe_destroy(&frame);
-      }
-      if(training&&DisplayDebugInfo(step)&&layer->mutable_data()!=nullptr){
-        LOG(INFO)<<StringPrintf("Forward layer  %10s data norm1 %13.9f",
-            layer->name().c_str(), layer->data().asum_data());
-      }
-    }
-  }
+  scheduler_->Run(scheduler_->graph(net, false),
+      [&](shared_ptr<Layer> layer, int threadid){
+      ForwardLayer(layer, step, training, threadid);});
 }
 
 void Executor::Backward(shared_ptr<NeuralNet> net, int step){
-  auto& layers=net->layers();
-  for (auto it = layers.rbegin(); it != layers.rend(); it++){
-    shared_ptr<Layer> layer=*it;
-    if(cluster_->group_procsid(layer->locationid())==cluster_->group_procsid()){
-      if(layer->is_bridgesrclayer()){
-        auto* src=static_cast<BridgeSrcLayer*>(layer.get());
-        while(!src->ready())
-          Pull(pull_, train_net_);
-      }
-      layer->ComputeGradient();
-      if(DisplayDebugInfo(step)&&layer->mutable_grad()!=nullptr){
-        LOG(INFO)<<StringPrintf("Backward layer %10s grad norm1 %13.9f\t",
-            layer->name().c_str(), layer->grad().asum_data());
-        for(shared_ptr<Param> p: layer->GetParams())
-          LOG(INFO)<<StringPrintf("param id %2d, name %10s,\
-              value norm1 %13.9f, grad norm1 %13.9f",
-              p->id(), p->name().c_str(),
-              p->data().asum_data(), p->grad().asum_data());
-      }
-      for(shared_ptr<Param> p: layer->GetParams()){
-        pm_->UpdateParam(p, step, local_threadid_);
-      }
-      if(layer->is_bridgedstlayer()){
-        zframe_t* frame=zframe_new(layer->grad().cpu_data(),
-            layer->data().count()*sizeof(float));
-        zsock_send(push_[layer->locationid()], "isf",
-            kGradFrame, layer->srclayers()[0]->name().c_str(), frame);
-        zframe_destroy(&frame);
-      }
+  scheduler_->Run(scheduler_->graph(net, true),
+      [&](shared_ptr<Layer> layer, int threadid){
+      BackwardLayer(layer, step, threadid);});
+}
+
+void Executor::ForwardLayer(shared_ptr<Layer> layer, int step, bool training,
+    int threadid){
+  if(layer->is_bridgedstlayer()){
+    // frames pulled by one thread may be for layers of other threads
+    auto* dst=static_cast<BridgeDstLayer*>(layer.get());
+    std::unique_lock<std::mutex> lck(pull_mtx_);
+    while(!dst->ready())
+      Pull(pull_, train_net_);
+  }
+  if(training){
+    for(shared_ptr<Param> p: layer->GetParams()){
+      pm_->WaitUpdate(p, step, threadid);
     }
   }
+  layer->ComputeFeature(training);
+  if(layer->is_bridgesrclayer()){
+    // copied, because ZMQ sends asynchronously and the data could be
+    // overwritten before the frame is consumed
+    zmsg_t* msg=zmsg_new();
+    zmsg_addstrf(msg, "%d", kDataFrame);
+    zmsg_addstr(msg, layer->dstlayers()[0]->name().c_str());
+    zmsg_addmem(msg, layer->data().cpu_data(),
+        layer->data().count()*sizeof(float));
+    std::unique_lock<std::mutex> lck(push_mtx_);
+    SendMsg(push_[cluster_->group_procsid(
+          layer->dstlayers()[0]->locationid())], &msg);
+  }
+  if(training&&DisplayDebugInfo(step)&&layer->mutable_data()!=nullptr){
+    LOG(INFO)<<StringPrintf("Forward layer  %10s data norm1 %13.9f",
+        layer->name().c_str(), layer->data().asum_data());
+  }
+}
+
+void Executor::BackwardLayer(shared_ptr<Layer> layer, int step, int threadid){
+  if(layer->is_bridgesrclayer()){
+    auto* src=static_cast<BridgeSrcLayer*>(layer.get());
+    std::unique_lock<std::mutex> lck(pull_mtx_);
+    while(!src->ready())
+      Pull(pull_, train_net_);
+  }
+  layer->ComputeGradient();
+  if(DisplayDebugInfo(step)&&layer->mutable_grad()!=nullptr){
+    LOG(INFO)<<StringPrintf("Backward layer %10s grad norm1 %13.9f\t",
+        layer->name().c_str(), layer->grad().asum_data());
+    for(shared_ptr<Param> p: layer->GetParams())
+      LOG(INFO)<<StringPrintf("param id %2d, name %10s,\
+          value norm1 %13.9f, grad norm1 %13.9f",
+          p->id(), p->name().c_str(),
+          p->data().asum_data(), p->grad().asum_data());
+  }
+  // queued and run by updater threads, not blocking lower layers
+  for(shared_ptr<Param> p: layer->GetParams()){
+    pm_->UpdateParam(p, step, threadid);
+  }
+  if(layer->is_bridgedstlayer()){
+    // copied for the same reason as data frames
+    zmsg_t* msg=zmsg_new();
+    zmsg_addstrf(msg, "%d", kGradFrame);
+    zmsg_addstr(msg, layer->srclayers()[0]->name().c_str());
+    zmsg_addmem(msg, layer->grad().cpu_data(),
+        layer->data().count()*sizeof(float));
+    std::unique_lock<std::mutex> lck(push_mtx_);
+    SendMsg(push_[cluster_->group_procsid(
+          layer->srclayers()[0]->locationid())], &msg);
+  }
 }
 
 void Executor::TrainOneBatch(int step){
@@ -310,9 +328,12 @@ void Executor::TrainOneBatch(int step){
   }
   Forward(train_net_, step, true);
   tForward_+=zclock_mono()-tick;
+  int64_t start=tick;
   tick=zclock_mono();
   Backward(train_net_, step);
   tBackward_+=zclock_mono()-tick;
+  if(local_threadid_==0)
+    pm_->Tune(step, zclock_mono()-start);
 }
 
 void Executor::Test(shared_ptr<NeuralNet> net, int nsteps, bool disperf){
@@ -322,7 +343,7 @@ void Executor::Test(shared_ptr<NeuralNet> net, int nsteps, bool disperf){
     auto cluster=Cluster::Get();
     for(auto& layer: net->datalayers()){
       int locid=layer->locationid();
-      if(cluster->group_threadid(local_threadid_)==locid)
+      if(cluster->group_procsid(locid)==cluster->group_procsid())
         localDataLayers.push_back(layer);
     }
     if(localDataLayers.size())